@@ -0,0 +1,67 @@
+#include <WiFi.h>
+#include <OpenAI.h>
+
+const char* ssid = "your-SSID";
+const char* password = "your-PASSWORD";
+const char* api_key = "your-OPENAI_API_KEY";
+
+OpenAI openai(api_key);
+OpenAI_ChatCompletion chat(openai);
+OpenAI_Future<OpenAI_StringResponse> pending;
+bool waiting = false;
+unsigned long last_tick = 0;
+
+void setup(){
+  Serial.begin(115200);
+  WiFi.begin(ssid, password);
+  Serial.print("Connecting");
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(100);
+    Serial.print(".");
+  }
+  Serial.println();
+
+  openai.setAsync(4, 0);            //Up to 4 queued requests, worker task runs on core 0
+
+  chat.setModel("gpt-3.5-turbo");   //Model to use for completion. Default is gpt-3.5-turbo
+  chat.setSystem("Code geek");      //Description of the required assistant
+  chat.setMaxTokens(1000);          //The maximum number of tokens to generate in the completion.
+
+  Serial.println("You can now send chat message to OpenAI by typing in the Arduino IDE Serial Monitor.");
+  Serial.println("The loop keeps running while the reply is on its way.\n");
+}
+
+void loop() {
+  if(waiting && pending.ready()){
+    waiting = false;
+    OpenAI_StringResponse * result = pending.get();
+    if(result != NULL && result->length() > 0){
+      String response = result->getAt(0);
+      response.trim();
+      Serial.printf("\nReceived message. Tokens: %u\n", result->tokens());
+      Serial.println(response);
+    } else if(result != NULL && result->error()){
+      Serial.print("\nError! ");
+      Serial.println(result->error());
+    } else {
+      Serial.println("\nRequest could not be queued!");
+    }
+  }
+
+  if(waiting && (millis() - last_tick) > 500){
+    // Stands in for the UI/sensor work that used to be blocked
+    last_tick = millis();
+    Serial.print(".");
+  }
+
+  if(waiting || !Serial.available()){
+    return;
+  }
+  String line = Serial.readStringUntil('\n');
+  if(line.length() == 0){
+    return;
+  }
+  Serial.println(line);
+  pending = chat.messageAsync(line);
+  waiting = true;
+}
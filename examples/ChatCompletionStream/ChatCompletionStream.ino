@@ -0,0 +1,65 @@
+#include <WiFi.h>
+#include <OpenAI.h>
+
+const char* ssid = "your-SSID";
+const char* password = "your-PASSWORD";
+const char* api_key = "your-OPENAI_API_KEY";
+
+OpenAI openai(api_key);
+OpenAI_ChatCompletion chat(openai);
+
+void setup(){
+  Serial.begin(115200);
+  WiFi.begin(ssid, password);
+  Serial.print("Connecting");
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(100);
+    Serial.print(".");
+  }
+  Serial.println();
+
+  chat.setModel("gpt-3.5-turbo");   //Model to use for completion. Default is gpt-3.5-turbo
+  chat.setSystem("Code geek");      //Description of the required assistant
+  chat.setMaxTokens(1000);          //The maximum number of tokens to generate in the completion.
+  chat.setTemperature(0.2);         //float between 0 and 2. Higher value gives more random results.
+  chat.setUser("OpenAI-ESP32");     //A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
+
+  Serial.println("You can now send chat message to OpenAI by typing in the Arduino IDE Serial Monitor.");
+  Serial.println("The reply is printed while it is being generated.");
+  Serial.println("You can restart the conversation by typing \"clear\"\n");
+}
+
+void loop() {
+  String line = Serial.readStringUntil('\n');
+  if(line.length() == 0){
+    return;
+  }
+  if(line == "clear" || line == "clear\r"){
+    chat.clearConversation();
+    Serial.println("Conversation cleared!");
+    return;
+  }
+  Serial.println();
+  Serial.println(line);
+  Serial.println("Processing...");
+  unsigned long start = millis();
+  unsigned long first = 0;
+  OpenAI_StringResponse result = chat.streamMessage(line, [&](unsigned int index, const char * delta, const char * finish_reason){
+    if(!first){
+      first = millis();
+    }
+    Serial.print(delta);
+    if(finish_reason != NULL){
+      Serial.printf("\n[%s]\n", finish_reason);
+    }
+    return true;
+  });
+  if(result.length()){
+    Serial.printf("First token after %lu ms, reply after %lu ms\n", first - start, millis() - start);
+  } else if(result.error()){
+    Serial.print("Error! ");
+    Serial.println(result.error());
+  } else {
+    Serial.println("Unknown error!");
+  }
+}
@@ -22,6 +22,7 @@ void setup(){
   imageGeneration.setResponseFormat(OPENAI_IMAGE_RESPONSE_FORMAT_URL);  //The format in which the generated images are returned. URL or B64_JSON
   imageGeneration.setN(1);                                              //The number of images to generate. Must be between 1 and 10.
   imageGeneration.setUser("OpenAI-ESP32");                              //A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
+  //imageGeneration.setOutput(&file);                                  //Decodes B64_JSON images straight into a Print, i.e. a file opened for writing, instead of returning them
 
   Serial.println("You can now let OpenAI to generate an image based on prompt by typing in the Arduino IDE Serial Monitor.");
   Serial.println("Each line will be interpreted as new prompt and processed.");
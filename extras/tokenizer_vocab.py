@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# Converts a .tiktoken vocabulary (base64 token and rank per line, i.e. cl100k_base.tiktoken)
+# into the binary file used by OpenAI_Tokenizer.
+#
+#   python3 tokenizer_vocab.py cl100k_base.tiktoken cl100k_base.bin
+#
+# Put the output on the file system and load it with begin(fs, path), or flash it to a data
+# partition and pass the pointer from esp_partition_mmap() to begin(data, len).
+
+import base64
+import struct
+import sys
+
+MAGIC = 0x4B54414F  # "OATK"
+VERSION = 1
+
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("usage: %s <input.tiktoken> <output.bin>" % sys.argv[0])
+        return 1
+    ranks = {}
+    with open(sys.argv[1], "rb") as f:
+        for line in f:
+            line = line.strip()
+            if not line:
+                continue
+            token, rank = line.split()
+            ranks[int(rank)] = base64.b64decode(token)
+    count = max(ranks) + 1
+    buckets = 1
+    while buckets < count * 2:
+        buckets *= 2
+    offsets = [0]
+    data = bytearray()
+    for r in range(count):
+        data += ranks.get(r, b"")
+        offsets.append(len(data))
+    # Linear probing, rank + 1 per bucket. Ranks missing from the input stay out of the table
+    table = [0] * buckets
+    for r, token in ranks.items():
+        b = fnv1a(token) & (buckets - 1)
+        while table[b]:
+            b = (b + 1) & (buckets - 1)
+        table[b] = r + 1
+    with open(sys.argv[2], "wb") as f:
+        f.write(struct.pack("<5I", MAGIC, VERSION, count, buckets, len(data)))
+        f.write(struct.pack("<%dI" % len(offsets), *offsets))
+        f.write(struct.pack("<%dI" % len(table), *table))
+        f.write(data)
+    print("%d tokens, %d buckets, %d bytes" % (count, buckets, 20 + 4 * (len(offsets) + buckets) + len(data)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,552 +1,2175 @@
-/*
-  ToDo:
-    - Support FS::File as input
-    - Look into supporting "stream" responses?
-    - Thread-Safe API?
-*/
-
 #include "OpenAI.h"
 #include "HTTPClient.h"
+#include "StreamString.h"
+#include "OpenAI_JsonReader.h"
+#include "OpenAI_Body.h"
+#include "OpenAI_Base64.h"
+#include "OpenAI_EmbeddingCache.h"
+#include "OpenAI_ResponseCache.h"
+#include "OpenAI_Tokenizer.h"
+
+// true if the text is a complete JSON array, i.e. a list of prompts or inputs
+static bool isJsonArray(const String & text){
+  if(!text.startsWith("[")){
+    return false;
+  }
+  OpenAI_JsonReader reader;
+  reader.write((const uint8_t *)text.c_str(), text.length());
+  return reader.finish();
+}
+
+// Appends text as a quoted JSON string, for bodies that have to be kept as a copy
+static void appendJsonString(String & out, const char * text){
+  char esc[8];
+  out += '"';
+  const char * run = text;
+  for(const char * c = text; ; c++){
+    if(*c != 0 && *c != '"' && *c != '\\' && (uint8_t)*c >= 0x20){
+      continue;
+    }
+    // Plain runs are appended in one piece
+    out.concat(run, c - run);
+    if(*c == 0){
+      break;
+    }
+    switch(*c){
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        snprintf(esc, sizeof(esc), "\\u%04x", (uint8_t)*c);
+        out += esc;
+        break;
+    }
+    run = c + 1;
+  }
+  out += '"';
+}
+
+// Largest array index accepted for choices and images
+#define OPENAI_MAX_CHOICES 128
 
-// Macros for building the request
-#define reqAddString(var,val) \
-  if(cJSON_AddStringToObject(req, var, val) == NULL){ \
-    cJSON_Delete(req); \
-    log_e("cJSON_AddStringToObject failed!"); \
-    return result; \
+typedef struct {
+  char * data;
+  size_t len;
+  size_t size;
+} OpenAI_TextBuffer;
+
+static bool appendText(OpenAI_TextBuffer * b, const char * text, size_t l){
+  if(b->data == NULL || (b->len + l + 1) > b->size){
+    size_t size = (b->size)?b->size:64;
+    while(size < (b->len + l + 1)){
+      size *= 2;
+    }
+    char * d = (char*)openai_realloc(b->data, size, OPENAI_MEMORY_PARSER);
+    if(d == NULL){
+      log_e("Text could not be allocated");
+      return false;
+    }
+    b->data = d;
+    b->size = size;
   }
+  memcpy(b->data + b->len, text, l);
+  b->len += l;
+  b->data[b->len] = 0;
+  return true;
+}
 
-#define reqAddNumber(var,val) \
-  if(cJSON_AddNumberToObject(req, var, val) == NULL){ \
-    cJSON_Delete(req); \
-    log_e("cJSON_AddNumberToObject failed!"); \
-    return result; \
+static OpenAI_TextBuffer * textAt(OpenAI_TextBuffer ** list, unsigned int * len, unsigned int index){
+  if(index >= OPENAI_MAX_CHOICES){
+    log_e("Index %u out of range", index);
+    return NULL;
+  }
+  if(index >= *len){
+    OpenAI_TextBuffer * l = (OpenAI_TextBuffer*)openai_realloc(*list, (index + 1) * sizeof(OpenAI_TextBuffer), OPENAI_MEMORY_PARSER);
+    if(l == NULL){
+      log_e("Data could not be allocated");
+      return NULL;
+    }
+    memset(&l[*len], 0, (index + 1 - *len) * sizeof(OpenAI_TextBuffer));
+    *list = l;
+    *len = index + 1;
   }
+  return &(*list)[index];
+}
 
-#define reqAddBool(var,val) \
-  if(cJSON_AddBoolToObject(req, var, val) == NULL){ \
-    cJSON_Delete(req); \
-    log_e("cJSON_AddBoolToObject failed!"); \
-    return result; \
+static void freeTexts(OpenAI_TextBuffer * list, unsigned int len){
+  if(list != NULL){
+    for(unsigned int i = 0; i < len; i++){
+      openai_free(list[i].data);
+    }
+    openai_free(list);
   }
+}
 
-#define reqAddItem(var,val) \
-  if(!cJSON_AddItemToObject(req, var, val)){ \
-    cJSON_Delete(req); \
-    cJSON_Delete(val); \
-    log_e("cJSON_AddItemToObject failed!"); \
-    return result; \
+// A parsed response keeps all of its data in one block. It is taken from the buffer of the caller if it fits, else from the heap
+static uint8_t * arenaAlloc(void * buffer, size_t buffer_size, size_t size, bool & owned){
+  size_t pad = (8 - ((uintptr_t)buffer & 7)) & 7;
+  if(buffer != NULL && (pad + size) <= buffer_size){
+    owned = false;
+    return (uint8_t*)buffer + pad;
   }
+  if(buffer != NULL){
+    log_d("Response buffer is too small, %u bytes needed", pad + size);
+  }
+  owned = true;
+  return (uint8_t*)openai_malloc(size, OPENAI_MEMORY_RESPONSE);
+}
 
-static String getJsonError(cJSON * json){
-  if(json == NULL){
-    return String("cJSON_Parse failed!");
+// The table of the texts followed by the texts
+static char ** packTexts(OpenAI_TextBuffer * list, unsigned int len, void * buffer, size_t buffer_size, bool & owned){
+  size_t size = len * sizeof(char*);
+  for(unsigned int i = 0; i < len; i++){
+    size += list[i].len + 1;
   }
-  if(!cJSON_IsObject(json)){
-    return String("Response is not an object! " + String(cJSON_Print(json)));
+  char ** data = (char**)arenaAlloc(buffer, buffer_size, size, owned);
+  if(data == NULL){
+    log_e("Data could not be allocated");
+    return NULL;
   }
-  if(cJSON_HasObjectItem(json, "error")){
-    cJSON * error = cJSON_GetObjectItem(json, "error");
-    if(!cJSON_IsObject(error)){
-      return String("Error is not an object! " + String(cJSON_Print(error)));
-    }
-    if(!cJSON_HasObjectItem(error, "message")){
-      return String("Error does not contain message! " + String(cJSON_Print(error)));
+  char * p = (char*)&data[len];
+  for(unsigned int i = 0; i < len; i++){
+    data[i] = p;
+    if(list[i].len){
+      memcpy(p, list[i].data, list[i].len);
     }
-    cJSON * error_message = cJSON_GetObjectItem(error, "message");
-    return String(cJSON_GetStringValue(error_message));
+    p[list[i].len] = 0;
+    p += list[i].len + 1;
+  }
+  return data;
+}
+
+// Same layout, from the block of another response
+static char ** copyTexts(char ** texts, unsigned int len){
+  size_t size = len * sizeof(char*);
+  for(unsigned int i = 0; i < len; i++){
+    size += strlen(texts[i]) + 1;
   }
-  return String();
+  char ** data = (char**)openai_malloc(size, OPENAI_MEMORY_RESPONSE);
+  if(data == NULL){
+    return NULL;
+  }
+  memcpy(data, texts, size);
+  for(unsigned int i = 0; i < len; i++){
+    data[i] = (char*)data + (texts[i] - (char*)texts);
+  }
+  return data;
 }
 
+//
+// OpenAI_ResponseParser
+//
+
+// Base for the response parsers. Extracts "error.message" and checks that the response is an object
+class OpenAI_ResponseParser : public OpenAI_JsonReader {
+  protected:
+    String error_message;
+    bool has_error;
+    bool is_object;
+
+    void onBegin(OpenAI_Json_Container type){
+      if(depth() == 0){
+        is_object = (type == OPENAI_JSON_OBJECT);
+      } else if(match("error")){
+        has_error = true;
+      }
+    }
+    void onString(const char * data, size_t len, bool last){
+      if(match("error.message") || match("error")){
+        has_error = true;
+        error_message.concat(data, len);
+      }
+    }
+
+  public:
+    OpenAI_ResponseParser()
+      : has_error(false)
+      , is_object(false)
+    {}
+
+    void reset(){
+      OpenAI_JsonReader::reset();
+      error_message = "";
+      has_error = false;
+      is_object = false;
+    }
+
+    // Ends the document. Returns NULL if the response is valid, else a copy of the error
+    char * end(){
+      String error;
+      if(!finish()){
+        if(!received()){
+          log_e("Empty result!");
+          return NULL;
+        }
+        error = "JSON parse failed! " + String(OpenAI_JsonReader::error());
+      } else if(!is_object){
+        error = "Response is not an object!";
+      } else if(has_error){
+        error = error_message.length()?error_message:String("Error does not contain message!");
+      } else {
+        return NULL;
+      }
+      log_e("%s", error.c_str());
+      return openai_strdup(error.c_str(), OPENAI_MEMORY_RESPONSE);
+    }
+};
+
 //
 // OpenAI_EmbeddingResponse
 //
 
-OpenAI_EmbeddingResponse::OpenAI_EmbeddingResponse(const char * payload){
+static void freeEmbeddings(OpenAI_EmbeddingData * data, unsigned int len){
+  if(data){
+    for (unsigned int i = 0; i < len; i++){
+      openai_free(data[i].data);
+      openai_free(data[i].data_f32);
+      openai_free(data[i].data_i8);
+      openai_free(data[i].data_u8);
+    }
+    openai_free(data);
+  }
+}
+
+#define OPENAI_ALIGN8(n) (((n) + 7) & ~((size_t)7))
+
+// The table of the vectors followed by their values, each aligned for doubles
+static OpenAI_EmbeddingData * packEmbeddings(OpenAI_EmbeddingData * vectors, unsigned int len, void * buffer, size_t buffer_size, bool & owned){
+  size_t size = OPENAI_ALIGN8(len * sizeof(OpenAI_EmbeddingData));
+  for(unsigned int i = 0; i < len; i++){
+    OpenAI_EmbeddingData * v = &vectors[i];
+    size += OPENAI_ALIGN8(v->len * (v->data?sizeof(double):(v->data_f32?sizeof(float):1)));
+  }
+  OpenAI_EmbeddingData * data = (OpenAI_EmbeddingData*)arenaAlloc(buffer, buffer_size, size, owned);
+  if(data == NULL){
+    log_e("Data could not be allocated");
+    return NULL;
+  }
+  uint8_t * p = (uint8_t*)data + OPENAI_ALIGN8(len * sizeof(OpenAI_EmbeddingData));
+  for(unsigned int i = 0; i < len; i++){
+    OpenAI_EmbeddingData * v = &vectors[i];
+    OpenAI_EmbeddingData * d = &data[i];
+    *d = *v;
+    size_t l = 0;
+    if(v->data){
+      l = v->len * sizeof(double);
+      d->data = (double*)p;
+      memcpy(p, v->data, l);
+    } else if(v->data_f32){
+      l = v->len * sizeof(float);
+      d->data_f32 = (float*)p;
+      memcpy(p, v->data_f32, l);
+    } else if(v->data_i8){
+      l = v->len;
+      d->data_i8 = (int8_t*)p;
+      memcpy(p, v->data_i8, l);
+    } else if(v->data_u8){
+      l = v->len;
+      d->data_u8 = p;
+      memcpy(p, v->data_u8, l);
+    }
+    p += OPENAI_ALIGN8(l);
+  }
+  return data;
+}
+
+// Reads "data[].embedding[]" and "usage.total_tokens"
+class OpenAI_EmbeddingResponseParser : public OpenAI_ResponseParser {
+  private:
+    OpenAI_EmbeddingResponse & r;
+    std::vector<unsigned int> slots;  //Vector of the response for each input of the request. Empty if they are the same
+    std::vector<uint64_t> keys;       //Cache key of each input of the request
+    OpenAI_EmbeddingCache * cache;
+    float * cached;                   //Vector read from the cache
+    unsigned int cached_size;
+    unsigned int received_vectors;
+    OpenAI_EmbeddingData * vector;
+    unsigned int size;
+    float * scratch;              //Values of the current vector until it is quantized
+    unsigned int scratch_len;
+    unsigned int scratch_size;
+    OpenAI_Base64Decoder base64;  //encoding_format "base64" sends each vector as a string of float32
+    uint8_t bytes[4];
+    uint8_t bytes_len;
+    bool in_string;
+
+    // Makes room for one more value in a growing array
+    static bool reserve(void ** values, unsigned int len, unsigned int & size, size_t item){
+      if(len < size){
+        return true;
+      }
+      unsigned int s = (size)?(size * 2):256;
+      void * d = openai_realloc(*values, s * item, OPENAI_MEMORY_PARSER);
+      if(d == NULL){
+        return false;
+      }
+      *values = d;
+      size = s;
+      return true;
+    }
+
+    // Gives the unused end of a grown array back
+    static void shrink(void ** values, unsigned int len, unsigned int size, size_t item){
+      if(len < size && len){
+        void * d = openai_realloc(*values, len * item, OPENAI_MEMORY_PARSER);
+        if(d != NULL){
+          *values = d;
+        }
+      }
+    }
+
+    void quantize(){
+      if(!scratch_len){
+        return;
+      }
+      float lo = scratch[0], hi = scratch[0];
+      for(unsigned int i = 1; i < scratch_len; i++){
+        if(scratch[i] < lo){
+          lo = scratch[i];
+        }
+        if(scratch[i] > hi){
+          hi = scratch[i];
+        }
+      }
+      uint8_t * q = (uint8_t*)openai_malloc(scratch_len, OPENAI_MEMORY_PARSER);
+      if(q == NULL){
+        log_e("Embedding could not be allocated");
+        return;
+      }
+      if(r.prec == OPENAI_EMBEDDING_PRECISION_INT8){
+        // Symmetric, so that zero stays zero and dot products need no offset
+        float m = (-lo > hi)?-lo:hi;
+        vector->scale = (m > 0)?(m / 127.0f):1.0f;
+        vector->offset = 0;
+        for(unsigned int i = 0; i < scratch_len; i++){
+          ((int8_t*)q)[i] = (int8_t)lroundf(scratch[i] / vector->scale);
+        }
+        vector->data_i8 = (int8_t*)q;
+      } else {
+        vector->scale = (hi > lo)?((hi - lo) / 255.0f):1.0f;
+        vector->offset = lo;
+        for(unsigned int i = 0; i < scratch_len; i++){
+          q[i] = (uint8_t)lroundf((scratch[i] - lo) / vector->scale);
+        }
+        vector->data_u8 = q;
+      }
+      vector->len = scratch_len;
+    }
+
+    OpenAI_EmbeddingData * vectorAt(unsigned int i){
+      if(i >= r.len){
+        OpenAI_EmbeddingData * d = (OpenAI_EmbeddingData*)openai_realloc(r.data, (i + 1) * sizeof(OpenAI_EmbeddingData), OPENAI_MEMORY_PARSER);
+        if(d == NULL){
+          log_e("Data could not be allocated");
+          return NULL;
+        }
+        memset(&d[r.len], 0, (i + 1 - r.len) * sizeof(OpenAI_EmbeddingData));
+        r.data = d;
+        r.len = i + 1;
+      }
+      if(r.data[i].len){
+        log_e("Duplicate embedding %u", i);
+        return NULL;
+      }
+      return &r.data[i];
+    }
+
+    void beginVector(){
+      unsigned int i = index(1);
+      if(!slots.empty()){
+        if(i >= slots.size()){
+          log_e("Unexpected embedding %u", i);
+          vector = NULL;
+          return;
+        }
+        i = slots[i];
+      }
+      vector = vectorAt(i);
+      size = 0;
+      scratch_len = 0;
+      base64.reset();
+      bytes_len = 0;
+    }
+
+    void endVector(){
+      switch(r.prec){
+        case OPENAI_EMBEDDING_PRECISION_DOUBLE:
+          shrink((void**)&vector->data, vector->len, size, sizeof(double));
+          break;
+        case OPENAI_EMBEDDING_PRECISION_FLOAT:
+          shrink((void**)&vector->data_f32, vector->len, size, sizeof(float));
+          break;
+        default:
+          quantize();
+          break;
+      }
+      vector = NULL;
+    }
+
+    // Keeps the vector for the next time the same input is embedded
+    void store(){
+      unsigned int i = index(1);
+      if(cache == NULL || vector == NULL || i >= keys.size()){
+        return;
+      }
+      switch(r.prec){
+        case OPENAI_EMBEDDING_PRECISION_DOUBLE:
+          // The cache keeps float32, the scratch buffer is free with this precision
+          if(vector->len > scratch_size){
+            float * s = (float*)openai_realloc(scratch, vector->len * sizeof(float), OPENAI_MEMORY_PARSER);
+            if(s == NULL){
+              return;
+            }
+            scratch = s;
+            scratch_size = vector->len;
+          }
+          for(unsigned int v = 0; v < vector->len; v++){
+            scratch[v] = vector->data[v];
+          }
+          cache->put(keys[i], scratch, vector->len);
+          break;
+        case OPENAI_EMBEDDING_PRECISION_FLOAT:
+          cache->put(keys[i], vector->data_f32, vector->len);
+          break;
+        default:
+          // Before it is quantized
+          cache->put(keys[i], scratch, scratch_len);
+          break;
+      }
+    }
+
+    // Every value goes straight into the selected precision
+    void addValue(double value){
+      bool added = false;
+      switch(r.prec){
+        case OPENAI_EMBEDDING_PRECISION_DOUBLE:
+          if((added = reserve((void**)&vector->data, vector->len, size, sizeof(double)))){
+            vector->data[vector->len++] = value;
+          }
+          break;
+        case OPENAI_EMBEDDING_PRECISION_FLOAT:
+          if((added = reserve((void**)&vector->data_f32, vector->len, size, sizeof(float)))){
+            vector->data_f32[vector->len++] = value;
+          }
+          break;
+        default:
+          if((added = reserve((void**)&scratch, scratch_len, scratch_size, sizeof(float)))){
+            scratch[scratch_len++] = value;
+          }
+          break;
+      }
+      if(!added){
+        log_e("Embedding could not be allocated");
+        vector = NULL;
+      }
+    }
+
+  protected:
+    void onBegin(OpenAI_Json_Container type){
+      OpenAI_ResponseParser::onBegin(type);
+      if(type == OPENAI_JSON_ARRAY && match("data.#.embedding")){
+        beginVector();
+      }
+    }
+    void onEnd(OpenAI_Json_Container type){
+      if(vector != NULL && type == OPENAI_JSON_ARRAY && match("data.#.embedding")){
+        store();
+        endVector();
+        received_vectors++;
+      }
+    }
+    void onNumber(double value){
+      if(vector != NULL && match("data.#.embedding.#")){
+        addValue(value);
+      } else if(match("usage.total_tokens")){
+        r.usage += value;
+      }
+    }
+    void onString(const char * data, size_t len, bool last){
+      OpenAI_ResponseParser::onString(data, len, last);
+      if(!match("data.#.embedding")){
+        return;
+      }
+      if(vector == NULL && !in_string){
+        beginVector();
+      }
+      in_string = !last;
+      // Decoded in small steps, so a whole network read needs no large buffer
+      uint8_t buf[48];
+      while(vector != NULL && len){
+        size_t l = (len > 64)?64:len;
+        size_t n = base64.decode(data, l, buf);
+        data += l;
+        len -= l;
+        for(size_t i = 0; i < n && vector != NULL; i++){
+          bytes[bytes_len++] = buf[i];
+          if(bytes_len == 4){
+            // little-endian float32, same as the ESP32
+            float f;
+            memcpy(&f, bytes, 4);
+            addValue(f);
+            bytes_len = 0;
+          }
+        }
+      }
+      if(vector != NULL && last){
+        if(base64.failed() || base64.pending() || bytes_len){
+          log_e("Invalid base64 embedding");
+        } else {
+          store();
+        }
+        endVector();
+        received_vectors++;
+      }
+    }
+
+  public:
+    OpenAI_EmbeddingResponseParser(OpenAI_EmbeddingResponse & response, OpenAI_EmbeddingCache * c=NULL)
+      : r(response)
+      , cache(c)
+      , cached(NULL)
+      , cached_size(0)
+      , received_vectors(0)
+      , vector(NULL)
+      , size(0)
+      , scratch(NULL)
+      , scratch_len(0)
+      , scratch_size(0)
+      , bytes_len(0)
+      , in_string(false)
+    {}
+    ~OpenAI_EmbeddingResponseParser(){
+      if(scratch != NULL){
+        openai_free(scratch);
+      }
+      if(cached != NULL){
+        openai_free(cached);
+      }
+    }
+
+    // Input i of the batch is sent with the next request. Its vector goes to slot of the response
+    void expect(unsigned int slot, uint64_t key){
+      slots.push_back(slot);
+      if(cache != NULL){
+        keys.push_back(key);
+      }
+    }
+    unsigned int expected(){ return slots.size(); }
+    unsigned int vectors(){ return received_vectors; }     //Vectors read from the response
+
+    // Fills slot from the cache. false on a miss
+    bool fromCache(unsigned int slot, uint64_t key){
+      unsigned int len = cache->get(key, cached, cached_size);
+      if(len > cached_size){
+        float * c = (float*)openai_realloc(cached, len * sizeof(float), OPENAI_MEMORY_PARSER);
+        if(c == NULL){
+          log_e("Embedding could not be allocated");
+          return false;
+        }
+        cached = c;
+        cached_size = len;
+        len = cache->get(key, cached, cached_size);
+      }
+      if(!len || len > cached_size || (vector = vectorAt(slot)) == NULL){
+        return false;
+      }
+      size = 0;
+      scratch_len = 0;
+      for(unsigned int i = 0; i < len && vector != NULL; i++){
+        addValue(cached[i]);
+      }
+      if(vector == NULL){
+        return false;
+      }
+      endVector();
+      return true;
+    }
+
+    void end(){
+      r.error_str = OpenAI_ResponseParser::end();
+      if(r.error_str == NULL && received() && !received_vectors){
+        log_e("Data was not found");
+      }
+    }
+
+    // Moves the vectors of all batches into one block once the response is complete
+    static void pack(OpenAI_EmbeddingResponse & response, void * buffer=NULL, size_t size=0){
+      if(response.packed || !response.len){
+        return;
+      }
+      bool owned;
+      OpenAI_EmbeddingData * d = packEmbeddings(response.data, response.len, buffer, size, owned);
+      if(d == NULL){
+        return;
+      }
+      freeEmbeddings(response.data, response.len);
+      response.data = d;
+      response.packed = true;
+      response.owned = owned;
+    }
+};
+
+OpenAI_EmbeddingResponse::OpenAI_EmbeddingResponse(const char * payload, OpenAI_Embedding_Precision precision){
   usage = 0;
   len = 0;
   data = NULL;
+  prec = precision;
   error_str = NULL;
-  cJSON * u, *tokens, *d;
-  int dl;
+  packed = false;
+  owned = true;
 
   if(payload == NULL){
     return;
   }
 
-  // Parse payload
-  cJSON * json = cJSON_Parse(payload);
+  OpenAI_EmbeddingResponseParser parser(*this);
+  parser.write((const uint8_t *)payload, strlen(payload));
+  parser.end();
+  OpenAI_EmbeddingResponseParser::pack(*this);
+}
 
-  // Check for error
-  String error = getJsonError(json);
-  if(error.length()){
-    error_str = strdup(error.c_str());
-    if(json != NULL){
-      cJSON_Delete(json);
-    }
-    log_e("%s",error.c_str());
-    return;
+// Copy of the values, NULL stays NULL
+static void * copyValues(const void * values, size_t len){
+  if(values == NULL){
+    return NULL;
+  }
+  void * d = openai_malloc(len, OPENAI_MEMORY_RESPONSE);
+  if(d != NULL){
+    memcpy(d, values, len);
   }
+  return d;
+}
 
-  // Get total_tokens
-  if(!cJSON_HasObjectItem(json, "usage")){
-    log_e("Usage was not found");
-    goto end;
+OpenAI_EmbeddingResponse::OpenAI_EmbeddingResponse(OpenAI_EmbeddingResponse && other)
+  : usage(other.usage)
+  , len(other.len)
+  , data(other.data)
+  , prec(other.prec)
+  , error_str(other.error_str)
+  , packed(other.packed)
+  , owned(other.owned)
+{
+  other.len = 0;
+  other.data = NULL;
+  other.error_str = NULL;
+}
+
+void OpenAI_EmbeddingResponse::release(){
+  if(!packed){
+    freeEmbeddings(data, len);
+  } else if(owned){
+    openai_free(data);
   }
-  u = cJSON_GetObjectItem(json, "usage");
-  if(u == NULL || !cJSON_IsObject(u) || !cJSON_HasObjectItem(u, "total_tokens")){
-    log_e("Total tokens were not found");
-    goto end;
+  if(error_str != NULL){
+    openai_free(error_str);
   }
-  tokens = cJSON_GetObjectItem(u, "total_tokens");
-  if(tokens == NULL){
-    log_e("Total tokens could not be read");
-    goto end;
+}
+
+OpenAI_EmbeddingResponse & OpenAI_EmbeddingResponse::operator=(OpenAI_EmbeddingResponse && other){
+  if(this != &other){
+    release();
+    usage = other.usage;
+    len = other.len;
+    data = other.data;
+    prec = other.prec;
+    error_str = other.error_str;
+    packed = other.packed;
+    owned = other.owned;
+    other.len = 0;
+    other.data = NULL;
+    other.error_str = NULL;
   }
-  usage = cJSON_GetNumberValue(tokens);
+  return *this;
+}
 
-  // Parse data
-  if(!cJSON_HasObjectItem(json, "data")){
-    log_e("Data was not found");
-    goto end;
+OpenAI_EmbeddingResponse::~OpenAI_EmbeddingResponse(){
+  release();
+}
+
+OpenAI_EmbeddingResponse OpenAI_EmbeddingResponse::clone(){
+  OpenAI_EmbeddingResponse result(NULL, prec);
+  result.usage = usage;
+  if(error_str != NULL){
+    result.error_str = openai_strdup(error_str, OPENAI_MEMORY_RESPONSE);
   }
-  d = cJSON_GetObjectItem(json, "data");
-  if(d == NULL || !cJSON_IsArray(d)){
-    log_e("Data is not array");
-    goto end;
+  if(!len){
+    return result;
   }
-  dl = cJSON_GetArraySize(d);
-  if(dl <= 0){
-    log_e("Data is empty");
-    goto end;
+  result.data = packEmbeddings(data, len, NULL, 0, result.owned);
+  if(result.data != NULL){
+    result.len = len;
+    result.packed = true;
   }
-  data = (OpenAI_EmbeddingData*)malloc(dl * sizeof(OpenAI_EmbeddingData));
-  if(data == NULL){
-    log_e("Data could not be allocated");
-    goto end;
+  return result;
+}
+
+float OpenAI_EmbeddingResponse::valueAt(unsigned int index, unsigned int i){
+  if(index >= len || i >= data[index].len){
+    return 0;
+  }
+  OpenAI_EmbeddingData * d = &data[index];
+  switch(prec){
+    case OPENAI_EMBEDDING_PRECISION_DOUBLE: return d->data[i];
+    case OPENAI_EMBEDDING_PRECISION_FLOAT: return d->data_f32[i];
+    case OPENAI_EMBEDDING_PRECISION_INT8: return d->data_i8[i] * d->scale;
+    default: return d->data_u8[i] * d->scale + d->offset;
   }
-  for (int di = 0; di < dl; di++){
-    cJSON * ditem = cJSON_GetArrayItem(d, di);
-    if(ditem == NULL || !cJSON_IsObject(ditem) || !cJSON_HasObjectItem(ditem, "embedding")){
-      log_e("Embedding was not found");
-      goto end;
+}
+
+//
+// OpenAI_ModerationResponse
+//
+
+// Reads "results[].flagged"
+class OpenAI_ModerationResponseParser : public OpenAI_ResponseParser {
+  private:
+    OpenAI_ModerationResponse & r;
+
+  protected:
+    void onBool(bool value){
+      if(!match("results.#.flagged")){
+        return;
+      }
+      unsigned int i = index(1);
+      if(i >= OPENAI_MAX_CHOICES){
+        log_e("Index %u out of range", i);
+        return;
+      }
+      if(i >= r.len){
+        bool * d = (bool*)openai_realloc(r.data, (i + 1) * sizeof(bool), OPENAI_MEMORY_RESPONSE);
+        if(d == NULL){
+          log_e("Data could not be allocated");
+          return;
+        }
+        memset(&d[r.len], 0, (i + 1 - r.len) * sizeof(bool));
+        r.data = d;
+        r.len = i + 1;
+      }
+      r.data[i] = value;
+    }
+
+  public:
+    OpenAI_ModerationResponseParser(OpenAI_ModerationResponse & response)
+      : r(response)
+    {}
+
+    void end(){
+      r.error_str = OpenAI_ResponseParser::end();
+      if(r.error_str == NULL && received() && !r.len){
+        log_e("Results was not found");
+      }
+    }
+};
+
+OpenAI_ModerationResponse::OpenAI_ModerationResponse(const char * payload){
+  len = 0;
+  data = NULL;
+  error_str = NULL;
+
+  if(payload == NULL){
+    return;
+  }
+
+  OpenAI_ModerationResponseParser parser(*this);
+  parser.write((const uint8_t *)payload, strlen(payload));
+  parser.end();
+}
+
+OpenAI_ModerationResponse::OpenAI_ModerationResponse(OpenAI_ModerationResponse && other)
+  : len(other.len)
+  , data(other.data)
+  , error_str(other.error_str)
+{
+  other.len = 0;
+  other.data = NULL;
+  other.error_str = NULL;
+}
+
+OpenAI_ModerationResponse & OpenAI_ModerationResponse::operator=(OpenAI_ModerationResponse && other){
+  if(this != &other){
+    openai_free(data);
+    openai_free(error_str);
+    len = other.len;
+    data = other.data;
+    error_str = other.error_str;
+    other.len = 0;
+    other.data = NULL;
+    other.error_str = NULL;
+  }
+  return *this;
+}
+
+OpenAI_ModerationResponse::~OpenAI_ModerationResponse(){
+  if(data){
+    openai_free(data);
+  }
+  if(error_str != NULL){
+    openai_free(error_str);
+  }
+}
+
+OpenAI_ModerationResponse OpenAI_ModerationResponse::clone(){
+  OpenAI_ModerationResponse result(NULL);
+  if(error_str != NULL){
+    result.error_str = openai_strdup(error_str, OPENAI_MEMORY_RESPONSE);
+  }
+  if(len){
+    result.data = (bool*)copyValues(data, len * sizeof(bool));
+    if(result.data == NULL){
+      log_e("Data could not be allocated");
+      return result;
+    }
+    result.len = len;
+  }
+  return result;
+}
+
+//
+// OpenAI_ImageResponse
+//
+
+// Reads "data[].url" or "data[].b64_json".
+// With an output, "b64_json" is decoded and passed on in pieces as it arrives
+// and the response keeps an empty string for each image that was written
+class OpenAI_ImageResponseParser : public OpenAI_ResponseParser {
+  private:
+    OpenAI_ImageResponse & r;
+    OpenAI_TextBuffer * images;
+    unsigned int len;
+    void * buffer;
+    size_t buffer_size;
+    OpenAI_ImageCallback output;
+    OpenAI_Base64Decoder base64;
+    const char * output_error;
+    bool stopped;
+
+    void decode(const char * data, size_t l, bool last){
+      // Decoded in small steps, so a whole network read needs no large buffer
+      uint8_t bytes[48];
+      while(l){
+        size_t step = (l > 64)?64:l;
+        size_t n = base64.decode(data, step, bytes);
+        if(base64.failed()){
+          break;
+        }
+        if(n && !output(index(1), bytes, n)){
+          stopped = true;
+          return;
+        }
+        data += step;
+        l -= step;
+      }
+      if(base64.failed() || (last && base64.pending())){
+        output_error = "Image is not valid base64!";
+        stopped = true;
+        return;
+      }
+      if(last){
+        base64.reset();
+        textAt(&images, &len, index(1));
+      }
     }
-    cJSON * numberArray = cJSON_GetObjectItem(ditem, "embedding");
-    if(numberArray == NULL || !cJSON_IsArray(numberArray)){
-      log_e("Embedding is not array");
-      goto end;
+
+  protected:
+    void onString(const char * data, size_t l, bool last){
+      OpenAI_ResponseParser::onString(data, l, last);
+      if(stopped){
+        return;
+      }
+      if(output && match("data.#.b64_json")){
+        decode(data, l, last);
+      } else if(match("data.#.url") || match("data.#.b64_json")){
+        OpenAI_TextBuffer * b = textAt(&images, &len, index(1));
+        if(b != NULL){
+          appendText(b, data, l);
+        }
+      }
     }
-    int l = cJSON_GetArraySize(numberArray);
-    if(l <= 0){
-      log_e("Embedding is empty");
-      goto end;
+
+  public:
+    OpenAI_ImageResponseParser(OpenAI_ImageResponse & response, void * buf=NULL, size_t size=0, OpenAI_ImageCallback out=nullptr)
+      : r(response)
+      , images(NULL)
+      , len(0)
+      , buffer(buf)
+      , buffer_size(size)
+      , output(out)
+      , output_error(NULL)
+      , stopped(false)
+    {}
+    ~OpenAI_ImageResponseParser(){
+      freeTexts(images, len);
     }
-    data[di].data = (double*)malloc(l * sizeof(double));
-    if(data[di].data == NULL){
-      log_e("Embedding could not be allocated");
-      goto end;
+
+    // A short write makes HTTPClient drop the rest of the body once the output stops
+    size_t write(const uint8_t * buffer, size_t size){
+      if(stopped){
+        return 0;
+      }
+      size_t n = OpenAI_ResponseParser::write(buffer, size);
+      return stopped?0:n;
     }
-    len++;
-    data[di].len = l;
-    for (int i = 0; i < l; i++){
-      cJSON * item = cJSON_GetArrayItem(numberArray, i);
-      if(item == NULL){
-        log_e("Embedding item could not be read");
-        goto end;
+    size_t write(uint8_t c){ return write(&c, 1); }
+
+    void end(){
+      if(output_error != NULL){
+        log_e("%s", output_error);
+        r.error_str = openai_strdup(output_error, OPENAI_MEMORY_RESPONSE);
+        return;
+      }
+      if(stopped){
+        // The output cut the document short. The response lists the images that were completed
+        if(!len){
+          return;
+        }
+      } else {
+        r.error_str = OpenAI_ResponseParser::end();
+        if(r.error_str != NULL || !received()){
+          return;
+        }
+        if(!len){
+          log_e("Data was not found");
+          return;
+        }
+      }
+      r.data = packTexts(images, len, buffer, buffer_size, r.owned);
+      if(r.data != NULL){
+        r.len = len;
       }
-      data[di].data[i] = cJSON_GetNumberValue(item);
     }
+};
+
+// Writes the decoded images to out one after the other. Stops if out is full
+static OpenAI_ImageCallback imageOutput(Print * out){
+  if(out == NULL){
+    return nullptr;
   }
-end:
-  cJSON_Delete(json);
+  return [out](unsigned int index, const uint8_t * data, size_t len){
+    size_t written = out->write(data, len);
+    if(written != len){
+      log_e("Output took %u of %u bytes of image %u", written, len, index);
+      return false;
+    }
+    return true;
+  };
 }
 
-OpenAI_EmbeddingResponse::~OpenAI_EmbeddingResponse(){
-  if(data){
-    for (unsigned int i = 0; i < len; i++){
-      free(data[i].data);
+// An output needs the images as b64_json. Once it is cleared, the format chosen by the caller is sent again
+static void imageSetOutput(OpenAI_ImageCallback & output, uint8_t & response_format, uint8_t chosen_format, OpenAI_ImageCallback cb){
+  output = cb;
+  response_format = (output)?(uint8_t)OPENAI_IMAGE_RESPONSE_FORMAT_B64_JSON:chosen_format;
+}
+
+OpenAI_ImageResponse::OpenAI_ImageResponse(const char * payload){
+  len = 0;
+  data = NULL;
+  error_str = NULL;
+  owned = true;
+
+  if(payload == NULL){
+    return;
+  }
+
+  OpenAI_ImageResponseParser parser(*this);
+  parser.write((const uint8_t *)payload, strlen(payload));
+  parser.end();
+}
+
+OpenAI_ImageResponse::OpenAI_ImageResponse(OpenAI_ImageResponse && other)
+  : len(other.len)
+  , data(other.data)
+  , error_str(other.error_str)
+  , owned(other.owned)
+{
+  other.len = 0;
+  other.data = NULL;
+  other.error_str = NULL;
+}
+
+OpenAI_ImageResponse & OpenAI_ImageResponse::operator=(OpenAI_ImageResponse && other){
+  if(this != &other){
+    if(owned){
+      openai_free(data);
     }
-    free(data);
+    openai_free(error_str);
+    len = other.len;
+    data = other.data;
+    error_str = other.error_str;
+    owned = other.owned;
+    other.len = 0;
+    other.data = NULL;
+    other.error_str = NULL;
+  }
+  return *this;
+}
+
+OpenAI_ImageResponse::~OpenAI_ImageResponse(){
+  if(data != NULL && owned){
+    openai_free(data);
   }
   if(error_str != NULL){
-    free(error_str);
+    openai_free(error_str);
+  }
+}
+
+OpenAI_ImageResponse OpenAI_ImageResponse::clone(){
+  OpenAI_ImageResponse result(NULL);
+  if(error_str != NULL){
+    result.error_str = openai_strdup(error_str, OPENAI_MEMORY_RESPONSE);
+  }
+  if(len){
+    result.data = copyTexts(data, len);
+    if(result.data == NULL){
+      log_e("Data could not be allocated");
+      return result;
+    }
+    result.len = len;
   }
+  return result;
 }
 
 //
-// OpenAI_ModerationResponse
+// OpenAI_StringResponse
 //
 
-OpenAI_ModerationResponse::OpenAI_ModerationResponse(const char * payload){
+// Reads "choices[].text" or "choices[].message.content" and "usage.total_tokens"
+class OpenAI_StringResponseParser : public OpenAI_ResponseParser {
+  private:
+    OpenAI_StringResponse & r;
+    OpenAI_TextBuffer * choices;
+    unsigned int len;
+    void * buffer;
+    size_t buffer_size;
+
+  protected:
+    void onBegin(OpenAI_Json_Container type){
+      OpenAI_ResponseParser::onBegin(type);
+      if(match("choices.#")){
+        textAt(&choices, &len, index(1));
+      }
+    }
+    void onString(const char * data, size_t l, bool last){
+      OpenAI_ResponseParser::onString(data, l, last);
+      if(match("choices.#.text") || match("choices.#.message.content")){
+        OpenAI_TextBuffer * b = textAt(&choices, &len, index(1));
+        if(b != NULL){
+          appendText(b, data, l);
+        }
+      }
+    }
+    void onNumber(double value){
+      if(match("usage.total_tokens")){
+        r.usage = value;
+      }
+    }
+
+  public:
+    OpenAI_StringResponseParser(OpenAI_StringResponse & response, void * buf=NULL, size_t size=0)
+      : r(response)
+      , choices(NULL)
+      , len(0)
+      , buffer(buf)
+      , buffer_size(size)
+    {}
+    ~OpenAI_StringResponseParser(){
+      freeTexts(choices, len);
+    }
+
+    void end(){
+      r.error_str = OpenAI_ResponseParser::end();
+      if(r.error_str != NULL || !received()){
+        return;
+      }
+      if(!len){
+        log_e("Choices was not found");
+        return;
+      }
+      r.data = packTexts(choices, len, buffer, buffer_size, r.owned);
+      if(r.data != NULL){
+        r.len = len;
+      }
+    }
+};
+
+OpenAI_StringResponse::OpenAI_StringResponse(const char * payload){
+  usage = 0;
   len = 0;
   data = NULL;
   error_str = NULL;
-  cJSON *d;
-  int dl;
+  owned = true;
 
   if(payload == NULL){
     return;
   }
 
-  // Parse payload
-  cJSON * json = cJSON_Parse(payload);
+  OpenAI_StringResponseParser parser(*this);
+  parser.write((const uint8_t *)payload, strlen(payload));
+  parser.end();
+}
+
+OpenAI_StringResponse::OpenAI_StringResponse(OpenAI_StringResponse && other)
+  : usage(other.usage)
+  , len(other.len)
+  , data(other.data)
+  , error_str(other.error_str)
+  , owned(other.owned)
+{
+  other.len = 0;
+  other.data = NULL;
+  other.error_str = NULL;
+}
 
-  // Check for error
-  String error = getJsonError(json);
-  if(error.length()){
-    error_str = strdup(error.c_str());
-    if(json != NULL){
-      cJSON_Delete(json);
+OpenAI_StringResponse & OpenAI_StringResponse::operator=(OpenAI_StringResponse && other){
+  if(this != &other){
+    if(owned){
+      openai_free(data);
     }
-    log_e("%s",error.c_str());
-    return;
+    openai_free(error_str);
+    usage = other.usage;
+    len = other.len;
+    data = other.data;
+    error_str = other.error_str;
+    owned = other.owned;
+    other.len = 0;
+    other.data = NULL;
+    other.error_str = NULL;
   }
+  return *this;
+}
 
-  // Parse data
-  if(!cJSON_HasObjectItem(json, "results")){
-    log_e("Results was not found");
-    goto end;
+OpenAI_StringResponse::~OpenAI_StringResponse(){
+  if(data != NULL && owned){
+    openai_free(data);
   }
-  d = cJSON_GetObjectItem(json, "results");
-  if(d == NULL || !cJSON_IsArray(d)){
-    log_e("Results is not array");
-    goto end;
+  if(error_str != NULL){
+    openai_free(error_str);
   }
-  dl = cJSON_GetArraySize(d);
-  if(dl <= 0){
-    log_e("Results is empty");
-    goto end;
+}
+
+OpenAI_StringResponse OpenAI_StringResponse::clone(){
+  OpenAI_StringResponse result(NULL);
+  result.usage = usage;
+  if(error_str != NULL){
+    result.error_str = openai_strdup(error_str, OPENAI_MEMORY_RESPONSE);
   }
-  data = (bool*)malloc(dl * sizeof(bool));
-  if(data == NULL){
-    log_e("Data could not be allocated");
-    goto end;
+  if(len){
+    result.data = copyTexts(data, len);
+    if(result.data == NULL){
+      log_e("Choices could not be allocated");
+      return result;
+    }
+    result.len = len;
+  }
+  return result;
+}
+
+//
+// OpenAI_TextParser
+//
+
+// Reads the "text" of audio responses
+class OpenAI_TextParser : public OpenAI_ResponseParser {
+  private:
+    String text;
+
+  protected:
+    void onString(const char * data, size_t len, bool last){
+      OpenAI_ResponseParser::onString(data, len, last);
+      if(match("text")){
+        text.concat(data, len);
+      }
+    }
+
+  public:
+    String end(){
+      char * error = OpenAI_ResponseParser::end();
+      if(error != NULL){
+        openai_free(error);
+        return String();
+      }
+      return text;
+    }
+};
+
+//
+// OpenAI_ChoiceStream
+//
+
+class OpenAI_ChoiceStream;
+
+// Reads the choices of one streamed event
+class OpenAI_EventParser : public OpenAI_ResponseParser {
+  private:
+    OpenAI_ChoiceStream * stream;
+    String text;
+    String finish_reason;
+    unsigned int choice;
+    bool has_text;
+    bool has_finish;
+
+  protected:
+    void onBegin(OpenAI_Json_Container type){
+      OpenAI_ResponseParser::onBegin(type);
+      if(match("choices.#")){
+        text = "";
+        finish_reason = "";
+        choice = index(1);
+        has_text = false;
+        has_finish = false;
+      }
+    }
+    void onString(const char * data, size_t len, bool last){
+      OpenAI_ResponseParser::onString(data, len, last);
+      if(match("choices.#.text") || match("choices.#.delta.content")){
+        text.concat(data, len);
+        has_text = true;
+      } else if(match("choices.#.finish_reason")){
+        finish_reason.concat(data, len);
+        has_finish = true;
+      }
+    }
+    void onNumber(double value){
+      if(match("choices.#.index")){
+        choice = value;
+      }
+    }
+    void onEnd(OpenAI_Json_Container type);
+
+  public:
+    OpenAI_EventParser(OpenAI_ChoiceStream * s)
+      : stream(s)
+      , choice(0)
+      , has_text(false)
+      , has_finish(false)
+    {}
+};
+
+// Splits a "text/event-stream" body into its "data:" events as it arrives
+// and appends the text of every event to the buffer of the choice it belongs to.
+// Completions carry the text in "choices[].text", chats in "choices[].delta.content"
+class OpenAI_ChoiceStream : public Stream {
+  private:
+    OpenAI_StreamCallback callback;
+    OpenAI_EventParser event;
+    OpenAI_ResponseParser body;
+    String line;
+    OpenAI_TextBuffer * choices;
+    unsigned int len;
+    unsigned int events;
+    bool done;
+
+    void onLine();
+
+  public:
+    OpenAI_ChoiceStream(OpenAI_StreamCallback cb)
+      : callback(cb)
+      , event(this)
+      , choices(NULL)
+      , len(0)
+      , events(0)
+      , done(false)
+    {}
+    ~OpenAI_ChoiceStream(){
+      freeTexts(choices, len);
+    }
+
+    void onChoice(unsigned int index, const char * text, const char * finish_reason);
+
+    size_t write(const uint8_t * buffer, size_t size);
+    size_t write(uint8_t c){ return write(&c, 1); }
+    int available(){ return 0; }
+    int read(){ return -1; }
+    int peek(){ return -1; }
+
+    void finish(OpenAI_StringResponse & result, void * buffer=NULL, size_t buffer_size=0);
+};
+
+void OpenAI_EventParser::onEnd(OpenAI_Json_Container type){
+  if(type == OPENAI_JSON_OBJECT && match("choices.#")){
+    stream->onChoice(choice, has_text?text.c_str():NULL, has_finish?finish_reason.c_str():NULL);
+  }
+}
+
+size_t OpenAI_ChoiceStream::write(const uint8_t * buffer, size_t size){
+  if(done){
+    // Returning a short write makes HTTPClient drop the rest of the body
+    return 0;
+  }
+  const char * p = (const char *)buffer;
+  const char * end = p + size;
+  while(p < end){
+    const char * nl = (const char *)memchr(p, '\n', end - p);
+    if(nl == NULL){
+      line.concat(p, end - p);
+      break;
+    }
+    line.concat(p, nl - p);
+    if(line.endsWith("\r")){
+      line.remove(line.length() - 1);
+    }
+    onLine();
+    line = "";
+    if(done){
+      return 0;
+    }
+    p = nl + 1;
   }
-  len = dl;
-  for (int di = 0; di < dl; di++){
-    cJSON * ditem = cJSON_GetArrayItem(d, di);
-    if(ditem == NULL || !cJSON_IsObject(ditem) || !cJSON_HasObjectItem(ditem, "flagged")){
-      log_e("Flagged was not found");
-      goto end;
+  return size;
+}
+
+void OpenAI_ChoiceStream::onLine(){
+  if(line.startsWith("data:")){
+    const char * data = line.c_str() + 5;
+    while(*data == ' '){
+      data++;
+    }
+    if(!strcmp(data, "[DONE]")){
+      done = true;
+      return;
+    }
+    events++;
+    event.reset();
+    event.write((const uint8_t *)data, strlen(data));
+    char * error = event.end();
+    if(error != NULL){
+      openai_free(error);
     }
-    cJSON * flagged = cJSON_GetObjectItem(ditem, "flagged");
-    if(flagged == NULL || !cJSON_IsBool(flagged)){
-      log_e("Flagged is not bool");
-      goto end;
+  } else if(events == 0 && line.length()){
+    // Not an event stream, most likely an error object
+    body.write((const uint8_t *)line.c_str(), line.length());
+  }
+}
+
+void OpenAI_ChoiceStream::onChoice(unsigned int index, const char * text, const char * finish_reason){
+  if(done){
+    return;
+  }
+  OpenAI_TextBuffer * b = textAt(&choices, &len, index);
+  if(b == NULL || !appendText(b, (text != NULL)?text:"", (text != NULL)?strlen(text):0)){
+    done = true;
+    return;
+  }
+  if((text != NULL || finish_reason != NULL) && callback && !callback(index, (text != NULL)?text:"", finish_reason)){
+    done = true;
+  }
+}
+
+void OpenAI_ChoiceStream::finish(OpenAI_StringResponse & result, void * buffer, size_t buffer_size){
+  if(line.length()){
+    onLine();
+  }
+  if(events == 0){
+    result.error_str = body.end();
+    return;
+  }
+  if(len == 0){
+    return;
+  }
+  result.data = packTexts(choices, len, buffer, buffer_size, result.owned);
+  if(result.data != NULL){
+    result.len = len;
+  }
+}
+
+//
+// OpenAI
+//
+
+struct OpenAI_Connection {
+  WiFiClient * client;
+  HTTPClient http;
+  unsigned long last_used;
+  bool busy;
+};
+
+OpenAI::OpenAI(const char *openai_api_key)
+    : api_key(openai_api_key)
+    , base_url("https://api.openai.com/v1/")
+    , connections(NULL)
+    , connections_len(0)
+    , keep_alive(30000)
+    , connections_lock(NULL)
+    , connections_free(NULL)
+    , connections_config(NULL)
+    , retry_attempts(3)
+    , retry_delay(500)
+    , retry_max_delay(20000)
+    , retry_generations(false)
+    , async_queue(NULL)
+    , async_stopped(NULL)
+    , async_depth(4)
+    , async_core(tskNO_AFFINITY)
+    , async_workers(1)
+    , async_running(0)
+    , embedding_cache(NULL)
+    , response_cache(NULL)
+    , token_counter(NULL)
+{
+  memset(&stats, 0, sizeof(stats));
+  memset(&retry_stats, 0, sizeof(retry_stats));
+  memset(&upload_stats, 0, sizeof(upload_stats));
+  connections_lock = xSemaphoreCreateMutex();
+  connections_config = xSemaphoreCreateMutex();
+  // Created once, so tasks that wait for a connection keep waiting on it while the pool is replaced
+  connections_free = xSemaphoreCreateCounting(OPENAI_MAX_CONNECTIONS, 0);
+  setConnectionPool(1, keep_alive);
+}
+
+OpenAI::~OpenAI(){
+  stopWorker();
+  if(connections_config != NULL){
+    xSemaphoreTake(connections_config, portMAX_DELAY);
+  }
+  drainConnections();
+  closeConnections();
+  delete[] connections;
+  if(connections_free != NULL){
+    vSemaphoreDelete(connections_free);
+  }
+  if(connections_config != NULL){
+    vSemaphoreDelete(connections_config);
+  }
+  if(connections_lock != NULL){
+    vSemaphoreDelete(connections_lock);
+  }
+}
+
+// Takes every connection of the pool, waiting for the requests that use them. Called with connections_config held,
+// so no other task can change the pool in between. New requests wait in acquireConnection() until the pool is given back
+void OpenAI::drainConnections(){
+  if(connections_free == NULL){
+    return;
+  }
+  for(unsigned int i = 0; i < connections_len; i++){
+    xSemaphoreTake(connections_free, portMAX_DELAY);
+  }
+}
+
+// Closes the clients of a drained pool
+void OpenAI::closeConnections(){
+  if(connections_lock == NULL){
+    return;
+  }
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  for(unsigned int i = 0; i < connections_len; i++){
+    if(connections[i].client != NULL){
+      connections[i].http.end();
+      connections[i].client->stop();
+      delete connections[i].client;
+      connections[i].client = NULL;
     }
-    data[di] = cJSON_IsTrue(flagged);
   }
-end:
-  cJSON_Delete(json);
+  xSemaphoreGive(connections_lock);
+}
+
+OpenAI & OpenAI::setBaseUrl(const char * url){
+  if(url == NULL || !strlen(url)){
+    return *this;
+  }
+  if(connections_config == NULL || connections_lock == NULL){
+    log_e("Connection pool was not created");
+    return *this;
+  }
+  xSemaphoreTake(connections_config, portMAX_DELAY);
+  drainConnections();
+  // Open connections belong to the previous host
+  closeConnections();
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  base_url = String(url);
+  if(!base_url.endsWith("/")){
+    base_url += "/";
+  }
+  xSemaphoreGive(connections_lock);
+  for(unsigned int i = 0; i < connections_len; i++){
+    xSemaphoreGive(connections_free);
+  }
+  xSemaphoreGive(connections_config);
+  return *this;
+}
+
+OpenAI & OpenAI::setConnectionPool(unsigned int size, unsigned long idle_timeout){
+  if(size == 0){
+    size = 1;
+  }
+  if(size > OPENAI_MAX_CONNECTIONS){
+    log_e("Connection pool is limited to %u", OPENAI_MAX_CONNECTIONS);
+    size = OPENAI_MAX_CONNECTIONS;
+  }
+  if(connections_config == NULL || connections_lock == NULL || connections_free == NULL){
+    log_e("Connection pool was not created");
+    return *this;
+  }
+  // Allocated first, so a failure leaves the current pool working
+  OpenAI_Connection * pool = new OpenAI_Connection[size];
+  if(pool == NULL){
+    log_e("Connection pool could not be allocated");
+    return *this;
+  }
+  for(unsigned int i = 0; i < size; i++){
+    pool[i].client = NULL;
+    pool[i].last_used = 0;
+    pool[i].busy = false;
+    pool[i].http.setReuse(idle_timeout > 0);
+  }
+  xSemaphoreTake(connections_config, portMAX_DELAY);
+  drainConnections();
+  closeConnections();
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  OpenAI_Connection * old = connections;
+  connections = pool;
+  connections_len = size;
+  keep_alive = idle_timeout;
+  xSemaphoreGive(connections_lock);
+  delete[] old;
+  for(unsigned int i = 0; i < size; i++){
+    xSemaphoreGive(connections_free);
+  }
+  xSemaphoreGive(connections_config);
+  return *this;
+}
+
+OpenAI_ConnectionStats OpenAI::connectionStats(){
+  OpenAI_ConnectionStats s;
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  s = stats;
+  xSemaphoreGive(connections_lock);
+  return s;
+}
+
+void OpenAI::resetConnectionStats(){
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  memset(&stats, 0, sizeof(stats));
+  xSemaphoreGive(connections_lock);
+}
+
+OpenAI & OpenAI::setRetryPolicy(unsigned int attempts, unsigned long base_delay, unsigned long max_delay, bool generations){
+  retry_attempts = (attempts)?attempts:1;
+  retry_delay = base_delay;
+  retry_max_delay = max_delay;
+  retry_generations = generations;
+  return *this;
+}
+
+OpenAI_RetryStats OpenAI::retryStats(){
+  OpenAI_RetryStats s;
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  s = retry_stats;
+  xSemaphoreGive(connections_lock);
+  return s;
+}
+
+void OpenAI::resetRetryStats(){
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  memset(&retry_stats, 0, sizeof(retry_stats));
+  xSemaphoreGive(connections_lock);
+}
+
+OpenAI_UploadStats OpenAI::uploadStats(){
+  OpenAI_UploadStats s;
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  s = upload_stats;
+  xSemaphoreGive(connections_lock);
+  return s;
+}
+
+OpenAI & OpenAI::setEmbeddingCache(OpenAI_EmbeddingCache * cache){
+  embedding_cache = cache;
+  return *this;
+}
+
+OpenAI & OpenAI::setResponseCache(OpenAI_ResponseCache * cache){
+  response_cache = cache;
+  return *this;
+}
+
+OpenAI & OpenAI::setTokenizer(OpenAI_Tokenizer * t){
+  token_counter = t;
+  return *this;
 }
 
-OpenAI_ModerationResponse::~OpenAI_ModerationResponse(){
-  if(data){
-    free(data);
+// English text averages about four characters per token
+unsigned int OpenAI::countTokens(const char * text){
+  if(text == NULL){
+    return 0;
   }
-  if(error_str != NULL){
-    free(error_str);
+  if(token_counter != NULL){
+    return token_counter->count(text);
   }
+  return (strlen(text) + 3) / 4;
 }
 
-//
-// OpenAI_ImageResponse
-//
+void OpenAI::setAllocator(OpenAI_Allocator * allocator){
+  OpenAI_Allocator::set(allocator);
+}
 
-OpenAI_ImageResponse::OpenAI_ImageResponse(const char * payload){
-  len = 0;
-  data = NULL;
-  error_str = NULL;
-  cJSON *d;
-  int dl;
+OpenAI_MemoryStats OpenAI::memoryStats(OpenAI_Memory_Category category){
+  return OpenAI_Allocator::get()->stats(category);
+}
 
-  if(payload == NULL){
-    return;
+OpenAI & OpenAI::setAsync(unsigned int queue_depth, int core, unsigned int workers){
+  if(queue_depth == 0){
+    queue_depth = 1;
   }
+  if(workers == 0){
+    workers = 1;
+  }
+  // Requests already queued are finished by the old workers
+  stopWorker();
+  async_depth = queue_depth;
+  async_core = core;
+  async_workers = workers;
+  return *this;
+}
 
-  // Parse payload
-  cJSON * json = cJSON_Parse(payload);
+bool OpenAI::startWorker(){
+  async_queue = xQueueCreate(async_depth, sizeof(OpenAI_AsyncTask *));
+  async_stopped = xSemaphoreCreateCounting(async_workers, 0);
+  if(async_queue == NULL || async_stopped == NULL){
+    log_e("Async queue could not be allocated");
+    stopWorker();
+    return false;
+  }
+  for(unsigned int i = 0; i < async_workers; i++){
+    if(xTaskCreatePinnedToCore(asyncWorker, "openai", 8192, this, 1, NULL, async_core) != pdPASS){
+      log_e("Async worker %u could not be started", i);
+      break;
+    }
+    async_running++;
+  }
+  if(async_running == 0){
+    stopWorker();
+    return false;
+  }
+  return true;
+}
 
-  // Check for error
-  String error = getJsonError(json);
-  if(error.length()){
-    error_str = strdup(error.c_str());
-    if(json != NULL){
-      cJSON_Delete(json);
+void OpenAI::stopWorker(){
+  if(async_queue != NULL && async_stopped != NULL){
+    // Each NULL tells one worker to exit after the tasks before it
+    OpenAI_AsyncTask * t = NULL;
+    for(unsigned int i = 0; i < async_running; i++){
+      xQueueSend(async_queue, &t, portMAX_DELAY);
     }
-    log_e("%s",error.c_str());
-    return;
+    for(unsigned int i = 0; i < async_running; i++){
+      xSemaphoreTake(async_stopped, portMAX_DELAY);
+    }
+  }
+  async_running = 0;
+  if(async_queue != NULL){
+    vQueueDelete(async_queue);
+    async_queue = NULL;
+  }
+  if(async_stopped != NULL){
+    vSemaphoreDelete(async_stopped);
+    async_stopped = NULL;
   }
+}
 
-  // Parse data
-  if(!cJSON_HasObjectItem(json, "data")){
-    log_e("Data was not found");
-    goto end;
+void OpenAI::asyncWorker(void * arg){
+  OpenAI * oai = (OpenAI *)arg;
+  OpenAI_AsyncTask * t = NULL;
+  while(xQueueReceive(oai->async_queue, &t, portMAX_DELAY) == pdTRUE && t != NULL){
+    // The following tasks of a conversation are run right away by the same worker
+    while(t != NULL){
+      t->run();
+      OpenAI_AsyncTask * next = t->next;
+      t->release();
+      t = next;
+    }
+  }
+  xSemaphoreGive(oai->async_stopped);
+  vTaskDelete(NULL);
+}
+
+bool OpenAI::submit(OpenAI_AsyncTask * task, OpenAI_Serial * serial){
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  bool started = (async_queue != NULL) || startWorker();
+  xSemaphoreGive(connections_lock);
+  if(!started){
+    task->cancel();
+    return false;
+  }
+  if(serial != NULL && serial->lock == NULL){
+    serial = NULL;
+  }
+  task->retain();
+  if(serial != NULL){
+    xSemaphoreTake(serial->lock, portMAX_DELAY);
+    if(serial->busy){
+      // Run by the worker of the task before it, once that is done
+      task->serial = serial;
+      serial->append(task);
+      xSemaphoreGive(serial->lock);
+      return true;
+    }
   }
-  d = cJSON_GetObjectItem(json, "data");
-  if(d == NULL || !cJSON_IsArray(d)){
-    log_e("Data is not array");
-    goto end;
+  bool queued = xQueueSend(async_queue, &task, 0) == pdTRUE;
+  if(serial != NULL){
+    if(queued){
+      task->serial = serial;
+      serial->busy = true;
+    }
+    xSemaphoreGive(serial->lock);
   }
-  dl = cJSON_GetArraySize(d);
-  if(dl <= 0){
-    log_e("Data is empty");
-    goto end;
+  if(!queued){
+    log_e("Async queue is full");
+    task->cancel();
+    task->release();
+    return false;
   }
-  data = (char**)malloc(dl * sizeof(char*));
-  if(data == NULL){
-    log_e("Data could not be allocated");
-    goto end;
+  return true;
+}
+
+OpenAI_Connection * OpenAI::acquireConnection(){
+  OpenAI_Connection * c = NULL;
+  if(connections_free == NULL || connections == NULL || xSemaphoreTake(connections_free, portMAX_DELAY) != pdTRUE){
+    return NULL;
   }
-  
-  for (int di = 0; di < dl; di++){
-    cJSON * item = cJSON_GetArrayItem(d, di);
-    if(item == NULL || !cJSON_IsObject(item) || (!cJSON_HasObjectItem(item, "url") && !cJSON_HasObjectItem(item, "b64_json"))){
-      log_e("Image was not found");
-      goto end;
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  // Prefer a connection that is still open
+  for(unsigned int i = 0; i < connections_len; i++){
+    if(!connections[i].busy && connections[i].client != NULL && connections[i].client->connected()){
+      c = &connections[i];
+      break;
     }
-    if(cJSON_HasObjectItem(item, "url")){
-      cJSON * url = cJSON_GetObjectItem(item, "url");
-      if(url == NULL || !cJSON_IsString(url)){
-        log_e("Image url could not be read");
-        goto end;
-      }
-      data[di] = strdup(cJSON_GetStringValue(url));
-      if(data[di] == NULL){
-        log_e("Image url could not be copied");
-        goto end;
-      }
-      len++;
-    } else if(cJSON_HasObjectItem(item, "b64_json")){
-      cJSON * b64_json = cJSON_GetObjectItem(item, "b64_json");
-      if(b64_json == NULL || !cJSON_IsString(b64_json)){
-        log_e("Image b64_json could not be read");
-        goto end;
+  }
+  if(c == NULL){
+    for(unsigned int i = 0; i < connections_len; i++){
+      if(!connections[i].busy){
+        c = &connections[i];
+        break;
       }
-      data[di] = strdup(cJSON_GetStringValue(b64_json));
-      if(data[di] == NULL){
-        log_e("Image b64_json could not be copied");
-        goto end;
+    }
+  }
+  c->busy = true;
+  if(c->client == NULL){
+    if(base_url.startsWith("https://")){
+      WiFiClientSecure * client = new WiFiClientSecure();
+      if(client != NULL){
+        client->setInsecure();
       }
-      len++;
+      c->client = client;
+    } else {
+      c->client = new WiFiClient();
+    }
+  }
+  if(c->client != NULL){
+    if(c->client->connected() && (millis() - c->last_used) > keep_alive){
+      c->client->stop();
+      stats.expired++;
+    }
+    if(c->client->connected()){
+      stats.reused++;
+    } else {
+      stats.handshakes++;
     }
+    stats.requests++;
+  }
+  xSemaphoreGive(connections_lock);
+  if(c->client == NULL){
+    log_e("Client could not be allocated");
+    releaseConnection(c, false);
+    return NULL;
   }
-end:
-  cJSON_Delete(json);
+  return c;
 }
 
-OpenAI_ImageResponse::~OpenAI_ImageResponse(){
-  if(data){
-    for (unsigned int i = 0; i < len; i++){
-      free(data[i]);
-    }
-    free(data);
+void OpenAI::releaseConnection(OpenAI_Connection * c, bool reconnected){
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  if(reconnected){
+    stats.reconnects++;
+    stats.handshakes++;
   }
-  if(error_str != NULL){
-    free(error_str);
+  if(keep_alive == 0 && c->client != NULL){
+    c->client->stop();
   }
+  c->last_used = millis();
+  c->busy = false;
+  xSemaphoreGive(connections_lock);
+  xSemaphoreGive(connections_free);
 }
 
-//
-// OpenAI_StringResponse
-//
+static bool connectionLost(int httpCode){
+  return httpCode == HTTPC_ERROR_SEND_HEADER_FAILED
+      || httpCode == HTTPC_ERROR_SEND_PAYLOAD_FAILED
+      || httpCode == HTTPC_ERROR_NOT_CONNECTED
+      || httpCode == HTTPC_ERROR_CONNECTION_LOST;
+}
 
-OpenAI_StringResponse::OpenAI_StringResponse(const char * payload){
-  usage = 0;
-  len = 0;
-  data = NULL;
-  error_str = NULL;
-  cJSON * u, *tokens, *d;
-  int dl;
+int OpenAI::request(const char * method, String endpoint, const char * content_type, uint8_t * data, size_t len, Stream * response, uint16_t timeout){
+  return execute(method, endpoint, content_type, data, len, NULL, response, timeout);
+}
 
-  if(payload == NULL){
-    return;
+int OpenAI::request(const char * method, String endpoint, const char * content_type, OpenAI_Body * body, Stream * response, uint16_t timeout){
+  if(body != NULL && !body->valid()){
+    log_e("Invalid request body!");
+    return HTTPC_ERROR_TOO_LESS_RAM;
   }
+  return execute(method, endpoint, content_type, NULL, 0, body, response, timeout);
+}
 
-  // Parse payload
-  cJSON * json = cJSON_Parse(payload);
+static const char * retry_headers[] = {
+  "Retry-After",
+  "retry-after-ms",
+  "x-ratelimit-remaining-requests",
+  "x-ratelimit-reset-requests",
+  "x-ratelimit-remaining-tokens",
+  "x-ratelimit-reset-tokens"
+};
 
-  // Check for error
-  String error = getJsonError(json);
-  if(error.length()){
-    error_str = strdup(error.c_str());
-    if(json != NULL){
-      cJSON_Delete(json);
+// "1h2m3.5s", "6m0s" or "120ms", as sent in the x-ratelimit-reset-* headers. 0 if it can not be read
+static unsigned long parseDuration(const char * s){
+  double ms = 0;
+  while(*s){
+    char * end = NULL;
+    double v = strtod(s, &end);
+    if(end == s){
+      return 0;
     }
-    log_e("%s",error.c_str());
-    return;
-  }
-
-  // Get total_tokens
-  if(!cJSON_HasObjectItem(json, "usage")){
-    log_e("Usage was not found");
-    goto end;
-  }
-  u = cJSON_GetObjectItem(json, "usage");
-  if(u == NULL || !cJSON_IsObject(u) || !cJSON_HasObjectItem(u, "total_tokens")){
-    log_e("Total tokens were not found");
-    goto end;
-  }
-  tokens = cJSON_GetObjectItem(u, "total_tokens");
-  if(tokens == NULL){
-    log_e("Total tokens could not be read");
-    goto end;
+    if(!strncmp(end, "ms", 2)){
+      ms += v;
+      end += 2;
+    } else if(*end == 'h'){
+      ms += v * 3600000;
+      end++;
+    } else if(*end == 'm'){
+      ms += v * 60000;
+      end++;
+    } else if(*end == 's'){
+      ms += v * 1000;
+      end++;
+    } else {
+      return 0;
+    }
+    s = end;
   }
-  usage = cJSON_GetNumberValue(tokens);
+  return (unsigned long)ms;
+}
 
-  // Parse data
-  if(!cJSON_HasObjectItem(json, "choices")){
-    log_e("Choices was not found");
-    goto end;
+// The time the server asked to wait, 0 if it did not say
+static unsigned long serverDelay(HTTPClient & http){
+  String h = http.header("retry-after-ms");
+  if(h.length()){
+    return h.toInt();
   }
-  d = cJSON_GetObjectItem(json, "choices");
-  if(d == NULL || !cJSON_IsArray(d)){
-    log_e("Choices is not array");
-    goto end;
+  h = http.header("Retry-After");
+  if(h.length() && isdigit(h[0])){
+    // The HTTP date form is not used by the API
+    return h.toInt() * 1000;
   }
-  dl = cJSON_GetArraySize(d);
-  if(dl <= 0){
-    log_e("Choices is empty");
-    goto end;
+  // Only the limits that ran out matter
+  unsigned long wait = 0;
+  if(http.header("x-ratelimit-remaining-requests") == "0"){
+    wait = parseDuration(http.header("x-ratelimit-reset-requests").c_str());
   }
-  data = (char**)malloc(dl * sizeof(char*));
-  if(data == NULL){
-    log_e("Data could not be allocated");
-    goto end;
+  if(http.header("x-ratelimit-remaining-tokens") == "0"){
+    unsigned long tokens = parseDuration(http.header("x-ratelimit-reset-tokens").c_str());
+    if(tokens > wait){
+      wait = tokens;
+    }
   }
-  
-  for (int di = 0; di < dl; di++){
-    cJSON * item = cJSON_GetArrayItem(d, di);
-    if(item == NULL || !cJSON_IsObject(item) || (!cJSON_HasObjectItem(item, "text") && !cJSON_HasObjectItem(item, "message"))){
-      log_e("Message was not found");
-      goto end;
+  return wait;
+}
+
+// Requests that give the same result when they are repeated. The others generate content and are billed again,
+// so they are only repeated if the server did not take them
+static bool isIdempotent(const char * method, const String & endpoint){
+  if(strcmp(method, "POST")){
+    return true;
+  }
+  return endpoint.startsWith("embeddings") || endpoint.startsWith("moderations");
+}
+
+// Full jitter: anything between no wait and the exponential backoff, so that clients that failed together spread out
+unsigned long openai_backoff(unsigned int n, unsigned long base_delay, unsigned long max_delay){
+  unsigned long backoff = base_delay << ((n < 16)?n - 1:15);
+  if(backoff > max_delay || backoff < base_delay){
+    backoff = max_delay;
+  }
+  return (backoff)?(esp_random() % (backoff + 1)):0;
+}
+
+// Decides if attempt n failed in a way that another attempt can fix and how long to wait for it
+bool OpenAI::retryDelay(OpenAI_Connection * c, int httpCode, unsigned int n, bool idempotent, unsigned long & wait){
+  bool retry = false;
+  switch(httpCode){
+    // Not taken by the server
+    case HTTP_CODE_TOO_MANY_REQUESTS:
+    case HTTP_CODE_SERVICE_UNAVAILABLE:
+    case HTTPC_ERROR_CONNECTION_REFUSED:
+    case HTTPC_ERROR_SEND_HEADER_FAILED:
+      retry = true;
+      break;
+    // May have been taken before it failed
+    case HTTP_CODE_REQUEST_TIMEOUT:
+    case HTTP_CODE_CONFLICT:
+    case HTTP_CODE_INTERNAL_SERVER_ERROR:
+    case HTTP_CODE_BAD_GATEWAY:
+    case HTTP_CODE_GATEWAY_TIMEOUT:
+    case HTTPC_ERROR_SEND_PAYLOAD_FAILED:
+    case HTTPC_ERROR_NOT_CONNECTED:
+    case HTTPC_ERROR_CONNECTION_LOST:
+    case HTTPC_ERROR_READ_TIMEOUT:
+      retry = idempotent || retry_generations;
+      break;
+    default:
+      break;
+  }
+  if(!retry){
+    return false;
+  }
+  unsigned long jitter = openai_backoff(n, retry_delay, retry_max_delay);
+  unsigned long server = (httpCode > 0)?serverDelay(c->http):0;
+  if(server > retry_max_delay){
+    log_e("Server asks to wait %lu ms, longer than the retry policy allows", server);
+    return false;
+  }
+  if(server > jitter){
+    // Spread out the clients that wait for the same reset
+    jitter = server + ((retry_delay)?(esp_random() % (retry_delay + 1)):0);
+  }
+  wait = jitter;
+  return true;
+}
+
+// Runs the request with the retry policy. The response only gets the body of the attempt that counts
+int OpenAI::execute(const char * method, String endpoint, const char * content_type, uint8_t * data, size_t len, OpenAI_Body * body, Stream * response, uint16_t timeout){
+  bool idempotent = isIdempotent(method, endpoint);
+  int httpCode = 0;
+  unsigned int n = 1;
+  unsigned long waited = 0;
+  while(true){
+    unsigned long wait = 0;
+    httpCode = attempt(method, endpoint, content_type, data, len, body, response, timeout, n, idempotent, (n < retry_attempts)?&wait:NULL);
+    if(httpCode == HTTP_CODE_TOO_MANY_REQUESTS){
+      xSemaphoreTake(connections_lock, portMAX_DELAY);
+      retry_stats.rate_limited++;
+      xSemaphoreGive(connections_lock);
     }
-    if(cJSON_HasObjectItem(item, "text")){
-      cJSON * text = cJSON_GetObjectItem(item, "text");
-      if(text == NULL || !cJSON_IsString(text)){
-        log_e("Text could not be read");
-        goto end;
-      }
-      data[di] = strdup(cJSON_GetStringValue(text));
-      if(data[di] == NULL){
-        log_e("Text could not be copied");
-        goto end;
-      }
-      len++;
-    } else if(cJSON_HasObjectItem(item, "message")){
-      cJSON * message = cJSON_GetObjectItem(item, "message");
-      if(message == NULL || !cJSON_IsObject(message) || !cJSON_HasObjectItem(message, "content")){
-        log_e("Message is not object");
-        goto end;
-      }
-      cJSON * mesg = cJSON_GetObjectItem(message, "content");
-      if(mesg == NULL || !cJSON_IsString(mesg)){
-        log_e("Message could not be read");
-        goto end;
+    if(!wait){
+      break;
+    }
+    log_w("HTTP_ERROR: %d, attempt %u of %u in %lu ms", httpCode, n + 1, retry_attempts, wait);
+    delay(wait);
+    waited += wait;
+    n++;
+  }
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  retry_stats.requests++;
+  if(n > 1){
+    retry_stats.retried++;
+    retry_stats.retries += n - 1;
+    retry_stats.backoff += waited;
+  }
+  if(httpCode != HTTP_CODE_OK && n > 1){
+    retry_stats.failed++;
+  }
+  xSemaphoreGive(connections_lock);
+  return httpCode;
+}
+
+// Sends the request once. If wait is given and the attempt can be repeated, the body of the response
+// is dropped and wait is set to the ms to wait before the next attempt
+int OpenAI::attempt(const char * method, String endpoint, const char * content_type, uint8_t * data, size_t len, OpenAI_Body * body, Stream * response, uint16_t timeout, unsigned int n, bool idempotent, unsigned long * wait){
+  OpenAI_Connection * c = acquireConnection();
+  if(c == NULL){
+    log_e("No connection available!");
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+  bool reused = c->client->connected();
+  bool reconnected = false;
+  int httpCode = 0;
+  while(true){
+    c->http.setTimeout(timeout);
+    if(!c->http.begin(*c->client, base_url + endpoint)){
+      log_e("Invalid URL: %s%s", base_url.c_str(), endpoint.c_str());
+      break;
+    }
+    if(content_type != NULL){
+      c->http.addHeader("Content-Type", content_type);
+    }
+    c->http.addHeader("Authorization", "Bearer " + api_key);
+    c->http.collectHeaders(retry_headers, sizeof(retry_headers) / sizeof(retry_headers[0]));
+    if(body != NULL && body->length()){
+      if(!body->rewind()){
+        // A stream that was already read can not be sent again
+        httpCode = HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+        break;
       }
-      data[di] = strdup(cJSON_GetStringValue(mesg));
-      if(data[di] == NULL){
-        log_e("Message could not be copied");
-        goto end;
+      httpCode = c->http.sendRequest(method, body, body->length());
+    } else {
+      httpCode = c->http.sendRequest(method, data, len);
+    }
+    // The server may have closed the keep-alive connection while it was idle
+    if(reused && !reconnected && connectionLost(httpCode)){
+      log_d("Connection closed by server. Reconnecting");
+      c->client->stop();
+      reconnected = true;
+      continue;
+    }
+    break;
+  }
+  if(wait != NULL && httpCode != HTTP_CODE_OK && retryDelay(c, httpCode, n, idempotent, *wait)){
+    if(body == NULL || body->rewind()){
+      // The rest of the failed response is still on the connection
+      c->http.end();
+      c->client->stop();
+      releaseConnection(c, reconnected);
+      if(*wait == 0){
+        *wait = 1;
       }
-      len = di+1;
+      return httpCode;
     }
+    // rewind() logged that the body can not be sent again
+    *wait = 0;
   }
-end:
-  cJSON_Delete(json);
-}
-
-OpenAI_StringResponse::~OpenAI_StringResponse(){
-  if(data != NULL){
-    for (unsigned int i = 0; i < len; i++){
-      free(data[i]);
+  if(httpCode > 0){
+    if(httpCode != HTTP_CODE_OK){
+      log_e("HTTP_ERROR: %d", httpCode);
     }
-    free(data);
-  }
-  if(error_str != NULL){
-    free(error_str);
+    if(response != NULL){
+      c->http.writeToStream(response);
+    }
+  } else {
+    log_e("HTTP_ERROR: %d", httpCode);
   }
+  c->http.end();
+  releaseConnection(c, reconnected);
+  return httpCode;
 }
 
-//
-// OpenAI
-//
-
-OpenAI::OpenAI(const char *openai_api_key)
-    : api_key(openai_api_key)
-{
-
+int OpenAI::upload(String endpoint, String boundary, uint8_t * data, size_t len, Stream * response) {
+  log_d("\"%s\": boundary=%s, len=%u", endpoint.c_str(), boundary.c_str(), len);
+  return request("POST", endpoint, ("multipart/form-data; boundary="+boundary).c_str(), data, len, response, 20000);
 }
 
-OpenAI::~OpenAI(){
-
+int OpenAI::upload(String endpoint, OpenAI_Multipart & body, Stream * response) {
+  body.end();
+  log_d("\"%s\": %s, len=%u", endpoint.c_str(), body.contentType().c_str(), body.length());
+  int httpCode = request("POST", endpoint, body.contentType().c_str(), &body, response, 20000);
+  OpenAI_UploadStats s = body.stats();
+  log_d("Sent %u bytes in %lu ms, heap used: %u", s.bytes, s.time, s.heap_used);
+  xSemaphoreTake(connections_lock, portMAX_DELAY);
+  upload_stats = s;
+  xSemaphoreGive(connections_lock);
+  return httpCode;
 }
 
 String OpenAI::upload(String endpoint, String boundary, uint8_t * data, size_t len) {
-  log_d("\"%s\": boundary=%s, len=%u", endpoint.c_str(), boundary.c_str(), len);
-  HTTPClient http;
-  http.setTimeout(20000);
-  http.begin("https://api.openai.com/v1/" + endpoint);
-  http.addHeader("Content-Type", "multipart/form-data; boundary="+boundary);
-  http.addHeader("Authorization", "Bearer " + api_key);
-  int httpCode = http.sendRequest("POST", data, len);
-  if (httpCode != HTTP_CODE_OK) {
-    log_e("HTTP_ERROR: %d", httpCode);
-  }
-  String response = http.getString();
-  http.end();
+  StreamString response;
+  upload(endpoint, boundary, data, len, &response);
   log_d("%s", response.c_str());
   return response;
 }
 
-String OpenAI::post(String endpoint, String jsonBody) {
+// Passes the response on and keeps a copy of it for the response cache
+class OpenAI_ResponseRecorder : public Stream {
+  private:
+    Stream * out;
+    uint8_t * data;
+    size_t len;
+    size_t max;
+    bool overflow;
+
+  public:
+    OpenAI_ResponseRecorder(Stream * response, size_t limit)
+      : out(response)
+      , data(NULL)
+      , len(0)
+      , max(limit)
+      , overflow(false)
+    {}
+    ~OpenAI_ResponseRecorder(){
+      openai_free(data);
+    }
+
+    size_t write(const uint8_t * buffer, size_t size){
+      if(!overflow){
+        uint8_t * d = NULL;
+        if((len + size) <= max && (d = (uint8_t*)openai_realloc(data, len + size, OPENAI_MEMORY_PARSER)) != NULL){
+          memcpy(d + len, buffer, size);
+          data = d;
+          len += size;
+        } else {
+          overflow = true;
+        }
+      }
+      return (out != NULL)?out->write(buffer, size):size;
+    }
+    size_t write(uint8_t c){ return write(&c, 1); }
+    int available(){ return 0; }
+    int read(){ return -1; }
+    int peek(){ return -1; }
+
+    bool complete(){ return !overflow && len; }
+    const uint8_t * buffer(){ return data; }
+    size_t length(){ return len; }
+};
+
+int OpenAI::post(String endpoint, String jsonBody, Stream * response, bool cacheable) {
+  if(!cacheable || response_cache == NULL){
+    log_d("\"%s\": %s", endpoint.c_str(), jsonBody.c_str());
+    return request("POST", endpoint, "application/json", (uint8_t*)jsonBody.c_str(), jsonBody.length(), response, 60000);
+  }
+  String key = endpoint + "\n" + jsonBody;
+  if(response_cache->get(key, response)){
+    log_d("\"%s\": cached", endpoint.c_str());
+    return HTTP_CODE_OK;
+  }
   log_d("\"%s\": %s", endpoint.c_str(), jsonBody.c_str());
-  HTTPClient http;
-  http.setTimeout(60000);
-  http.begin("https://api.openai.com/v1/" + endpoint);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("Authorization", "Bearer " + api_key);
-  int httpCode = http.POST(jsonBody);
-  if (httpCode != HTTP_CODE_OK) {
-    log_e("HTTP_ERROR: %d", httpCode);
+  OpenAI_ResponseRecorder recorder(response, response_cache->maxSize());
+  int httpCode = request("POST", endpoint, "application/json", (uint8_t*)jsonBody.c_str(), jsonBody.length(), &recorder, 60000);
+  // Errors are not kept, the next attempt may succeed
+  if(httpCode == HTTP_CODE_OK && recorder.complete()){
+    response_cache->put(key, recorder.buffer(), recorder.length());
+  }
+  return httpCode;
+}
+
+int OpenAI::post(String endpoint, OpenAI_JsonBody & body, Stream * response, bool cacheable) {
+  if(!body.end()){
+    log_e("Invalid request body!");
+    return HTTPC_ERROR_TOO_LESS_RAM;
   }
-  String response = http.getString();
-  http.end();
+  if(cacheable && response_cache != NULL){
+    String json = body.toString();
+    if(json.length()){
+      return post(endpoint, json, response, true);
+    }
+  }
+  log_d("\"%s\": %u bytes", endpoint.c_str(), body.length());
+  return request("POST", endpoint, "application/json", &body, response, 60000);
+}
+
+String OpenAI::post(String endpoint, String jsonBody) {
+  StreamString response;
+  post(endpoint, jsonBody, &response);
   log_d("%s", response.c_str());
   return response;
 }
 
 String OpenAI::get(String endpoint) {
   log_d("\"%s\"", endpoint.c_str());
-  HTTPClient http;
-  http.begin("https://api.openai.com/v1/" + endpoint);
-  http.addHeader("Authorization", "Bearer " + api_key);
-  int httpCode = http.GET();
-  if (httpCode != HTTP_CODE_OK) {
-    log_e("HTTP_ERROR: %d", httpCode);
-  }
-  String response = http.getString();
-  http.end();
+  StreamString response;
+  request("GET", endpoint, NULL, NULL, 0, &response);
   log_d("%s", response.c_str());
   return response;
 }
 
 String OpenAI::del(String endpoint) {
   log_d("\"%s\"", endpoint.c_str());
-  HTTPClient http;
-  http.begin("https://api.openai.com/v1/" + endpoint);
-  http.addHeader("Authorization", "Bearer " + api_key);
-  int httpCode = http.sendRequest("DELETE");
-  if (httpCode != HTTP_CODE_OK) {
-    log_e("HTTP_ERROR: %d", httpCode);
-  }
-  String response = http.getString();
-  http.end();
+  StreamString response;
+  request("DELETE", endpoint, NULL, NULL, 0, &response);
   log_d("%s", response.c_str());
   return response;
 }
 
+OpenAI_Embedding OpenAI::embedding(){
+  return OpenAI_Embedding(*this);
+}
+
 OpenAI_Completion OpenAI::completion(){
   return OpenAI_Completion(*this);
 }
@@ -585,39 +2208,224 @@ OpenAI_AudioTranslation OpenAI::audioTranslation(){
 //   "user": null//string. A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
 // }
 
-OpenAI_EmbeddingResponse OpenAI::embedding(String input, const char * model, const char * user){
+OpenAI_EmbeddingResponse OpenAI::embedding(String input, const char * model, const char * user, OpenAI_Embedding_Precision precision, OpenAI_Embedding_Encoding_Format encoding){
   String endpoint = "embeddings";
 
-  OpenAI_EmbeddingResponse result = OpenAI_EmbeddingResponse(NULL);
-  cJSON * req = cJSON_CreateObject();
-  if(req == NULL){
-    log_e("cJSON_CreateObject failed!");
+  OpenAI_EmbeddingResponse result = OpenAI_EmbeddingResponse(NULL, precision);
+  // Plain text goes through the cache. Arrays, that may hold tokens, are sent as they are
+  if(embedding_cache != NULL && !input.startsWith("[")){
+    OpenAI_Embedding e(*this);
+    e.setPrecision(precision).setEncodingFormat(encoding);
+    if(model != NULL){
+      e.setModel(model);
+    }
+    if(user != NULL){
+      e.setUser(user);
+    }
+    const char * text = input.c_str();
+    e.request([text](unsigned int i) -> const char * {
+      return (i == 0)?text:NULL;
+    }, result);
     return result;
   }
-  reqAddString("model", (model == NULL)?"text-embedding-ada-002":model);
+  OpenAI_JsonBody body;
+  body.beginObject();
+  body.addString("model", (model == NULL)?"text-embedding-ada-002":model);
   if(input.startsWith("[")){
-    cJSON * in = cJSON_Parse(input.c_str());
-    if(in == NULL || !cJSON_IsArray(in)){
+    if(!isJsonArray(input)){
       log_e("Input not JSON Array!");
-      cJSON_Delete(req);
       return result;
     }
-    reqAddItem("input", in);
+    body.addRaw("input", input.c_str());
   } else {
-    reqAddString("input", input.c_str());
+    body.addString("input", input.c_str());
   }
   if(user != NULL){
-    reqAddString("user", user);
+    body.addString("user", user);
+  }
+  if(encoding == OPENAI_EMBEDDING_ENCODING_FORMAT_BASE64){
+    body.addString("encoding_format", "base64");
   }
-  String jsonBody = String(cJSON_Print(req));
-  cJSON_Delete(req);
-  String response = post(endpoint, jsonBody);
+  body.endObject();
 
-  if(!response.length()){
-    log_e("Empty response!");
-    return result;
+  OpenAI_EmbeddingResponseParser parser(result);
+  post(endpoint, body, &parser);
+  parser.end();
+  OpenAI_EmbeddingResponseParser::pack(result);
+  return result;
+}
+
+OpenAI_Future<OpenAI_EmbeddingResponse> OpenAI::embeddingAsync(String input, const char * model, const char * user, OpenAI_Embedding_Precision precision, OpenAI_Embedding_Encoding_Format encoding){
+  OpenAI * oai = this;
+  return async<OpenAI_EmbeddingResponse>([oai, input, model, user, precision, encoding](){
+    return oai->embedding(input, model, user, precision, encoding);
+  });
+}
+
+//
+// OpenAI_Embedding
+//
+
+const OpenAI_Field<OpenAI_Embedding> OpenAI_Embedding::fields[] = {
+  openaiText("model", &OpenAI_Embedding::model, "text-embedding-ada-002"),
+  openaiText("user", &OpenAI_Embedding::user)
+};
+
+OpenAI_Embedding::OpenAI_Embedding(OpenAI &openai)
+  : oai(openai)
+  , model(NULL)
+  , user(NULL)
+  , precision(OPENAI_EMBEDDING_PRECISION_DOUBLE)
+  , encoding_format(OPENAI_EMBEDDING_ENCODING_FORMAT_FLOAT)
+  , batch_inputs(100)
+  , batch_tokens(8000)
+  , cache(openai.embeddingCache())
+  , response_buffer(NULL)
+  , response_buffer_size(0)
+{}
+
+OpenAI_Embedding::~OpenAI_Embedding(){
+  if(model != NULL){
+    openai_free((void*)model);
+  }
+  if(user != NULL){
+    openai_free((void*)user);
+  }
+}
+
+OpenAI_Embedding & OpenAI_Embedding::setModel(const char * m){
+  if(model != NULL){
+    openai_free((void*)model);
+  }
+  model = openai_strdup(m, OPENAI_MEMORY_SETTINGS);
+  return *this;
+}
+
+OpenAI_Embedding & OpenAI_Embedding::setUser(const char * u){
+  if(user != NULL){
+    openai_free((void*)user);
+  }
+  user = openai_strdup(u, OPENAI_MEMORY_SETTINGS);
+  return *this;
+}
+
+OpenAI_Embedding & OpenAI_Embedding::setResponseBuffer(void * buffer, size_t size){
+  response_buffer = buffer;
+  response_buffer_size = size;
+  return *this;
+}
+
+OpenAI_Embedding & OpenAI_Embedding::setPrecision(OpenAI_Embedding_Precision p){
+  if(p >= OPENAI_EMBEDDING_PRECISION_DOUBLE && p <= OPENAI_EMBEDDING_PRECISION_UINT8){
+    precision = p;
+  }
+  return *this;
+}
+
+OpenAI_Embedding & OpenAI_Embedding::setEncodingFormat(OpenAI_Embedding_Encoding_Format f){
+  if(f >= OPENAI_EMBEDDING_ENCODING_FORMAT_FLOAT && f <= OPENAI_EMBEDDING_ENCODING_FORMAT_BASE64){
+    encoding_format = f;
+  }
+  return *this;
+}
+
+OpenAI_Embedding & OpenAI_Embedding::setBatchLimits(unsigned int inputs, unsigned int tokens){
+  if(inputs > 0){
+    batch_inputs = inputs;
+  }
+  if(tokens > 0){
+    batch_tokens = tokens;
+  }
+  return *this;
+}
+
+OpenAI_Embedding & OpenAI_Embedding::setCache(OpenAI_EmbeddingCache * c){
+  cache = c;
+  return *this;
+}
+
+OpenAI_EmbeddingResponse OpenAI_Embedding::embed(String input){
+  const char * text = input.c_str();
+  return embed(&text, 1);
+}
+
+OpenAI_EmbeddingResponse OpenAI_Embedding::embed(const char * const * inputs, unsigned int count){
+  return embed([inputs, count](unsigned int i) -> const char * {
+    return (i < count)?inputs[i]:NULL;
+  });
+}
+
+OpenAI_EmbeddingResponse OpenAI_Embedding::embed(const std::vector<String> & inputs){
+  const std::vector<String> * list = &inputs;
+  return embed([list](unsigned int i) -> const char * {
+    return (i < list->size())?(*list)[i].c_str():NULL;
+  });
+}
+
+OpenAI_EmbeddingResponse OpenAI_Embedding::embed(OpenAI_EmbeddingInput next){
+  OpenAI_EmbeddingResponse result = OpenAI_EmbeddingResponse(NULL, precision);
+  request(next, result);
+  return result;
+}
+
+void OpenAI_Embedding::request(OpenAI_EmbeddingInput next, OpenAI_EmbeddingResponse & result){
+  String endpoint = "embeddings";
+  const char * name = (model == NULL)?"text-embedding-ada-002":model;
+
+  unsigned int index = 0;
+  const char * input = next(index);
+  uint64_t key = 0;
+  bool missed = false;  //input was already looked up
+  if(input == NULL){
+    log_e("No input!");
+  }
+  // One request per batch. The vectors are added to the same response in input order
+  while(input != NULL && result.error() == NULL){
+    OpenAI_EmbeddingResponseParser parser(result, cache);
+    unsigned int tokens = 0;
+    OpenAI_JsonBody body;
+    body.beginObject();
+    body.beginArray("input");
+    while(input != NULL){
+      // Inputs found in the cache are not sent
+      if(cache != NULL && !missed){
+        key = OpenAI_EmbeddingCache::key(name, input);
+        if(parser.fromCache(index, key)){
+          input = next(++index);
+          continue;
+        }
+        missed = true;
+      }
+      unsigned int t = oai.countTokens(input);
+      unsigned int sent = parser.expected();
+      if(sent > 0 && (sent == batch_inputs || (tokens + t) > batch_tokens)){
+        break;
+      }
+      // The callback may reuse its buffer for the next input
+      body.addString(NULL, input, true);
+      tokens += t;
+      parser.expect(index, key);
+      missed = false;
+      input = next(++index);
+    }
+    if(!parser.expected()){
+      break;
+    }
+    body.endArray();
+    openaiWriteFields(this, fields, body);
+    if(encoding_format == OPENAI_EMBEDDING_ENCODING_FORMAT_BASE64){
+      body.addString("encoding_format", "base64");
+    }
+    body.endObject();
+
+    oai.post(endpoint, body, &parser);
+    parser.end();
+    if(result.error() == NULL && parser.vectors() != parser.expected()){
+      log_e("Expected %u vectors, received %u", parser.expected(), parser.vectors());
+      break;
+    }
   }
-  return OpenAI_EmbeddingResponse(response.c_str());
+  OpenAI_EmbeddingResponseParser::pack(result, response_buffer, response_buffer_size);
 }
 
 // moderations { //Classifies if text violates OpenAI's Content Policy
@@ -629,35 +2437,33 @@ OpenAI_ModerationResponse OpenAI::moderation(String input, const char * model){
   String endpoint = "moderations";
 
   OpenAI_ModerationResponse result = OpenAI_ModerationResponse(NULL);
-  String res = "";
-  cJSON * req = cJSON_CreateObject();
-  if(req == NULL){
-    log_e("cJSON_CreateObject failed!");
-    return result;
-  }
+  OpenAI_JsonBody body;
+  body.beginObject();
   if(input.startsWith("[")){
-    cJSON * in = cJSON_Parse(input.c_str());
-    if(in == NULL || !cJSON_IsArray(in)){
+    if(!isJsonArray(input)){
       log_e("Input not JSON Array!");
-      cJSON_Delete(req);
       return result;
     }
-    reqAddItem("input", in);
+    body.addRaw("input", input.c_str());
   } else {
-    reqAddString("input", input.c_str());
+    body.addString("input", input.c_str());
   }
   if(model != NULL){
-    reqAddString("model", model);
+    body.addString("model", model);
   }
-  String jsonBody = String(cJSON_Print(req));
-  cJSON_Delete(req);
-  res = post(endpoint, jsonBody);
+  body.endObject();
 
-  if(!res.length()){
-    log_e("Empty result!");
-    return result;
-  }
-  return OpenAI_ModerationResponse(res.c_str());
+  OpenAI_ModerationResponseParser parser(result);
+  post(endpoint, body, &parser, true);
+  parser.end();
+  return result;
+}
+
+OpenAI_Future<OpenAI_ModerationResponse> OpenAI::moderationAsync(String input, const char * model){
+  OpenAI * oai = this;
+  return async<OpenAI_ModerationResponse>([oai, input, model](){
+    return oai->moderation(input, model);
+  });
 }
 
 // completions { //Creates a completion for the provided prompt and parameters
@@ -678,6 +2484,19 @@ OpenAI_ModerationResponse OpenAI::moderation(String input, const char * model){
 //   "user": null//string. A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
 // }
 
+const OpenAI_Field<OpenAI_Completion> OpenAI_Completion::fields[] = {
+  openaiText("model", &OpenAI_Completion::model, "text-davinci-003"),
+  openaiCount("max_tokens", &OpenAI_Completion::max_tokens, 0, 1),
+  openaiReal("temperature", &OpenAI_Completion::temperature, 1, 0, 2),
+  openaiReal("top_p", &OpenAI_Completion::top_p, 1, 0, 1),
+  openaiCount("n", &OpenAI_Completion::n, 1, 1, OPENAI_MAX_CHOICES),
+  openaiFlag("echo", &OpenAI_Completion::echo, false),
+  openaiText("stop", &OpenAI_Completion::stop),
+  openaiReal("presence_penalty", &OpenAI_Completion::presence_penalty, 0, -2, 2),
+  openaiReal("frequency_penalty", &OpenAI_Completion::frequency_penalty, 0, -2, 2),
+  openaiText("user", &OpenAI_Completion::user)
+};
+
 OpenAI_Completion::OpenAI_Completion(OpenAI &openai)
   : oai(openai)
   , model(NULL)
@@ -691,80 +2510,71 @@ OpenAI_Completion::OpenAI_Completion(OpenAI &openai)
   , frequency_penalty(0)
   , best_of(1)
   , user(NULL)
+  , max_context(0)
+  , response_buffer(NULL)
+  , response_buffer_size(0)
 {}
 
 OpenAI_Completion::~OpenAI_Completion(){
   if(model != NULL){
-    free((void*)model);
+    openai_free((void*)model);
   }
   if(stop != NULL){
-    free((void*)stop);
+    openai_free((void*)stop);
   }
   if(user != NULL){
-    free((void*)user);
+    openai_free((void*)user);
   }
 }
 
 OpenAI_Completion & OpenAI_Completion::setModel(const char * m){
   if(model != NULL){
-    free((void*)model);
+    openai_free((void*)model);
   }
-  model = strdup(m);
+  model = openai_strdup(m, OPENAI_MEMORY_SETTINGS);
   return *this;
 }
 
 OpenAI_Completion & OpenAI_Completion::setMaxTokens(unsigned int m){
-  if(m > 0){
-    max_tokens = m;
-  }
+  openaiSetField(this, fields, &OpenAI_Completion::max_tokens, m);
   return *this;
 }
 
 OpenAI_Completion & OpenAI_Completion::setTemperature(float t){
-  if(t >= 0 && t <= 2.0){
-    temperature = t;
-  }
+  openaiSetField(this, fields, &OpenAI_Completion::temperature, t);
   return *this;
 }
 
 OpenAI_Completion & OpenAI_Completion::setTopP(float t){
-  if(t >= 0 && t <= 1.0){
-    top_p = t;
-  }
+  openaiSetField(this, fields, &OpenAI_Completion::top_p, t);
   return *this;
 }
 
 OpenAI_Completion & OpenAI_Completion::setN(unsigned int _n){
-  if(n > 0){
-    n = _n;
-  }
+  openaiSetField(this, fields, &OpenAI_Completion::n, _n);
   return *this;
 }
 
 OpenAI_Completion & OpenAI_Completion::setEcho(bool e){
-  echo = e;
+  openaiSetField(this, fields, &OpenAI_Completion::echo, e);
   return *this;
 }
 
 OpenAI_Completion & OpenAI_Completion::setStop(const char * s){
   if(stop != NULL){
-    free((void*)stop);
+    openai_free((void*)stop);
   }
-  stop = strdup(s);
+  stop = openai_strdup(s, OPENAI_MEMORY_SETTINGS);
   return *this;
 }
 
 OpenAI_Completion & OpenAI_Completion::setPresencePenalty(float p){
-  if(p >= -2.0 && p <= 2.0){
-    presence_penalty = p;
-  }
+  openaiSetField(this, fields, &OpenAI_Completion::presence_penalty, p);
   return *this;
 }
 
 OpenAI_Completion & OpenAI_Completion::setFrequencyPenalty(float p){
-  if(p >= -2.0 && p <= 2.0){
-    frequency_penalty = p;
-  }
+  openaiSetField(this, fields, &OpenAI_Completion::frequency_penalty, p);
   return *this;
 }
 
@@ -775,74 +2585,91 @@ OpenAI_Completion & OpenAI_Completion::setBestOf(unsigned int b){
   return *this;
 }
 
-OpenAI_Completion & OpenAI_Completion::setUser(const char * u){
-  if(user != NULL){
-    free((void*)user);
-  }
-  user = strdup(u);
-  return *this;
+OpenAI_Completion & OpenAI_Completion::setUser(const char * u){
+  if(user != NULL){
+    openai_free((void*)user);
+  }
+  user = openai_strdup(u, OPENAI_MEMORY_SETTINGS);
+  return *this;
+}
+
+OpenAI_Completion & OpenAI_Completion::setResponseBuffer(void * buffer, size_t size){
+  response_buffer = buffer;
+  response_buffer_size = size;
+  return *this;
+}
+
+OpenAI_Completion & OpenAI_Completion::setMaxContextTokens(unsigned int t){
+  max_context = t;
+  return *this;
+}
+
+// The prompt is referenced by the body, so it has to outlive the request
+bool OpenAI_Completion::buildRequest(OpenAI_JsonBody & body, const String & p, bool stream){
+  if(max_context){
+    unsigned int tokens = oai.countTokens(p.c_str());
+    if((tokens + max_tokens) > max_context){
+      log_e("Prompt of %u tokens does not fit in the context", tokens);
+      return false;
+    }
+  }
+  body.beginObject();
+  if(p.startsWith("[")){
+    if(!isJsonArray(p)){
+      log_e("Input not JSON Array!");
+      return false;
+    }
+    body.addRaw("prompt", p.c_str());
+  } else {
+    body.addString("prompt", p.c_str());
+  }
+  openaiWriteFields(this, fields, body);
+  if(stream){
+    // best_of can not be combined with stream
+    body.addBool("stream", true);
+  } else if(best_of != 1){
+    body.addInteger("best_of", best_of);
+  }
+  body.endObject();
+  return body.end();
+}
+
+OpenAI_StringResponse OpenAI_Completion::prompt(String p){
+  String endpoint = "completions";
+
+  OpenAI_StringResponse result = OpenAI_StringResponse(NULL);
+  OpenAI_JsonBody body;
+  if(!buildRequest(body, p, false)){
+    return result;
+  }
+
+  OpenAI_StringResponseParser parser(result, response_buffer, response_buffer_size);
+  // Only greedy sampling gives the same answer again
+  oai.post(endpoint, body, &parser, temperature == 0);
+  parser.end();
+  return result;
+}
+
+OpenAI_Future<OpenAI_StringResponse> OpenAI_Completion::promptAsync(String p){
+  OpenAI_Completion * completion = this;
+  return oai.async<OpenAI_StringResponse>([completion, p](){
+    return completion->prompt(p);
+  });
 }
 
-OpenAI_StringResponse OpenAI_Completion::prompt(String p){
+OpenAI_StringResponse OpenAI_Completion::streamPrompt(String p, OpenAI_StreamCallback cb){
   String endpoint = "completions";
 
   OpenAI_StringResponse result = OpenAI_StringResponse(NULL);
-  cJSON * req = cJSON_CreateObject();
-  if(req == NULL){
-    log_e("cJSON_CreateObject failed!");
+  OpenAI_JsonBody body;
+  if(!buildRequest(body, p, true)){
     return result;
   }
-  reqAddString("model", (model == NULL)?"text-davinci-003":model);
-  if(p.startsWith("[")){
-    cJSON * in = cJSON_Parse(p.c_str());
-    if(in == NULL || !cJSON_IsArray(in)){
-      log_e("Input not JSON Array!");
-      cJSON_Delete(req);
-      return result;
-    }
-    reqAddItem("prompt", in);
-  } else {
-    reqAddString("prompt", p.c_str());
-  }
-  if(max_tokens){
-    reqAddNumber("max_tokens", max_tokens);
-  }
-  if(temperature != 1){
-    reqAddNumber("temperature", temperature);
-  }
-  if(top_p != 1){
-    reqAddNumber("top_p", top_p);
-  }
-  if(n != 1){
-    reqAddNumber("n", n);
-  }
-  if(echo){
-    reqAddBool("echo", true);
-  }
-  if(stop != NULL){
-    reqAddString("stop", stop);
-  }
-  if(presence_penalty != 0){
-    reqAddNumber("presence_penalty", presence_penalty);
-  }
-  if(frequency_penalty != 0){
-    reqAddNumber("frequency_penalty", frequency_penalty);
-  }
-  if(best_of != 1){
-    reqAddNumber("best_of", best_of);
-  }
-  if(user != NULL){
-    reqAddString("user", user);
-  }
-  String jsonBody = String(cJSON_Print(req));
-  cJSON_Delete(req);
-  String res = oai.post(endpoint, jsonBody);
 
-  if(!res.length()){
-    log_e("Empty result!");
-    return result;
-  }
-  return OpenAI_StringResponse(res.c_str());
+  OpenAI_ChoiceStream stream(cb);
+  oai.post(endpoint, body, &stream);
+  stream.finish(result, response_buffer, response_buffer_size);
+  return result;
 }
 
 // chat/completions { //Given a chat conversation, the model will return a chat completion response.
@@ -864,6 +2691,17 @@ OpenAI_StringResponse OpenAI_Completion::prompt(String p){
 //   "user": null//string. A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
 // }
 
+const OpenAI_Field<OpenAI_ChatCompletion> OpenAI_ChatCompletion::fields[] = {
+  openaiText("model", &OpenAI_ChatCompletion::model, "gpt-3.5-turbo"),
+  openaiCount("max_tokens", &OpenAI_ChatCompletion::max_tokens, 0, 1),
+  openaiReal("temperature", &OpenAI_ChatCompletion::temperature, 1, 0, 2),
+  openaiReal("top_p", &OpenAI_ChatCompletion::top_p, 1, 0, 1),
+  openaiText("stop", &OpenAI_ChatCompletion::stop),
+  openaiReal("presence_penalty", &OpenAI_ChatCompletion::presence_penalty, 0, -2, 2),
+  openaiReal("frequency_penalty", &OpenAI_ChatCompletion::frequency_penalty, 0, -2, 2),
+  openaiText("user", &OpenAI_ChatCompletion::user)
+};
+
 OpenAI_ChatCompletion::OpenAI_ChatCompletion(OpenAI &openai)
   : oai(openai)
   , model(NULL)
@@ -875,215 +2713,367 @@ OpenAI_ChatCompletion::OpenAI_ChatCompletion(OpenAI &openai)
   , presence_penalty(0)
   , frequency_penalty(0)
   , user(NULL)
+  , max_context(0)
+  , compact_tokens(0)
+  , compact_bytes(0)
+  , compact_keep(2)
+  , summary(NULL)
+  , summary_tokens(0)
+  , conversation(0)
+  , response_buffer(NULL)
+  , response_buffer_size(0)
 {
-  messages = cJSON_CreateArray();
+  lock = xSemaphoreCreateRecursiveMutex();
 }
 
 OpenAI_ChatCompletion::~OpenAI_ChatCompletion(){
+  // The summary that is running writes to this object
+  compaction.wait();
+  if(summary != NULL){
+    openai_free(summary);
+  }
+  if(lock != NULL){
+    vSemaphoreDelete(lock);
+  }
   if(model != NULL){
-    free((void*)model);
+    openai_free((void*)model);
   }
   if(description != NULL){
-    free((void*)description);
+    openai_free((void*)description);
   }
   if(stop != NULL){
-    free((void*)stop);
+    openai_free((void*)stop);
   }
   if(user != NULL){
-    free((void*)user);
+    openai_free((void*)user);
   }
 }
 
 OpenAI_ChatCompletion & OpenAI_ChatCompletion::setModel(const char * m){
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
   if(model != NULL){
-    free((void*)model);
+    openai_free((void*)model);
   }
-  model = strdup(m);
+  model = openai_strdup(m, OPENAI_MEMORY_SETTINGS);
+  xSemaphoreGiveRecursive(lock);
   return *this;
 }
 
 OpenAI_ChatCompletion & OpenAI_ChatCompletion::setSystem(const char * s){
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
   if(description != NULL){
-    free((void*)description);
+    openai_free((void*)description);
   }
-  description = strdup(s);
+  description = openai_strdup(s, OPENAI_MEMORY_SETTINGS);
+  xSemaphoreGiveRecursive(lock);
   return *this;
 }
 
 OpenAI_ChatCompletion & OpenAI_ChatCompletion::setMaxTokens(unsigned int m){
-  if(m > 0){
-    max_tokens = m;
-  }
+  openaiSetField(this, fields, &OpenAI_ChatCompletion::max_tokens, m);
   return *this;
 }
 
 OpenAI_ChatCompletion & OpenAI_ChatCompletion::setTemperature(float t){
-  if(t >= 0 && t <= 2.0){
-    temperature = t;
-  }
+  openaiSetField(this, fields, &OpenAI_ChatCompletion::temperature, t);
   return *this;
 }
 
 OpenAI_ChatCompletion & OpenAI_ChatCompletion::setTopP(float t){
-  if(t >= 0 && t <= 1.0){
-    top_p = t;
-  }
+  openaiSetField(this, fields, &OpenAI_ChatCompletion::top_p, t);
   return *this;
 }
 
 OpenAI_ChatCompletion & OpenAI_ChatCompletion::setStop(const char * s){
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
   if(stop != NULL){
-    free((void*)stop);
+    openai_free((void*)stop);
   }
-  stop = strdup(s);
+  stop = openai_strdup(s, OPENAI_MEMORY_SETTINGS);
+  xSemaphoreGiveRecursive(lock);
   return *this;
 }
 
 OpenAI_ChatCompletion & OpenAI_ChatCompletion::setPresencePenalty(float p){
-  if(p >= -2.0 && p <= 2.0){
-    presence_penalty = p;
-  }
+  openaiSetField(this, fields, &OpenAI_ChatCompletion::presence_penalty, p);
   return *this;
 }
 
 OpenAI_ChatCompletion & OpenAI_ChatCompletion::setFrequencyPenalty(float p){
-  if(p >= -2.0 && p <= 2.0){
-    frequency_penalty = p;
-  }
+  openaiSetField(this, fields, &OpenAI_ChatCompletion::frequency_penalty, p);
   return *this;
 }
 
 OpenAI_ChatCompletion & OpenAI_ChatCompletion::setUser(const char * u){
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
   if(user != NULL){
-    free((void*)user);
+    openai_free((void*)user);
   }
-  user = strdup(u);
+  user = openai_strdup(u, OPENAI_MEMORY_SETTINGS);
+  xSemaphoreGiveRecursive(lock);
   return *this;
 }
 
-OpenAI_ChatCompletion & OpenAI_ChatCompletion::clearConversation(){
-  if(messages != NULL){
-    cJSON_Delete(messages);
-    messages = cJSON_CreateArray();
-  }
+OpenAI_ChatCompletion & OpenAI_ChatCompletion::setResponseBuffer(void * buffer, size_t size){
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  response_buffer = buffer;
+  response_buffer_size = size;
+  xSemaphoreGiveRecursive(lock);
   return *this;
 }
 
-static cJSON * createChatMessage(cJSON * messages, const char * role, const char * content){
-  cJSON * message = cJSON_CreateObject();
-  if(message == NULL){
-    log_e("cJSON_CreateObject failed!");
-    return NULL;
-  }
-  if(cJSON_AddStringToObject(message, "role", role) == NULL){
-    cJSON_Delete(message);
-    log_e("cJSON_AddStringToObject failed!");
-    return NULL;
-  }
-  if(cJSON_AddStringToObject(message, "content", content) == NULL){
-    cJSON_Delete(message);
-    log_e("cJSON_AddStringToObject failed!");
-    return NULL;
-  }
-  if(!cJSON_AddItemToArray(messages, message)){
-    cJSON_Delete(message);
-    log_e("cJSON_AddItemToArray failed!");
-    return NULL;
-  }
-  return message;
+OpenAI_ChatCompletion & OpenAI_ChatCompletion::setHistoryLimit(size_t bytes){
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  history.setMaxBytes(bytes);
+  xSemaphoreGiveRecursive(lock);
+  return *this;
 }
 
-OpenAI_StringResponse OpenAI_ChatCompletion::message(String p, bool save){
-  String endpoint = "chat/completions";
+OpenAI_ChatCompletion & OpenAI_ChatCompletion::setMaxContextTokens(unsigned int t){
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  max_context = t;
+  xSemaphoreGiveRecursive(lock);
+  return *this;
+}
 
-  OpenAI_StringResponse result = OpenAI_StringResponse(NULL);
-  cJSON * req = cJSON_CreateObject();
-  if(req == NULL){
-    log_e("cJSON_CreateObject failed!");
-    return result;
-  }
-  reqAddString("model", (model == NULL)?"gpt-3.5-turbo":model);
+OpenAI_ChatCompletion & OpenAI_ChatCompletion::setCompaction(unsigned int tokens, size_t bytes, unsigned int keep_turns){
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  compact_tokens = tokens;
+  compact_bytes = bytes;
+  compact_keep = keep_turns;
+  xSemaphoreGiveRecursive(lock);
+  return *this;
+}
 
-  cJSON * _messages = cJSON_CreateArray();
-  if(_messages == NULL){
-    cJSON_Delete(req);
-    log_e("cJSON_CreateArray failed!");
-    return result;
-  }
-  if(description != NULL){
-    if(createChatMessage(_messages, "system", description) == NULL){
-      cJSON_Delete(req);
-      cJSON_Delete(_messages);
-      log_e("createChatMessage failed!");
-      return result;
+OpenAI_ChatCompletion & OpenAI_ChatCompletion::clearConversation(){
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  history.clear();
+  if(summary != NULL){
+    openai_free(summary);
+    summary = NULL;
+  }
+  summary_tokens = 0;
+  // A summary that is still running belongs to the old conversation
+  conversation++;
+  xSemaphoreGiveRecursive(lock);
+  return *this;
+}
+
+static const char * chat_roles[] = {"system","user","assistant"};
+
+// Added by the API to every message and to prime the reply
+#define OPENAI_CHAT_MESSAGE_TOKENS  4
+#define OPENAI_CHAT_REPLY_TOKENS    3
+// Longest summary of the compacted turns
+#define OPENAI_CHAT_SUMMARY_TOKENS  256
+
+static const char * chat_summary_request = "Summarize the conversation so far in a few sentences, so that you can continue it from the summary alone. Keep names, facts, decisions and open questions.";
+static const char * chat_summary_prefix = "Summary of the earlier conversation: ";
+
+static void appendChatMessage(String & out, OpenAI_Chat_Role role, const char * content){
+  out += "{\"role\":\"";
+  out += chat_roles[role];
+  out += "\",\"content\":";
+  appendJsonString(out, content);
+  out += '}';
+}
+
+static void addChatMessage(OpenAI_JsonBody & body, OpenAI_Chat_Role role, const char * content){
+  body.beginObject();
+  body.addString("role", chat_roles[role]);
+  body.addString("content", content);
+  body.endObject();
+}
+
+// The messages are referenced by the body and escaped straight from the history while it is sent,
+// so the lock has to be held and the prompt kept until the request is done
+bool OpenAI_ChatCompletion::buildRequest(OpenAI_JsonBody & body, const String & p, bool stream){
+  // The oldest turns are dropped until the conversation fits in the context with the reply
+  if(max_context){
+    size_t fixed = OPENAI_CHAT_REPLY_TOKENS + OPENAI_CHAT_MESSAGE_TOKENS + oai.countTokens(p.c_str()) + max_tokens + summary_tokens;
+    if(description != NULL){
+      fixed += OPENAI_CHAT_MESSAGE_TOKENS + oai.countTokens(description);
     }
-  }
-  if(messages != NULL && cJSON_IsArray(messages)){
-    int mlen = cJSON_GetArraySize(messages);
-    for(int i = 0; i < mlen; ++i){
-      cJSON * item = cJSON_GetArrayItem(messages, i);
-      if(item != NULL && cJSON_IsObject(item)){
-        if(!cJSON_AddItemReferenceToArray(_messages, item)){
-          cJSON_Delete(req);
-          cJSON_Delete(_messages);
-          log_e("cJSON_AddItemReferenceToArray failed!");
-          return result;
-        }
-      }
+    if(fixed > max_context){
+      log_e("Message of %u tokens does not fit in the context", fixed);
+      return false;
+    }
+    while(history.length() && (fixed + history.tokens()) > max_context){
+      history.removeOldest();
     }
   }
-  if(createChatMessage(_messages, "user", p.c_str()) == NULL){
-    cJSON_Delete(req);
-    cJSON_Delete(_messages);
-    log_e("createChatMessage failed!");
-    return result;
-  }
-
-  reqAddItem("messages", _messages);
-  if(max_tokens){
-    reqAddNumber("max_tokens", max_tokens);
+  body.beginObject();
+  body.beginArray("messages");
+  if(description != NULL){
+    addChatMessage(body, OPENAI_CHAT_ROLE_SYSTEM, description);
+  }
+  if(summary != NULL){
+    addChatMessage(body, OPENAI_CHAT_ROLE_SYSTEM, summary);
+  }
+  size_t cursor = 0;
+  OpenAI_Chat_Role role;
+  const char * content;
+  size_t len;
+  while(history.read(cursor, role, content, len)){
+    addChatMessage(body, role, content);
+  }
+  addChatMessage(body, OPENAI_CHAT_ROLE_USER, p.c_str());
+  body.endArray();
+  openaiWriteFields(this, fields, body);
+  if(stream){
+    body.addBool("stream", true);
+  }
+  body.endObject();
+  return body.end();
+}
+
+void OpenAI_ChatCompletion::saveMessage(String p, const char * reply){
+  unsigned int question = OPENAI_CHAT_MESSAGE_TOKENS + oai.countTokens(p.c_str());
+  unsigned int answer = OPENAI_CHAT_MESSAGE_TOKENS + oai.countTokens(reply);
+  if(!history.add(OPENAI_CHAT_ROLE_USER, p.c_str(), question)){
+    log_e("Message could not be saved");
+  } else if(!history.add(OPENAI_CHAT_ROLE_ASSISTANT, reply, answer)){
+    log_e("Message could not be saved");
+    // A question without its reply would be followed by the next question. Making room drops the
+    // oldest turns first, so the question is still the newest record unless the history is empty
+    history.removeNewest();
+  }
+  startCompaction();
+}
+
+// Once the history passes the threshold, the turns before the last few are summarized on a worker.
+// Messages go on with the full history meanwhile, so no turn waits for the summary
+void OpenAI_ChatCompletion::startCompaction(){
+  if((!compact_tokens || history.tokens() <= compact_tokens) && (!compact_bytes || history.bytes() <= compact_bytes)){
+    return;
   }
-  if(temperature != 1){
-    reqAddNumber("temperature", temperature);
+  if(!compaction.ready()){
+    return;
   }
-  if(top_p != 1){
-    reqAddNumber("top_p", top_p);
+  size_t cursor = 0;
+  OpenAI_Chat_Role role;
+  const char * content;
+  size_t len;
+  unsigned int questions = 0;
+  while(history.read(cursor, role, content, len)){
+    if(role == OPENAI_CHAT_ROLE_USER){
+      questions++;
+    }
   }
-  if(stop != NULL){
-    reqAddString("stop", stop);
+  if(questions <= compact_keep){
+    return;
   }
-  if(presence_penalty != 0){
-    reqAddNumber("presence_penalty", presence_penalty);
+  String body;
+  if(!body.reserve(history.bytes() + ((summary != NULL)?strlen(summary):0) + 512)){
+    log_e("Summary request could not be allocated");
+    return;
   }
-  if(frequency_penalty != 0){
-    reqAddNumber("frequency_penalty", frequency_penalty);
+  body = "{\"model\":";
+  appendJsonString(body, (model == NULL)?"gpt-3.5-turbo":model);
+  body += ",\"messages\":[";
+  // The previous summary is folded into the new one
+  if(summary != NULL){
+    appendChatMessage(body, OPENAI_CHAT_ROLE_SYSTEM, summary);
+    body += ',';
+  }
+  unsigned long records = 0;
+  unsigned int seen = 0;
+  cursor = 0;
+  while(history.read(cursor, role, content, len)){
+    if(role == OPENAI_CHAT_ROLE_USER && seen++ == (questions - compact_keep)){
+      break;
+    }
+    appendChatMessage(body, role, content);
+    body += ',';
+    records++;
+  }
+  appendChatMessage(body, OPENAI_CHAT_ROLE_USER, chat_summary_request);
+  body += "],\"max_tokens\":";
+  body += OPENAI_CHAT_SUMMARY_TOKENS;
+  body += ",\"temperature\":0}";
+  OpenAI_ChatCompletion * chat = this;
+  unsigned long upto = history.dropped() + records;
+  unsigned int conv = conversation;
+  compaction = oai.async<OpenAI_StringResponse>([chat, body, upto, conv](){
+    return chat->compact(body, upto, conv);
+  });
+}
+
+// Runs on a worker. Replaces the summarized turns, unless they are gone already
+OpenAI_StringResponse OpenAI_ChatCompletion::compact(String body, unsigned long upto, unsigned int conv){
+  OpenAI_StringResponse result = OpenAI_StringResponse(NULL);
+  OpenAI_StringResponseParser parser(result);
+  oai.post("chat/completions", body, &parser);
+  parser.end();
+  if(!result.length()){
+    log_e("Conversation could not be summarized");
+    return result;
   }
-  if(user != NULL){
-    reqAddString("user", user);
+  String text = chat_summary_prefix;
+  text += result.getAt(0);
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  if(conv == conversation){
+    char * s = openai_strdup(text.c_str(), OPENAI_MEMORY_RESPONSE);
+    if(s == NULL){
+      log_e("Summary could not be allocated");
+    } else {
+      if(summary != NULL){
+        openai_free(summary);
+      }
+      summary = s;
+      summary_tokens = OPENAI_CHAT_MESSAGE_TOKENS + oai.countTokens(summary);
+      // Turns dropped for room in the meantime count as well
+      while(history.length() && history.dropped() < upto){
+        history.removeOldest();
+      }
+    }
   }
-  String jsonBody = String(cJSON_Print(req));
-  cJSON_Delete(req);
+  xSemaphoreGiveRecursive(lock);
+  return result;
+}
 
-  String res = oai.post(endpoint, jsonBody);
+OpenAI_StringResponse OpenAI_ChatCompletion::message(String p, bool save){
+  String endpoint = "chat/completions";
 
-  if(!res.length()){
-    log_e("Empty result!");
-    return result;
+  OpenAI_StringResponse result = OpenAI_StringResponse(NULL);
+  // Held for the whole exchange, so the reply is saved right after the history it answers
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  OpenAI_JsonBody body;
+  if(buildRequest(body, p, false)){
+    OpenAI_StringResponseParser parser(result, response_buffer, response_buffer_size);
+    oai.post(endpoint, body, &parser);
+    parser.end();
+    if(save && result.length()){
+      saveMessage(p, result.getAt(0));
+    }
   }
-  if(save){
-    //add the responses to the messages here
-    //double parsing is here as workaround
-    OpenAI_StringResponse r = OpenAI_StringResponse(res.c_str());
-    if(r.length()){
-      if(createChatMessage(messages, "user", p.c_str()) == NULL){
-        log_e("createChatMessage failed!");
-      }
-      if(createChatMessage(messages, "assistant", r.getAt(0)) == NULL){
-        log_e("createChatMessage failed!");
-      }
+  xSemaphoreGiveRecursive(lock);
+  return result;
+}
+
+OpenAI_Future<OpenAI_StringResponse> OpenAI_ChatCompletion::messageAsync(String p, bool save){
+  OpenAI_ChatCompletion * chat = this;
+  return oai.async<OpenAI_StringResponse>([chat, p, save](){
+    return chat->message(p, save);
+  }, &serial);
+}
+
+OpenAI_StringResponse OpenAI_ChatCompletion::streamMessage(String p, OpenAI_StreamCallback cb, bool save){
+  String endpoint = "chat/completions";
+
+  OpenAI_StringResponse result = OpenAI_StringResponse(NULL);
+  xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  OpenAI_JsonBody body;
+  if(buildRequest(body, p, true)){
+    OpenAI_ChoiceStream stream(cb);
+    oai.post(endpoint, body, &stream);
+    stream.finish(result, response_buffer, response_buffer_size);
+    if(save && result.length()){
+      saveMessage(p, result.getAt(0));
     }
   }
-  return OpenAI_StringResponse(res.c_str());
+  xSemaphoreGiveRecursive(lock);
+  return result;
 }
 
 // edits { //Creates a new edit for the provided input, instruction, and parameters.
@@ -1095,46 +3085,55 @@ OpenAI_StringResponse OpenAI_ChatCompletion::message(String p, bool save){
 //   "top_p": 1//float between 0 and 1. recommended to alter this or temperature but not both.
 // }
 
+const OpenAI_Field<OpenAI_Edit> OpenAI_Edit::fields[] = {
+  openaiText("model", &OpenAI_Edit::model, "text-davinci-edit-001"),
+  openaiReal("temperature", &OpenAI_Edit::temperature, 1, 0, 2),
+  openaiReal("top_p", &OpenAI_Edit::top_p, 1, 0, 1),
+  openaiCount("n", &OpenAI_Edit::n, 1, 1, OPENAI_MAX_CHOICES)
+};
+
 OpenAI_Edit::OpenAI_Edit(OpenAI &openai)
   : oai(openai)
   , model(NULL)
   , temperature(1)
   , top_p(1)
   , n(1)
+  , response_buffer(NULL)
+  , response_buffer_size(0)
 {}
 
 OpenAI_Edit::~OpenAI_Edit(){
   if(model != NULL){
-    free((void*)model);
+    openai_free((void*)model);
   }
 }
 
 OpenAI_Edit & OpenAI_Edit::setModel(const char * m){
   if(model != NULL){
-    free((void*)model);
+    openai_free((void*)model);
   }
-  model = strdup(m);
+  model = openai_strdup(m, OPENAI_MEMORY_SETTINGS);
   return *this;
 }
 
 OpenAI_Edit & OpenAI_Edit::setTemperature(float t){
-  if(t >= 0 && t <= 2.0){
-    temperature = t;
-  }
+  openaiSetField(this, fields, &OpenAI_Edit::temperature, t);
   return *this;
 }
 
 OpenAI_Edit & OpenAI_Edit::setTopP(float t){
-  if(t >= 0 && t <= 1.0){
-    top_p = t;
-  }
+  openaiSetField(this, fields, &OpenAI_Edit::top_p, t);
   return *this;
 }
 
 OpenAI_Edit & OpenAI_Edit::setN(unsigned int _n){
-  if(n > 0){
-    n = _n;
-  }
+  openaiSetField(this, fields, &OpenAI_Edit::n, _n);
+  return *this;
+}
+
+OpenAI_Edit & OpenAI_Edit::setResponseBuffer(void * buffer, size_t size){
+  response_buffer = buffer;
+  response_buffer_size = size;
   return *this;
 }
 
@@ -1142,35 +3141,26 @@ OpenAI_StringResponse OpenAI_Edit::process(String instruction, String input){
   String endpoint = "edits";
 
   OpenAI_StringResponse result = OpenAI_StringResponse(NULL);
-  cJSON * req = cJSON_CreateObject();
-  if(req == NULL){
-    log_e("cJSON_CreateObject failed!");
-    return result;
-  }
-  reqAddString("model", (model == NULL)?"text-davinci-edit-001":model);
-  reqAddString("instruction", instruction.c_str());
+  OpenAI_JsonBody body;
+  body.beginObject();
+  body.addString("instruction", instruction.c_str());
   if(input){
-    reqAddString("input", input.c_str());
+    body.addString("input", input.c_str());
   }
-  if(temperature != 1){
-    reqAddNumber("temperature", temperature);
-  }
-  if(top_p != 1){
-    reqAddNumber("top_p", top_p);
-  }
-  if(n != 1){
-    reqAddNumber("n", n);
-  }
-  String jsonBody = String(cJSON_Print(req));
-  cJSON_Delete(req);
-  
-  String res = oai.post(endpoint, jsonBody);
+  openaiWriteFields(this, fields, body);
+  body.endObject();
 
-  if(!res.length()){
-    log_e("Empty result!");
-    return result;
-  }
-  return OpenAI_StringResponse(res.c_str());
+  OpenAI_StringResponseParser parser(result, response_buffer, response_buffer_size);
+  oai.post(endpoint, body, &parser, temperature == 0);
+  parser.end();
+  return result;
+}
+
+OpenAI_Future<OpenAI_StringResponse> OpenAI_Edit::processAsync(String instruction, String input){
+  OpenAI_Edit * edit = this;
+  return oai.async<OpenAI_StringResponse>([edit, instruction, input](){
+    return edit->process(instruction, input);
+  });
 }
 
 //
@@ -1188,46 +3178,69 @@ static const char * image_response_formats[] = {"url","b64_json"};
 //   "user": null//string. A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
 // }
 
+const OpenAI_Field<OpenAI_ImageGeneration> OpenAI_ImageGeneration::fields[] = {
+  openaiChoice("size", &OpenAI_ImageGeneration::size, image_sizes, 3),
+  openaiChoice("response_format", &OpenAI_ImageGeneration::response_format, image_response_formats, 2),
+  openaiCount("n", &OpenAI_ImageGeneration::n, 1, 1, 10),
+  openaiText("user", &OpenAI_ImageGeneration::user)
+};
+
 OpenAI_ImageGeneration::OpenAI_ImageGeneration(OpenAI &openai)
   : oai(openai)
   , size(OPENAI_IMAGE_SIZE_1024x1024)
   , response_format(OPENAI_IMAGE_RESPONSE_FORMAT_URL)
+  , chosen_format(OPENAI_IMAGE_RESPONSE_FORMAT_URL)
   , n(1)
   , user(NULL)
+  , response_buffer(NULL)
+  , response_buffer_size(0)
+  , output(nullptr)
 {}
 
 OpenAI_ImageGeneration::~OpenAI_ImageGeneration(){
   if(user != NULL){
-    free((void*)user);
+    openai_free((void*)user);
   }
 }
 
 OpenAI_ImageGeneration & OpenAI_ImageGeneration::setSize(OpenAI_Image_Size s){
-  if(s >= OPENAI_IMAGE_SIZE_1024x1024 && s <= OPENAI_IMAGE_SIZE_256x256){
-    size = s;
-  }
+  openaiSetField(this, fields, &OpenAI_ImageGeneration::size, s);
   return *this;
 }
 
 OpenAI_ImageGeneration & OpenAI_ImageGeneration::setResponseFormat(OpenAI_Image_Response_Format f){
-  if(f >= OPENAI_IMAGE_RESPONSE_FORMAT_URL && f <= OPENAI_IMAGE_RESPONSE_FORMAT_B64_JSON){
-    response_format = f;
+  if(openaiSetField(this, fields, &OpenAI_ImageGeneration::response_format, f)){
+    chosen_format = f;
+    imageSetOutput(output, response_format, chosen_format, output);
   }
   return *this;
 }
 
 OpenAI_ImageGeneration & OpenAI_ImageGeneration::setN(unsigned int _n){
-  if(n > 0 && n <= 10){
-    n = _n;
-  }
+  openaiSetField(this, fields, &OpenAI_ImageGeneration::n, _n);
   return *this;
 }
 
 OpenAI_ImageGeneration & OpenAI_ImageGeneration::setUser(const char * u){
   if(user != NULL){
-    free((void*)user);
+    openai_free((void*)user);
   }
-  user = strdup(u);
+  user = openai_strdup(u, OPENAI_MEMORY_SETTINGS);
+  return *this;
+}
+
+OpenAI_ImageGeneration & OpenAI_ImageGeneration::setResponseBuffer(void * buffer, size_t size){
+  response_buffer = buffer;
+  response_buffer_size = size;
+  return *this;
+}
+
+OpenAI_ImageGeneration & OpenAI_ImageGeneration::setOutput(Print * out){
+  return setOutputCallback(imageOutput(out));
+}
+
+OpenAI_ImageGeneration & OpenAI_ImageGeneration::setOutputCallback(OpenAI_ImageCallback cb){
+  imageSetOutput(output, response_format, chosen_format, cb);
   return *this;
 }
 
@@ -1235,32 +3248,23 @@ OpenAI_ImageResponse OpenAI_ImageGeneration::prompt(String p){
   String endpoint = "images/generations";
 
   OpenAI_ImageResponse result = OpenAI_ImageResponse(NULL);
-  cJSON * req = cJSON_CreateObject();
-  if(req == NULL){
-    log_e("cJSON_CreateObject failed!");
-    return result;
-  }
-  reqAddString("prompt", p.c_str());
-  if(size != OPENAI_IMAGE_SIZE_1024x1024){
-    reqAddString("size", image_sizes[size]);
-  }
-  if(response_format != OPENAI_IMAGE_RESPONSE_FORMAT_URL){
-    reqAddString("response_format", image_response_formats[response_format]);
-  }
-  if(n != 1){
-    reqAddNumber("n", n);
-  }
-  if(user != NULL){
-    reqAddString("user", user);
-  }
-  String jsonBody = String(cJSON_Print(req));
-  cJSON_Delete(req);
-  String res = oai.post(endpoint, jsonBody);
-  if(!res.length()){
-    log_e("Empty result!");
-    return result;
-  }
-  return OpenAI_ImageResponse(res.c_str());
+  OpenAI_JsonBody body;
+  body.beginObject();
+  body.addString("prompt", p.c_str());
+  openaiWriteFields(this, fields, body);
+  body.endObject();
+
+  OpenAI_ImageResponseParser parser(result, response_buffer, response_buffer_size, output);
+  oai.post(endpoint, body, &parser);
+  parser.end();
+  return result;
+}
+
+OpenAI_Future<OpenAI_ImageResponse> OpenAI_ImageGeneration::promptAsync(String p){
+  OpenAI_ImageGeneration * generation = this;
+  return oai.async<OpenAI_ImageResponse>([generation, p](){
+    return generation->prompt(p);
+  });
 }
 
 // images/variations { //Creates a variation of a given image.
@@ -1271,97 +3275,100 @@ OpenAI_ImageResponse OpenAI_ImageGeneration::prompt(String p){
 //   "user": null//string. A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
 // }
 
+const OpenAI_Field<OpenAI_ImageVariation> OpenAI_ImageVariation::fields[] = {
+  openaiChoice("size", &OpenAI_ImageVariation::size, image_sizes, 3),
+  openaiChoice("response_format", &OpenAI_ImageVariation::response_format, image_response_formats, 2),
+  openaiCount("n", &OpenAI_ImageVariation::n, 1, 1, 10),
+  openaiText("user", &OpenAI_ImageVariation::user)
+};
+
 OpenAI_ImageVariation::OpenAI_ImageVariation(OpenAI &openai)
   : oai(openai)
   , size(OPENAI_IMAGE_SIZE_1024x1024)
   , response_format(OPENAI_IMAGE_RESPONSE_FORMAT_URL)
+  , chosen_format(OPENAI_IMAGE_RESPONSE_FORMAT_URL)
   , n(1)
   , user(NULL)
+  , response_buffer(NULL)
+  , response_buffer_size(0)
+  , output(nullptr)
 {}
 
 OpenAI_ImageVariation::~OpenAI_ImageVariation(){
   if(user != NULL){
-    free((void*)user);
+    openai_free((void*)user);
   }
 }
 
 OpenAI_ImageVariation & OpenAI_ImageVariation::setSize(OpenAI_Image_Size s){
-  if(s >= OPENAI_IMAGE_SIZE_1024x1024 && s <= OPENAI_IMAGE_SIZE_256x256){
-    size = s;
-  }
+  openaiSetField(this, fields, &OpenAI_ImageVariation::size, s);
   return *this;
 }
 
 OpenAI_ImageVariation & OpenAI_ImageVariation::setResponseFormat(OpenAI_Image_Response_Format f){
-  if(f >= OPENAI_IMAGE_RESPONSE_FORMAT_URL && f <= OPENAI_IMAGE_RESPONSE_FORMAT_B64_JSON){
-    response_format = f;
+  if(openaiSetField(this, fields, &OpenAI_ImageVariation::response_format, f)){
+    chosen_format = f;
+    imageSetOutput(output, response_format, chosen_format, output);
   }
   return *this;
 }
 
 OpenAI_ImageVariation & OpenAI_ImageVariation::setN(unsigned int _n){
-  if(n > 0 && n <= 10){
-    n = _n;
-  }
+  openaiSetField(this, fields, &OpenAI_ImageVariation::n, _n);
   return *this;
 }
 
 OpenAI_ImageVariation & OpenAI_ImageVariation::setUser(const char * u){
   if(user != NULL){
-    free((void*)user);
+    openai_free((void*)user);
   }
-  user = strdup(u);
+  user = openai_strdup(u, OPENAI_MEMORY_SETTINGS);
   return *this;
 }
 
-OpenAI_ImageResponse OpenAI_ImageVariation::image(uint8_t * img_data, size_t img_len){
+OpenAI_ImageVariation & OpenAI_ImageVariation::setResponseBuffer(void * buffer, size_t size){
+  response_buffer = buffer;
+  response_buffer_size = size;
+  return *this;
+}
+
+OpenAI_ImageVariation & OpenAI_ImageVariation::setOutput(Print * out){
+  return setOutputCallback(imageOutput(out));
+}
+
+OpenAI_ImageVariation & OpenAI_ImageVariation::setOutputCallback(OpenAI_ImageCallback cb){
+  imageSetOutput(output, response_format, chosen_format, cb);
+  return *this;
+}
+
+OpenAI_ImageResponse OpenAI_ImageVariation::send(OpenAI_Multipart & body){
   String endpoint = "images/variations";
-  String boundary = "----WebKitFormBoundaryb9v538xFWfzLzRO3";
-  String itemPrefix = "--" +boundary+ "\r\nContent-Disposition: form-data; name=";
-  uint8_t * data = NULL;
-  size_t len = 0;
   OpenAI_ImageResponse result = OpenAI_ImageResponse(NULL);
+  OpenAI_ImageResponseParser parser(result, response_buffer, response_buffer_size, output);
+  oai.upload(endpoint, body, &parser);
+  parser.end();
+  return result;
+}
 
-  String reqBody = "";
-  if(size != OPENAI_IMAGE_SIZE_1024x1024){
-    reqBody += itemPrefix+"\"size\"\r\n\r\n"+String(image_sizes[size])+"\r\n";
-  }
-  if(response_format != OPENAI_IMAGE_RESPONSE_FORMAT_URL){
-    reqBody += itemPrefix+"\"response_format\"\r\n\r\n"+String(image_response_formats[response_format])+"\r\n";
-  }
-  if(n != 1){
-    reqBody += itemPrefix+"\"n\"\r\n\r\n"+String(n)+"\r\n";
-  }
-  if(user != NULL){
-    reqBody += itemPrefix+"\"user\"\r\n\r\n"+String(user)+"\r\n";
-  }
-  reqBody += itemPrefix+"\"image\"; filename=\"image.png\"\r\nContent-Type: image/png\r\n\r\n";
-
-  String reqEndBody = "\r\n--" +boundary+ "--\r\n";
+OpenAI_ImageResponse OpenAI_ImageVariation::image(uint8_t * img_data, size_t img_len){
+  OpenAI_Multipart body("----WebKitFormBoundaryb9v538xFWfzLzRO3");
+  openaiWriteFields(this, fields, body);
+  body.addFile("image", "image.png", "image/png", img_data, img_len);
+  return send(body);
+}
 
-  len = reqBody.length() + reqEndBody.length() + img_len;
+OpenAI_ImageResponse OpenAI_ImageVariation::image(Stream & img, size_t img_len){
+  OpenAI_Multipart body("----WebKitFormBoundaryb9v538xFWfzLzRO3");
+  openaiWriteFields(this, fields, body);
+  body.addFile("image", "image.png", "image/png", &img, img_len);
+  return send(body);
+}
 
-  data = (uint8_t*)malloc(len + 1);
-  if(data == NULL){
-    log_e("Failed to allocate request buffer! Len: %u", len);
-    return result;
-  }
-  uint8_t * d = data;
-  memcpy(d, reqBody.c_str(), reqBody.length());
-  d += reqBody.length();
-  memcpy(d, img_data, img_len);
-  d += img_len;
-  memcpy(d, reqEndBody.c_str(), reqEndBody.length());
-  d += reqEndBody.length();
-  *d = 0;
-
-  String res = oai.upload(endpoint, boundary, data, len);
-  free(data);
-  if(!res.length()){
-    log_e("Empty result!");
-    return result;
-  }
-  return OpenAI_ImageResponse(res.c_str());
+OpenAI_ImageResponse OpenAI_ImageVariation::image(fs::File & img){
+  OpenAI_Multipart body("----WebKitFormBoundaryb9v538xFWfzLzRO3");
+  openaiWriteFields(this, fields, body);
+  body.addFile("image", "image.png", "image/png", img);
+  return send(body);
 }
 
 // images/edits { //Creates an edited or extended image given an original image and a prompt.
@@ -1374,127 +3381,125 @@ OpenAI_ImageResponse OpenAI_ImageVariation::image(uint8_t * img_data, size_t img
 //   "user": null//string. A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
 // }
 
+const OpenAI_Field<OpenAI_ImageEdit> OpenAI_ImageEdit::fields[] = {
+  openaiText("prompt", &OpenAI_ImageEdit::prompt),
+  openaiChoice("size", &OpenAI_ImageEdit::size, image_sizes, 3),
+  openaiChoice("response_format", &OpenAI_ImageEdit::response_format, image_response_formats, 2),
+  openaiCount("n", &OpenAI_ImageEdit::n, 1, 1, 10),
+  openaiText("user", &OpenAI_ImageEdit::user)
+};
+
 OpenAI_ImageEdit::OpenAI_ImageEdit(OpenAI &openai)
   : oai(openai)
   , prompt(NULL)
   , size(OPENAI_IMAGE_SIZE_1024x1024)
   , response_format(OPENAI_IMAGE_RESPONSE_FORMAT_URL)
+  , chosen_format(OPENAI_IMAGE_RESPONSE_FORMAT_URL)
   , n(1)
   , user(NULL)
+  , response_buffer(NULL)
+  , response_buffer_size(0)
+  , output(nullptr)
 {}
 
 OpenAI_ImageEdit::~OpenAI_ImageEdit(){
   if(prompt != NULL){
-    free((void*)prompt);
+    openai_free((void*)prompt);
   }
   if(user != NULL){
-    free((void*)user);
+    openai_free((void*)user);
   }
 }
 
 OpenAI_ImageEdit & OpenAI_ImageEdit::setPrompt(const char * p){
   if(prompt != NULL){
-    free((void*)prompt);
+    openai_free((void*)prompt);
     prompt = NULL;
   }
   if(p != NULL){
-    prompt = strdup(p);
+    prompt = openai_strdup(p, OPENAI_MEMORY_SETTINGS);
   }
   return *this;
 }
 
 OpenAI_ImageEdit & OpenAI_ImageEdit::setSize(OpenAI_Image_Size s){
-  if(s >= OPENAI_IMAGE_SIZE_1024x1024 && s <= OPENAI_IMAGE_SIZE_256x256){
-    size = s;
-  }
+  openaiSetField(this, fields, &OpenAI_ImageEdit::size, s);
   return *this;
 }
 
 OpenAI_ImageEdit & OpenAI_ImageEdit::setResponseFormat(OpenAI_Image_Response_Format f){
-  if(f >= OPENAI_IMAGE_RESPONSE_FORMAT_URL && f <= OPENAI_IMAGE_RESPONSE_FORMAT_B64_JSON){
-    response_format = f;
+  if(openaiSetField(this, fields, &OpenAI_ImageEdit::response_format, f)){
+    chosen_format = f;
+    imageSetOutput(output, response_format, chosen_format, output);
   }
   return *this;
 }
 
 OpenAI_ImageEdit & OpenAI_ImageEdit::setN(unsigned int _n){
-  if(n > 0 && n <= 10){
-    n = _n;
-  }
+  openaiSetField(this, fields, &OpenAI_ImageEdit::n, _n);
   return *this;
 }
 
 OpenAI_ImageEdit & OpenAI_ImageEdit::setUser(const char * u){
   if(user != NULL){
-    free((void*)user);
+    openai_free((void*)user);
   }
-  user = strdup(u);
+  user = openai_strdup(u, OPENAI_MEMORY_SETTINGS);
   return *this;
 }
 
-OpenAI_ImageResponse OpenAI_ImageEdit::image(uint8_t * img_data, size_t img_len, uint8_t * mask_data, size_t mask_len){
-  String endpoint = "images/edits";
-  String boundary = "----WebKitFormBoundaryb9v538xFWfzLzRO3";
-  String itemPrefix = "--" +boundary+ "\r\nContent-Disposition: form-data; name=";
-  uint8_t * data = NULL;
-  size_t len = 0;
-  OpenAI_ImageResponse result = OpenAI_ImageResponse(NULL);
+OpenAI_ImageEdit & OpenAI_ImageEdit::setResponseBuffer(void * buffer, size_t size){
+  response_buffer = buffer;
+  response_buffer_size = size;
+  return *this;
+}
 
-  String reqBody = "";
-  if(prompt != NULL){
-    reqBody += itemPrefix+"\"prompt\"\r\n\r\n"+String(prompt)+"\r\n";
-  }
-  if(size != OPENAI_IMAGE_SIZE_1024x1024){
-    reqBody += itemPrefix+"\"size\"\r\n\r\n"+String(image_sizes[size])+"\r\n";
-  }
-  if(response_format != OPENAI_IMAGE_RESPONSE_FORMAT_URL){
-    reqBody += itemPrefix+"\"response_format\"\r\n\r\n"+String(image_response_formats[response_format])+"\r\n";
-  }
-  if(n != 1){
-    reqBody += itemPrefix+"\"n\"\r\n\r\n"+String(n)+"\r\n";
-  }
-  if(user != NULL){
-    reqBody += itemPrefix+"\"user\"\r\n\r\n"+String(user)+"\r\n";
-  }
-  reqBody += itemPrefix+"\"image\"; filename=\"image.png\"\r\nContent-Type: image/png\r\n\r\n";
+OpenAI_ImageEdit & OpenAI_ImageEdit::setOutput(Print * out){
+  return setOutputCallback(imageOutput(out));
+}
 
-  String reqEndBody = "\r\n--" +boundary+ "--\r\n";
+OpenAI_ImageEdit & OpenAI_ImageEdit::setOutputCallback(OpenAI_ImageCallback cb){
+  imageSetOutput(output, response_format, chosen_format, cb);
+  return *this;
+}
 
-  len = reqBody.length() + reqEndBody.length() + img_len;
+OpenAI_ImageResponse OpenAI_ImageEdit::send(OpenAI_Multipart & body){
+  String endpoint = "images/edits";
+  OpenAI_ImageResponse result = OpenAI_ImageResponse(NULL);
+  OpenAI_ImageResponseParser parser(result, response_buffer, response_buffer_size, output);
+  oai.upload(endpoint, body, &parser);
+  parser.end();
+  return result;
+}
 
-  String maskBody = "";
+OpenAI_ImageResponse OpenAI_ImageEdit::image(uint8_t * img_data, size_t img_len, uint8_t * mask_data, size_t mask_len){
+  OpenAI_Multipart body("----WebKitFormBoundaryb9v538xFWfzLzRO3");
+  openaiWriteFields(this, fields, body);
+  body.addFile("image", "image.png", "image/png", img_data, img_len);
   if(mask_data != NULL && mask_len > 0){
-    maskBody += "\r\n"+itemPrefix+"\"mask\"; filename=\"mask.png\"\r\nContent-Type: image/png\r\n\r\n";
-    len += maskBody.length() + mask_len;
+    body.addFile("mask", "mask.png", "image/png", mask_data, mask_len);
   }
+  return send(body);
+}
 
-  data = (uint8_t*)malloc(len + 1);
-  if(data == NULL){
-    log_e("Failed to allocate request buffer! Len: %u", len);
-    return result;
+OpenAI_ImageResponse OpenAI_ImageEdit::image(Stream & img, size_t img_len, Stream * mask, size_t mask_len){
+  OpenAI_Multipart body("----WebKitFormBoundaryb9v538xFWfzLzRO3");
+  openaiWriteFields(this, fields, body);
+  body.addFile("image", "image.png", "image/png", &img, img_len);
+  if(mask != NULL && mask_len > 0){
+    body.addFile("mask", "mask.png", "image/png", mask, mask_len);
   }
-  uint8_t * d = data;
-  memcpy(d, reqBody.c_str(), reqBody.length());
-  d += reqBody.length();
-  memcpy(d, img_data, img_len);
-  d += img_len;
-  if(mask_data != NULL && mask_len > 0){
-    memcpy(d, maskBody.c_str(), maskBody.length());
-    d += maskBody.length();
-    memcpy(d, mask_data, mask_len);
-    d += mask_len;
-  }
-  memcpy(d, reqEndBody.c_str(), reqEndBody.length());
-  d += reqEndBody.length();
-  *d = 0;
-
-  String res = oai.upload(endpoint, boundary, data, len);
-  free(data);
-  if(!res.length()){
-    log_e("Empty result!");
-    return result;
+  return send(body);
+}
+
+OpenAI_ImageResponse OpenAI_ImageEdit::image(fs::File & img, fs::File * mask){
+  OpenAI_Multipart body("----WebKitFormBoundaryb9v538xFWfzLzRO3");
+  openaiWriteFields(this, fields, body);
+  body.addFile("image", "image.png", "image/png", img);
+  if(mask != NULL && *mask){
+    body.addFile("mask", "mask.png", "image/png", *mask);
   }
-  return OpenAI_ImageResponse(res.c_str());
+  return send(body);
 }
 
 // audio/transcriptions { //Transcribes audio into the input language.
@@ -1531,6 +3536,14 @@ static const char * audio_response_formats[] = {"json", "text", "srt", "verbose_
     float temperature;
     const char * language;
 
+const OpenAI_Field<OpenAI_AudioTranscription> OpenAI_AudioTranscription::fields[] = {
+  openaiText<OpenAI_AudioTranscription>("model", nullptr, "whisper-1"),
+  openaiText("prompt", &OpenAI_AudioTranscription::prompt),
+  openaiChoice("response_format", &OpenAI_AudioTranscription::response_format, audio_response_formats, 5),
+  openaiReal("temperature", &OpenAI_AudioTranscription::temperature, 0, 0, 2),
+  openaiText("language", &OpenAI_AudioTranscription::language)
+};
+
 OpenAI_AudioTranscription::OpenAI_AudioTranscription(OpenAI &openai)
   : oai(openai)
   , prompt(NULL)
@@ -1541,107 +3554,71 @@ OpenAI_AudioTranscription::OpenAI_AudioTranscription(OpenAI &openai)
 
 OpenAI_AudioTranscription::~OpenAI_AudioTranscription(){
   if(prompt != NULL){
-    free((void*)prompt);
+    openai_free((void*)prompt);
   }
   if(language != NULL){
-    free((void*)language);
+    openai_free((void*)language);
   }
 }
 
 OpenAI_AudioTranscription & OpenAI_AudioTranscription::setPrompt(const char * p){
   if(prompt != NULL){
-    free((void*)prompt);
+    openai_free((void*)prompt);
     prompt = NULL;
   }
   if(p != NULL){
-    prompt = strdup(p);
+    prompt = openai_strdup(p, OPENAI_MEMORY_SETTINGS);
   }
   return *this;
 }
 
 OpenAI_AudioTranscription & OpenAI_AudioTranscription::setResponseFormat(OpenAI_Audio_Response_Format f){
-  if(f >= OPENAI_AUDIO_RESPONSE_FORMAT_JSON && f <= OPENAI_AUDIO_RESPONSE_FORMAT_VTT){
-    response_format = f;
-  }
+  openaiSetField(this, fields, &OpenAI_AudioTranscription::response_format, f);
   return *this;
 }
 
 OpenAI_AudioTranscription & OpenAI_AudioTranscription::setTemperature(float t){
-  if(t >= 0 && t <= 2.0){
-    temperature = t;
-  }
+  openaiSetField(this, fields, &OpenAI_AudioTranscription::temperature, t);
   return *this;
 }
 
 OpenAI_AudioTranscription & OpenAI_AudioTranscription::setLanguage(const char * l){
   if(language != NULL){
-    free((void*)language);
+    openai_free((void*)language);
     language = NULL;
   }
   if(l != NULL){
-    language = strdup(l);
+    language = openai_strdup(l, OPENAI_MEMORY_SETTINGS);
   }
   return *this;
 }
 
-String OpenAI_AudioTranscription::file(uint8_t * audio_data, size_t audio_len, OpenAI_Audio_Input_Format f){
+String OpenAI_AudioTranscription::send(OpenAI_Multipart & body){
   String endpoint = "audio/transcriptions";
-  String boundary = "----WebKitFormBoundary9HKFexBRLrf9dcpY";
-  String itemPrefix = "--" +boundary+ "\r\nContent-Disposition: form-data; name=";
-  uint8_t * data = NULL;
-  size_t len = 0;
+  OpenAI_TextParser parser;
+  oai.upload(endpoint, body, &parser);
+  return parser.end();
+}
 
-  String reqBody = itemPrefix+"\"model\"\r\n\r\nwhisper-1\r\n";
-  if(prompt != NULL){
-    reqBody += itemPrefix+"\"prompt\"\r\n\r\n"+String(prompt)+"\r\n";
-  }
-  if(response_format != OPENAI_AUDIO_RESPONSE_FORMAT_JSON){
-    reqBody += itemPrefix+"\"response_format\"\r\n\r\n"+String(audio_response_formats[response_format])+"\r\n";
-  }
-  if(temperature != 0){
-    reqBody += itemPrefix+"\"temperature\"\r\n\r\n"+String(temperature)+"\r\n";
-  }
-  if(language != NULL){
-    reqBody += itemPrefix+"\"language\"\r\n\r\n"+String(language)+"\r\n";
-  }
-  reqBody += itemPrefix+"\"file\"; filename=\"audio."+String(audio_input_formats[f])+"\"\r\nContent-Type: "+String(audio_input_mime[f])+"\r\n\r\n";
+String OpenAI_AudioTranscription::file(uint8_t * audio_data, size_t audio_len, OpenAI_Audio_Input_Format f){
+  OpenAI_Multipart body("----WebKitFormBoundary9HKFexBRLrf9dcpY");
+  openaiWriteFields(this, fields, body);
+  body.addFile("file", ("audio."+String(audio_input_formats[f])).c_str(), audio_input_mime[f], audio_data, audio_len);
+  return send(body);
+}
 
-  String reqEndBody = "\r\n--" +boundary+ "--\r\n";
+String OpenAI_AudioTranscription::file(Stream & audio, size_t audio_len, OpenAI_Audio_Input_Format f){
+  OpenAI_Multipart body("----WebKitFormBoundary9HKFexBRLrf9dcpY");
+  openaiWriteFields(this, fields, body);
+  body.addFile("file", ("audio."+String(audio_input_formats[f])).c_str(), audio_input_mime[f], &audio, audio_len);
+  return send(body);
+}
 
-  len = reqBody.length() + reqEndBody.length() + audio_len;
-  data = (uint8_t*)malloc(len + 1);
-  if(data == NULL){
-    log_e("Failed to allocate request buffer! Len: %u", len);
-    return String();
-  }
-  uint8_t * d = data;
-  memcpy(d, reqBody.c_str(), reqBody.length());
-  d += reqBody.length();
-  memcpy(d, audio_data, audio_len);
-  d += audio_len;
-  memcpy(d, reqEndBody.c_str(), reqEndBody.length());
-  d += reqEndBody.length();
-  *d = 0;
-
-  String result = oai.upload(endpoint, boundary, data, len);
-  free(data);
-  if(!result.length()){
-    log_e("Empty result!");
-    return result;
-  }
-  cJSON * json = cJSON_Parse(result.c_str());
-  String error = getJsonError(json);
-  result = "";
-  if(error.length()){
-    log_e("%s",error.c_str());
-  } else {
-    if(cJSON_HasObjectItem(json, "text")){
-      cJSON * text = cJSON_GetObjectItem(json, "text");
-      result = String(cJSON_GetStringValue(text));
-    }
-  }
-  cJSON_Delete(json);
-  return result;
+String OpenAI_AudioTranscription::file(fs::File & audio, OpenAI_Audio_Input_Format f){
+  OpenAI_Multipart body("----WebKitFormBoundary9HKFexBRLrf9dcpY");
+  openaiWriteFields(this, fields, body);
+  body.addFile("file", ("audio."+String(audio_input_formats[f])).c_str(), audio_input_mime[f], audio);
+  return send(body);
 }
 
 // audio/translations { //Translates audio into into English.
@@ -1652,6 +3629,13 @@ String OpenAI_AudioTranscription::file(uint8_t * audio_data, size_t audio_len, O
 //   "temperature": 1//float between 0 and 2
 // }
 
+const OpenAI_Field<OpenAI_AudioTranslation> OpenAI_AudioTranslation::fields[] = {
+  openaiText<OpenAI_AudioTranslation>("model", nullptr, "whisper-1"),
+  openaiText("prompt", &OpenAI_AudioTranslation::prompt),
+  openaiChoice("response_format", &OpenAI_AudioTranslation::response_format, audio_response_formats, 5),
+  openaiReal("temperature", &OpenAI_AudioTranslation::temperature, 0, 0, 2)
+};
+
 OpenAI_AudioTranslation::OpenAI_AudioTranslation(OpenAI &openai)
   : oai(openai)
   , prompt(NULL)
@@ -1661,90 +3645,57 @@ OpenAI_AudioTranslation::OpenAI_AudioTranslation(OpenAI &openai)
 
 OpenAI_AudioTranslation::~OpenAI_AudioTranslation(){
   if(prompt != NULL){
-    free((void*)prompt);
+    openai_free((void*)prompt);
   }
 }
 
 OpenAI_AudioTranslation & OpenAI_AudioTranslation::setPrompt(const char * p){
   if(prompt != NULL){
-    free((void*)prompt);
+    openai_free((void*)prompt);
     prompt = NULL;
   }
   if(p != NULL){
-    prompt = strdup(p);
+    prompt = openai_strdup(p, OPENAI_MEMORY_SETTINGS);
   }
   return *this;
 }
 
 OpenAI_AudioTranslation & OpenAI_AudioTranslation::setResponseFormat(OpenAI_Audio_Response_Format f){
-  if(f >= OPENAI_AUDIO_RESPONSE_FORMAT_JSON && f <= OPENAI_AUDIO_RESPONSE_FORMAT_VTT){
-    response_format = f;
-  }
+  openaiSetField(this, fields, &OpenAI_AudioTranslation::response_format, f);
   return *this;
 }
 
 OpenAI_AudioTranslation & OpenAI_AudioTranslation::setTemperature(float t){
-  if(t >= 0 && t <= 2.0){
-    temperature = t;
-  }
+  openaiSetField(this, fields, &OpenAI_AudioTranslation::temperature, t);
   return *this;
 }
 
-String OpenAI_AudioTranslation::file(uint8_t * audio_data, size_t audio_len, OpenAI_Audio_Input_Format f){
+String OpenAI_AudioTranslation::send(OpenAI_Multipart & body){
   String endpoint = "audio/translations";
-  String boundary = "----WebKitFormBoundary9HKFexBRLrf9dcpY";
-  String itemPrefix = "--" +boundary+ "\r\nContent-Disposition: form-data; name=";
-  uint8_t * data = NULL;
-  size_t len = 0;
+  OpenAI_TextParser parser;
+  oai.upload(endpoint, body, &parser);
+  return parser.end();
+}
 
-  String reqBody = itemPrefix+"\"model\"\r\n\r\nwhisper-1\r\n";
-  if(prompt != NULL){
-    reqBody += itemPrefix+"\"prompt\"\r\n\r\n"+String(prompt)+"\r\n";
-  }
-  if(response_format != OPENAI_AUDIO_RESPONSE_FORMAT_JSON){
-    reqBody += itemPrefix+"\"response_format\"\r\n\r\n"+String(audio_response_formats[response_format])+"\r\n";
-  }
-  if(temperature != 0){
-    reqBody += itemPrefix+"\"temperature\"\r\n\r\n"+String(temperature)+"\r\n";
-  }
-  reqBody += itemPrefix+"\"file\"; filename=\"audio."+String(audio_input_formats[f])+"\"\r\nContent-Type: "+String(audio_input_mime[f])+"\r\n\r\n";
+String OpenAI_AudioTranslation::file(uint8_t * audio_data, size_t audio_len, OpenAI_Audio_Input_Format f){
+  OpenAI_Multipart body("----WebKitFormBoundary9HKFexBRLrf9dcpY");
+  openaiWriteFields(this, fields, body);
+  body.addFile("file", ("audio."+String(audio_input_formats[f])).c_str(), audio_input_mime[f], audio_data, audio_len);
+  return send(body);
+}
 
-  String reqEndBody = "\r\n--" +boundary+ "--\r\n";
+String OpenAI_AudioTranslation::file(Stream & audio, size_t audio_len, OpenAI_Audio_Input_Format f){
+  OpenAI_Multipart body("----WebKitFormBoundary9HKFexBRLrf9dcpY");
+  openaiWriteFields(this, fields, body);
+  body.addFile("file", ("audio."+String(audio_input_formats[f])).c_str(), audio_input_mime[f], &audio, audio_len);
+  return send(body);
+}
 
-  len = reqBody.length() + reqEndBody.length() + audio_len;
-  data = (uint8_t*)malloc(len + 1);
-  if(data == NULL){
-    log_e("Failed to allocate request buffer! Len: %u", len);
-    return String();
-  }
-  uint8_t * d = data;
-  memcpy(d, reqBody.c_str(), reqBody.length());
-  d += reqBody.length();
-  memcpy(d, audio_data, audio_len);
-  d += audio_len;
-  memcpy(d, reqEndBody.c_str(), reqEndBody.length());
-  d += reqEndBody.length();
-  *d = 0;
-
-  String result = oai.upload(endpoint, boundary, data, len);
-  free(data);
-  if(!result.length()){
-    log_e("Empty result!");
-    return result;
-  }
-  cJSON * json = cJSON_Parse(result.c_str());
-  String error = getJsonError(json);
-  result = "";
-  if(error.length()){
-    log_e("%s",error.c_str());
-  } else {
-    if(cJSON_HasObjectItem(json, "text")){
-      cJSON * text = cJSON_GetObjectItem(json, "text");
-      result = String(cJSON_GetStringValue(text));
-    }
-  }
-  cJSON_Delete(json);
-  return result;
+String OpenAI_AudioTranslation::file(fs::File & audio, OpenAI_Audio_Input_Format f){
+  OpenAI_Multipart body("----WebKitFormBoundary9HKFexBRLrf9dcpY");
+  openaiWriteFields(this, fields, body);
+  body.addFile("file", ("audio."+String(audio_input_formats[f])).c_str(), audio_input_mime[f], audio);
+  return send(body);
 }
 
 
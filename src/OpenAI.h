@@ -1,7 +1,18 @@
 #pragma once
 #include "Arduino.h"
-#include "cJSON.h"
-
+#include "OpenAI_Body.h"
+#include "OpenAI_Allocator.h"
+#include "OpenAI_Fields.h"
+#include "OpenAI_Async.h"
+#include "OpenAI_ChatHistory.h"
+#include "OpenAI_ImageDownload.h"
+#include <functional>
+#include <vector>
+
+class OpenAI_Embedding;
+class OpenAI_EmbeddingCache;
+class OpenAI_ResponseCache;
+class OpenAI_Tokenizer;
 class OpenAI_Completion;
 class OpenAI_ChatCompletion;
 class OpenAI_Edit;
@@ -40,21 +51,58 @@ typedef enum {
   OPENAI_AUDIO_INPUT_FORMAT_WEBM
 } OpenAI_Audio_Input_Format;
 
+typedef enum {
+  OPENAI_EMBEDDING_PRECISION_DOUBLE,
+  OPENAI_EMBEDDING_PRECISION_FLOAT,
+  OPENAI_EMBEDDING_PRECISION_INT8,
+  OPENAI_EMBEDDING_PRECISION_UINT8
+} OpenAI_Embedding_Precision;
+
+typedef enum {
+  OPENAI_EMBEDDING_ENCODING_FORMAT_FLOAT,
+  OPENAI_EMBEDDING_ENCODING_FORMAT_BASE64
+} OpenAI_Embedding_Encoding_Format;
+
 typedef struct {
     unsigned int len;
-    double * data;
+    double * data;        //OPENAI_EMBEDDING_PRECISION_DOUBLE
+    float * data_f32;     //OPENAI_EMBEDDING_PRECISION_FLOAT
+    int8_t * data_i8;     //OPENAI_EMBEDDING_PRECISION_INT8, value = data_i8[i] * scale
+    uint8_t * data_u8;    //OPENAI_EMBEDDING_PRECISION_UINT8, value = data_u8[i] * scale + offset
+    float scale;
+    float offset;
 } OpenAI_EmbeddingData;
 
+//Returns the input at index, or NULL after the last one. The text has to stay valid until the next call
+typedef std::function<const char *(unsigned int index)> OpenAI_EmbeddingInput;
+
+//Called for every streamed piece of a choice. finish_reason is NULL until the choice completes. Return false to stop the stream
+typedef std::function<bool(unsigned int index, const char * delta, const char * finish_reason)> OpenAI_StreamCallback;
+
+//Called for every decoded piece of a b64_json image, in order. Return false to stop the download
+typedef std::function<bool(unsigned int index, const uint8_t * data, size_t len)> OpenAI_ImageCallback;
+
 class OpenAI_EmbeddingResponse {
   private:
     unsigned int usage;
     unsigned int len;
     OpenAI_EmbeddingData * data;
+    OpenAI_Embedding_Precision prec;
     char * error_str;
+    bool packed;          //The table and the vectors are one block
+    bool owned;           //The block is on the heap, not in the buffer of the caller
+
+    friend class OpenAI_EmbeddingResponseParser;
+    void release();
 
   public:
-    OpenAI_EmbeddingResponse(const char * payload);
+    OpenAI_EmbeddingResponse(const char * payload, OpenAI_Embedding_Precision precision=OPENAI_EMBEDDING_PRECISION_DOUBLE);
     ~OpenAI_EmbeddingResponse();
+    OpenAI_EmbeddingResponse(OpenAI_EmbeddingResponse && other);                 //Takes over the buffers of other, which is left empty
+    OpenAI_EmbeddingResponse & operator=(OpenAI_EmbeddingResponse && other);
+    OpenAI_EmbeddingResponse(const OpenAI_EmbeddingResponse &) = delete;            //Move only. clone() makes a copy
+    OpenAI_EmbeddingResponse & operator=(const OpenAI_EmbeddingResponse &) = delete;
+    OpenAI_EmbeddingResponse clone();
 
     unsigned int tokens(){
       return usage;
@@ -68,6 +116,10 @@ class OpenAI_EmbeddingResponse {
       }
       return NULL;
     }
+    OpenAI_Embedding_Precision precision(){
+      return prec;
+    }
+    float valueAt(unsigned int index, unsigned int i);   //Value i of vector index in any precision
     const char * error(){
       return error_str;
     }
@@ -79,9 +131,16 @@ class OpenAI_ModerationResponse {
     bool * data;
     char * error_str;
 
+    friend class OpenAI_ModerationResponseParser;
+
   public:
     OpenAI_ModerationResponse(const char * payload);
     ~OpenAI_ModerationResponse();
+    OpenAI_ModerationResponse(OpenAI_ModerationResponse && other);                 //Takes over the buffers of other, which is left empty
+    OpenAI_ModerationResponse & operator=(OpenAI_ModerationResponse && other);
+    OpenAI_ModerationResponse(const OpenAI_ModerationResponse &) = delete;            //Move only. clone() makes a copy
+    OpenAI_ModerationResponse & operator=(const OpenAI_ModerationResponse &) = delete;
+    OpenAI_ModerationResponse clone();
 
     unsigned int length(){
       return len;
@@ -100,12 +159,20 @@ class OpenAI_ModerationResponse {
 class OpenAI_ImageResponse {
   private:
     unsigned int len;
-    char ** data;
+    char ** data;         //The table and the strings are one block
     char * error_str;
+    bool owned;           //The block is on the heap, not in the buffer of the caller
+
+    friend class OpenAI_ImageResponseParser;
 
   public:
     OpenAI_ImageResponse(const char * payload);
     ~OpenAI_ImageResponse();
+    OpenAI_ImageResponse(OpenAI_ImageResponse && other);                 //Takes over the buffers of other, which is left empty
+    OpenAI_ImageResponse & operator=(OpenAI_ImageResponse && other);
+    OpenAI_ImageResponse(const OpenAI_ImageResponse &) = delete;            //Move only. clone() makes a copy
+    OpenAI_ImageResponse & operator=(const OpenAI_ImageResponse &) = delete;
+    OpenAI_ImageResponse clone();
 
     unsigned int length(){
       return len;
@@ -125,12 +192,21 @@ class OpenAI_StringResponse {
   private:
     unsigned int usage;
     unsigned int len;
-    char ** data;
+    char ** data;         //The table and the strings are one block
     char * error_str;
+    bool owned;           //The block is on the heap, not in the buffer of the caller
+
+    friend class OpenAI_StringResponseParser;
+    friend class OpenAI_ChoiceStream;
 
   public:
     OpenAI_StringResponse(const char * payload);
     ~OpenAI_StringResponse();
+    OpenAI_StringResponse(OpenAI_StringResponse && other);                 //Takes over the buffers of other, which is left empty
+    OpenAI_StringResponse & operator=(OpenAI_StringResponse && other);
+    OpenAI_StringResponse(const OpenAI_StringResponse &) = delete;            //Move only. clone() makes a copy
+    OpenAI_StringResponse & operator=(const OpenAI_StringResponse &) = delete;
+    OpenAI_StringResponse clone();
 
     unsigned int tokens(){
       return usage;
@@ -149,9 +225,66 @@ class OpenAI_StringResponse {
     }
 };
 
+typedef struct {
+    unsigned int requests;    //Requests sent through the connection pool
+    unsigned int reused;      //Requests sent over an already open keep-alive connection
+    unsigned int handshakes;  //New TCP/TLS connections opened
+    unsigned int expired;     //Idle connections closed after the keep-alive timeout
+    unsigned int reconnects;  //Requests resent after the server closed a reused connection
+} OpenAI_ConnectionStats;
+
+typedef struct {
+    unsigned int requests;      //Requests made, however many attempts each took
+    unsigned int retried;       //Requests that were sent more than once
+    unsigned int retries;       //Attempts after the first
+    unsigned int rate_limited;  //Attempts answered with 429
+    unsigned int failed;        //Retried requests that still failed after their last attempt
+    unsigned long backoff;      //ms spent waiting between attempts
+} OpenAI_RetryStats;
+
+unsigned long openai_backoff(unsigned int n, unsigned long base_delay, unsigned long max_delay); //Random wait before attempt n + 1, up to base_delay doubled for each attempt after the first
+
+#define OPENAI_MAX_CONNECTIONS 16  //Largest connection pool. Each open connection takes a socket and, with TLS, about 40KB of heap
+
+struct OpenAI_Connection;
+
 class OpenAI {
   private:
     String api_key;
+    String base_url;
+    OpenAI_Connection * connections;
+    unsigned int connections_len;
+    unsigned long keep_alive;
+    SemaphoreHandle_t connections_lock;
+    SemaphoreHandle_t connections_free;
+    SemaphoreHandle_t connections_config;
+    OpenAI_ConnectionStats stats;
+    OpenAI_RetryStats retry_stats;
+    unsigned int retry_attempts;
+    unsigned long retry_delay;
+    unsigned long retry_max_delay;
+    bool retry_generations;
+    OpenAI_UploadStats upload_stats;
+    QueueHandle_t async_queue;
+    SemaphoreHandle_t async_stopped;
+    unsigned int async_depth;
+    int async_core;
+    unsigned int async_workers;
+    unsigned int async_running;
+    OpenAI_EmbeddingCache * embedding_cache;
+    OpenAI_ResponseCache * response_cache;
+    OpenAI_Tokenizer * token_counter;
+
+    OpenAI_Connection * acquireConnection();
+    void releaseConnection(OpenAI_Connection * c, bool reconnected);
+    void drainConnections();
+    void closeConnections();
+    bool startWorker();
+    void stopWorker();
+    static void asyncWorker(void * arg);
+    int execute(const char * method, String endpoint, const char * content_type, uint8_t * data, size_t len, OpenAI_Body * body, Stream * response, uint16_t timeout);
+    int attempt(const char * method, String endpoint, const char * content_type, uint8_t * data, size_t len, OpenAI_Body * body, Stream * response, uint16_t timeout, unsigned int n, bool idempotent, unsigned long * wait);
+    bool retryDelay(OpenAI_Connection * c, int httpCode, unsigned int n, bool idempotent, unsigned long & wait);
 
   protected:
 
@@ -159,9 +292,49 @@ class OpenAI {
     OpenAI(const char *openai_api_key);
     ~OpenAI();
 
-    OpenAI_EmbeddingResponse embedding(String input, const char * model=NULL, const char * user=NULL);  //Creates an embedding vector representing the input text.
+    OpenAI & setBaseUrl(const char * url);                                    //Base URL of the API. Default is "https://api.openai.com/v1/". Waits for running requests to finish
+    OpenAI & setConnectionPool(unsigned int size, unsigned long idle_timeout);  //Number of keep-alive connections (up to OPENAI_MAX_CONNECTIONS) and ms before an idle one is closed. 0 timeout disables reuse. Waits for running requests to finish
+    OpenAI_ConnectionStats connectionStats();                                 //Counters for reused connections vs. new handshakes
+    void resetConnectionStats();
+    OpenAI_UploadStats uploadStats();                                         //Size, duration and heap use of the last upload
+    OpenAI & setRetryPolicy(unsigned int attempts, unsigned long base_delay=500, unsigned long max_delay=20000, bool generations=false); //Attempts per request, 1 disables retries. Waits are random up to base_delay doubled for each attempt, or what the rate limit headers ask for
+                                                                              //Requests that generate content are only repeated if the server did not take them, unless generations is set
+    OpenAI_RetryStats retryStats();                                           //Counters for retried requests and the time spent backing off
+    void resetRetryStats();
+    OpenAI & setAsync(unsigned int queue_depth, int core=tskNO_AFFINITY, unsigned int workers=1); //Requests that can wait for a worker, the core the workers run on and their number. Workers start with the first async request
+                                                                              //Each worker takes a connection from the pool while it runs a request, so make the pool at least as large
+
+    OpenAI & setEmbeddingCache(OpenAI_EmbeddingCache * cache);               //Embeddings of inputs that were seen before are taken from the cache. NULL disables it
+    OpenAI_EmbeddingCache * embeddingCache(){ return embedding_cache; }
+    OpenAI & setResponseCache(OpenAI_ResponseCache * cache);                 //Completions and edits with temperature 0 and moderations are answered from the cache when they repeat. NULL disables it
+    OpenAI & setTokenizer(OpenAI_Tokenizer * t);                              //Counts the tokens of prompts and batches. NULL estimates four characters per token
+    OpenAI_Tokenizer * tokenizer(){ return token_counter; }
+    unsigned int countTokens(const char * text);
+    static void setAllocator(OpenAI_Allocator * allocator);                  //Takes the buffers of all clients. Set it before the first request. NULL restores the heap, large blocks in PSRAM
+    static OpenAI_MemoryStats memoryStats(OpenAI_Memory_Category category);   //Bytes in use and their peak, if the allocator counts them
+
+    bool submit(OpenAI_AsyncTask * task, OpenAI_Serial * serial=NULL);        //Queues the task to a worker. The task is cancelled if the queue is full. Tasks of the same serial run in order
+    template<typename T>
+    OpenAI_Future<T> async(typename OpenAI_AsyncJob<T>::Function job, OpenAI_Serial * serial=NULL){  //Runs any request on a worker, i.e. async<OpenAI_ImageResponse>([&](){ return edit.image(data, len); })
+      OpenAI_AsyncJob<T> * j = new OpenAI_AsyncJob<T>(job);
+      if(j == NULL || !j->valid()){
+        delete j;
+        return OpenAI_Future<T>();
+      }
+      OpenAI_Future<T> f(j);
+      submit(j, serial);
+      j->release();
+      return f;
+    }
+
+    OpenAI_EmbeddingResponse embedding(String input, const char * model=NULL, const char * user=NULL, OpenAI_Embedding_Precision precision=OPENAI_EMBEDDING_PRECISION_DOUBLE,
+        OpenAI_Embedding_Encoding_Format encoding=OPENAI_EMBEDDING_ENCODING_FORMAT_FLOAT);  //Creates an embedding vector representing the input text. FLOAT takes half, INT8 and UINT8 an eighth of the memory. BASE64 transfers the vectors as binary float32
     OpenAI_ModerationResponse moderation(String input, const char * model=NULL);   //Classifies if text violates OpenAI's Content Policy
+    OpenAI_Future<OpenAI_EmbeddingResponse> embeddingAsync(String input, const char * model=NULL, const char * user=NULL, OpenAI_Embedding_Precision precision=OPENAI_EMBEDDING_PRECISION_DOUBLE,
+        OpenAI_Embedding_Encoding_Format encoding=OPENAI_EMBEDDING_ENCODING_FORMAT_FLOAT);  //Same as above, but the request runs on the worker task
+    OpenAI_Future<OpenAI_ModerationResponse> moderationAsync(String input, const char * model=NULL);
 
+    OpenAI_Embedding embedding();
     OpenAI_Completion completion();
     OpenAI_ChatCompletion chat();
     OpenAI_Edit edit();
@@ -175,11 +348,57 @@ class OpenAI {
     String del(String endpoint);
     String post(String endpoint, String jsonBody);
     String upload(String endpoint, String boundary, uint8_t * data, size_t len);
+    int post(String endpoint, String jsonBody, Stream * response, bool cacheable=false);       //Same as above, but the response body is written to the stream as it arrives. Cacheable requests may be answered by the response cache
+    int upload(String endpoint, String boundary, uint8_t * data, size_t len, Stream * response);
+    int post(String endpoint, OpenAI_JsonBody & body, Stream * response, bool cacheable=false); //Serializes the body onto the connection. Only cacheable requests are written out as a whole, for the key
+    int upload(String endpoint, OpenAI_Multipart & body, Stream * response);                 //Streams the parts of the form without copying them into one buffer
+
+    //Sends a request over a pooled connection and writes the response body to the given stream. Returns the HTTP code
+    int request(const char * method, String endpoint, const char * content_type, uint8_t * data, size_t len, Stream * response, uint16_t timeout=5000);
+    int request(const char * method, String endpoint, const char * content_type, OpenAI_Body * body, Stream * response, uint16_t timeout=5000);
+};
+
+class OpenAI_Embedding {
+  private:
+    OpenAI & oai;
+    static const OpenAI_Field<OpenAI_Embedding> fields[];   //Parameters of the request
+    const char * model;
+    const char * user;
+    OpenAI_Embedding_Precision precision;
+    OpenAI_Embedding_Encoding_Format encoding_format;
+    unsigned int batch_inputs;
+    unsigned int batch_tokens;
+    OpenAI_EmbeddingCache * cache;
+    void * response_buffer;
+    size_t response_buffer_size;
+
+    friend class OpenAI;
+    void request(OpenAI_EmbeddingInput next, OpenAI_EmbeddingResponse & result);
+
+  protected:
+
+  public:
+    OpenAI_Embedding(OpenAI &openai);
+    ~OpenAI_Embedding();
+
+    OpenAI_Embedding & setModel(const char * m);
+    OpenAI_Embedding & setUser(const char * u);                            //A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
+    OpenAI_Embedding & setPrecision(OpenAI_Embedding_Precision p);        //How the vectors are stored. FLOAT takes half, INT8 and UINT8 an eighth of the memory of DOUBLE
+    OpenAI_Embedding & setEncodingFormat(OpenAI_Embedding_Encoding_Format f); //How the vectors are transferred. BASE64 is binary float32
+    OpenAI_Embedding & setBatchLimits(unsigned int inputs, unsigned int tokens); //Inputs and estimated tokens per request. Longer lists are sent in several requests. Default is 100 and 8000
+    OpenAI_Embedding & setCache(OpenAI_EmbeddingCache * c);                //Only inputs that are not in the cache are sent. Default is the cache of the client
+    OpenAI_Embedding & setResponseBuffer(void * buffer, size_t size);      //Responses are laid out in this buffer instead of the heap if they fit. Only one response at a time can use it
+
+    OpenAI_EmbeddingResponse embed(String input);                                  //Creates an embedding vector representing the input text.
+    OpenAI_EmbeddingResponse embed(const char * const * inputs, unsigned int count); //One vector per input, in the same order
+    OpenAI_EmbeddingResponse embed(const std::vector<String> & inputs);
+    OpenAI_EmbeddingResponse embed(OpenAI_EmbeddingInput next);                    //Inputs are pulled from the callback while the requests are written
 };
 
 class OpenAI_Completion {
   private:
     OpenAI & oai;
+    static const OpenAI_Field<OpenAI_Completion> fields[];   //Parameters of the request
     const char * model;
     unsigned int max_tokens;
     float temperature;
@@ -191,6 +410,11 @@ class OpenAI_Completion {
     float frequency_penalty;
     unsigned int best_of;
     const char * user;
+    unsigned int max_context;
+    void * response_buffer;
+    size_t response_buffer_size;
+
+    bool buildRequest(OpenAI_JsonBody & body, const String & p, bool stream);
 
   protected:
 
@@ -209,14 +433,21 @@ class OpenAI_Completion {
     OpenAI_Completion & setFrequencyPenalty(float p); //float between -2.0 and 2.0. Positive values decrease the model's likelihood to repeat the same line verbatim.
     OpenAI_Completion & setBestOf(unsigned int b);    //Generates best_of completions server-side and returns the "best". "best_of" must be greater than "n"
     OpenAI_Completion & setUser(const char * u);      //A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
+    OpenAI_Completion & setMaxContextTokens(unsigned int t); //Context window of the model. Prompts that do not fit with max_tokens are not sent. 0 disables the check
+    OpenAI_Completion & setResponseBuffer(void * buffer, size_t size); //Responses are laid out in this buffer instead of the heap if they fit. Only one response at a time can use it
 
     OpenAI_StringResponse prompt(String p);           //Send the prompt for completion
+    OpenAI_StringResponse streamPrompt(String p, OpenAI_StreamCallback cb); //Same as prompt(), but the choices are passed to the callback as they are being generated. best_of is ignored
+    OpenAI_Future<OpenAI_StringResponse> promptAsync(String p);             //Same as prompt(), but the request runs on the worker task. The object has to outlive the request
 };
 
 class OpenAI_ChatCompletion {
   private:
     OpenAI & oai;
-    cJSON * messages;
+    static const OpenAI_Field<OpenAI_ChatCompletion> fields[];   //Parameters of the request
+    OpenAI_ChatHistory history;
+    SemaphoreHandle_t lock;
+    OpenAI_Serial serial;
     const char * model;
     const char * description;
     unsigned int max_tokens;
@@ -226,6 +457,21 @@ class OpenAI_ChatCompletion {
     float presence_penalty;
     float frequency_penalty;
     const char * user;
+    unsigned int max_context;
+    unsigned int compact_tokens;
+    size_t compact_bytes;
+    unsigned int compact_keep;
+    char * summary;                 //Stands for the turns that were compacted
+    unsigned int summary_tokens;
+    unsigned int conversation;      //Changes when the conversation is cleared
+    OpenAI_Future<OpenAI_StringResponse> compaction;
+    void * response_buffer;
+    size_t response_buffer_size;
+
+    bool buildRequest(OpenAI_JsonBody & body, const String & p, bool stream);
+    void saveMessage(String p, const char * reply);
+    void startCompaction();
+    OpenAI_StringResponse compact(String body, unsigned long upto, unsigned int conv);
 
   protected:
 
@@ -242,18 +488,27 @@ class OpenAI_ChatCompletion {
     OpenAI_ChatCompletion & setPresencePenalty(float p);  //float between -2.0 and 2.0. Positive values increase the model's likelihood to talk about new topics.
     OpenAI_ChatCompletion & setFrequencyPenalty(float p); //float between -2.0 and 2.0. Positive values decrease the model's likelihood to repeat the same line verbatim.
     OpenAI_ChatCompletion & setUser(const char * u);      //A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
+    OpenAI_ChatCompletion & setHistoryLimit(size_t bytes);//Bytes of the conversation kept for the next messages. The oldest turns are dropped first. Default is 16384
+    OpenAI_ChatCompletion & setMaxContextTokens(unsigned int t);//Context window of the model. The oldest turns are left out until the request and max_tokens fit. 0 disables the check
+    OpenAI_ChatCompletion & setCompaction(unsigned int tokens, size_t bytes=0, unsigned int keep_turns=2);//Once the history passes tokens or bytes, the older turns are summarized on a worker into one message. The last keep_turns stay verbatim. 0 disables
+    OpenAI_ChatCompletion & setResponseBuffer(void * buffer, size_t size);//Responses are laid out in this buffer instead of the heap if they fit. Only one response at a time can use it
     OpenAI_ChatCompletion & clearConversation();          //clears the accumulated conversation
 
     OpenAI_StringResponse message(String m, bool save=true);//Send the message for completion. Save it with the first response if selected
+    OpenAI_StringResponse streamMessage(String m, OpenAI_StreamCallback cb, bool save=true);//Same as message(), but the reply is passed to the callback as it is being generated
+    OpenAI_Future<OpenAI_StringResponse> messageAsync(String m, bool save=true);//Same as message(), but the request runs on a worker. Messages of one conversation are sent in order. The object has to outlive the request
 };
 
 class OpenAI_Edit {
   private:
     OpenAI & oai;
+    static const OpenAI_Field<OpenAI_Edit> fields[];   //Parameters of the request
     const char * model;
     float temperature;
     float top_p;
     unsigned int n;
+    void * response_buffer;
+    size_t response_buffer_size;
 
   protected:
 
@@ -265,17 +520,24 @@ class OpenAI_Edit {
     OpenAI_Edit & setTemperature(float t);      //float between 0 and 2. Higher value gives more random results.
     OpenAI_Edit & setTopP(float t);             //float between 0 and 1. recommended to alter this or temperature but not both.
     OpenAI_Edit & setN(unsigned int n);         //How many edits to generate for the input and instruction.
+    OpenAI_Edit & setResponseBuffer(void * buffer, size_t size); //Responses are laid out in this buffer instead of the heap if they fit. Only one response at a time can use it
 
     OpenAI_StringResponse process(String instruction, String input=String()); //Creates a new edit for the provided input, instruction, and parameters.
+    OpenAI_Future<OpenAI_StringResponse> processAsync(String instruction, String input=String()); //Same as process(), but the request runs on the worker task. The object has to outlive the request
 };
 
 class OpenAI_ImageGeneration {
   private:
     OpenAI & oai;
-    OpenAI_Image_Size size;
-    OpenAI_Image_Response_Format response_format;
+    static const OpenAI_Field<OpenAI_ImageGeneration> fields[];   //Parameters of the request
+    uint8_t size;                     //OpenAI_Image_Size
+    uint8_t response_format;          //OpenAI_Image_Response_Format
+    uint8_t chosen_format;            //Set with setResponseFormat(). b64_json is sent instead while an output is set
     unsigned int n;
     const char * user;
+    void * response_buffer;
+    size_t response_buffer_size;
+    OpenAI_ImageCallback output;
 
   protected:
 
@@ -287,17 +549,28 @@ class OpenAI_ImageGeneration {
     OpenAI_ImageGeneration & setResponseFormat(OpenAI_Image_Response_Format f); //The format in which the generated images are returned.
     OpenAI_ImageGeneration & setN(unsigned int n);                              //The number of images to generate. Must be between 1 and 10.
     OpenAI_ImageGeneration & setUser(const char * u);                           //A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
+    OpenAI_ImageGeneration & setResponseBuffer(void * buffer, size_t size);     //Responses are laid out in this buffer instead of the heap if they fit. Only one response at a time can use it
+    OpenAI_ImageGeneration & setOutput(Print * out);                            //Images are requested as b64_json and decoded into out as they arrive, one after the other, i.e. an fs::File. NULL turns it off and restores the response format
+    OpenAI_ImageGeneration & setOutputCallback(OpenAI_ImageCallback cb);        //Same, but each piece is passed to the callback with the index of its image
 
     OpenAI_ImageResponse prompt(String p);                                      //Creates image/images from given a prompt.
+    OpenAI_Future<OpenAI_ImageResponse> promptAsync(String p);                  //Same as prompt(), but the request runs on the worker task. The object has to outlive the request
 };
 
 class OpenAI_ImageVariation {
   private:
     OpenAI & oai;
-    OpenAI_Image_Size size;
-    OpenAI_Image_Response_Format response_format;
+    static const OpenAI_Field<OpenAI_ImageVariation> fields[];   //Parameters of the request
+    uint8_t size;                     //OpenAI_Image_Size
+    uint8_t response_format;          //OpenAI_Image_Response_Format
+    uint8_t chosen_format;            //Set with setResponseFormat(). b64_json is sent instead while an output is set
     unsigned int n;
     const char * user;
+    void * response_buffer;
+    size_t response_buffer_size;
+    OpenAI_ImageCallback output;
+
+    OpenAI_ImageResponse send(OpenAI_Multipart & body);
 
   protected:
 
@@ -309,18 +582,30 @@ class OpenAI_ImageVariation {
     OpenAI_ImageVariation & setResponseFormat(OpenAI_Image_Response_Format f); //The format in which the generated images are returned.
     OpenAI_ImageVariation & setN(unsigned int n);                              //The number of images to generate. Must be between 1 and 10.
     OpenAI_ImageVariation & setUser(const char * u);                           //A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
+    OpenAI_ImageVariation & setResponseBuffer(void * buffer, size_t size);     //Responses are laid out in this buffer instead of the heap if they fit. Only one response at a time can use it
+    OpenAI_ImageVariation & setOutput(Print * out);                            //Images are requested as b64_json and decoded into out as they arrive, one after the other, i.e. an fs::File. NULL turns it off and restores the response format
+    OpenAI_ImageVariation & setOutputCallback(OpenAI_ImageCallback cb);        //Same, but each piece is passed to the callback with the index of its image
 
     OpenAI_ImageResponse image(uint8_t * data, size_t len);                                  //Creates an image given a prompt.
+    OpenAI_ImageResponse image(Stream & data, size_t len);                                   //len bytes are read from the stream while uploading
+    OpenAI_ImageResponse image(fs::File & file);                                             //The image is read from the file while uploading
 };
 
 class OpenAI_ImageEdit {
   private:
     OpenAI & oai;
+    static const OpenAI_Field<OpenAI_ImageEdit> fields[];   //Parameters of the request
     const char * prompt;
-    OpenAI_Image_Size size;
-    OpenAI_Image_Response_Format response_format;
+    uint8_t size;                     //OpenAI_Image_Size
+    uint8_t response_format;          //OpenAI_Image_Response_Format
+    uint8_t chosen_format;            //Set with setResponseFormat(). b64_json is sent instead while an output is set
     unsigned int n;
     const char * user;
+    void * response_buffer;
+    size_t response_buffer_size;
+    OpenAI_ImageCallback output;
+
+    OpenAI_ImageResponse send(OpenAI_Multipart & body);
 
   protected:
 
@@ -333,18 +618,26 @@ class OpenAI_ImageEdit {
     OpenAI_ImageEdit & setResponseFormat(OpenAI_Image_Response_Format f); //The format in which the generated images are returned.
     OpenAI_ImageEdit & setN(unsigned int n);                              //The number of images to generate. Must be between 1 and 10.
     OpenAI_ImageEdit & setUser(const char * u);                           //A unique identifier representing your end-user, which can help OpenAI to monitor and detect abuse.
+    OpenAI_ImageEdit & setResponseBuffer(void * buffer, size_t size);     //Responses are laid out in this buffer instead of the heap if they fit. Only one response at a time can use it
+    OpenAI_ImageEdit & setOutput(Print * out);                            //Images are requested as b64_json and decoded into out as they arrive, one after the other, i.e. an fs::File. NULL turns it off and restores the response format
+    OpenAI_ImageEdit & setOutputCallback(OpenAI_ImageCallback cb);        //Same, but each piece is passed to the callback with the index of its image
 
     OpenAI_ImageResponse image(uint8_t * data, size_t len, uint8_t * mask_data=NULL, size_t mask_len=0); //Creates an edited or extended image given an original image and a prompt.
+    OpenAI_ImageResponse image(Stream & data, size_t len, Stream * mask=NULL, size_t mask_len=0);       //Image and mask are read from the streams while uploading
+    OpenAI_ImageResponse image(fs::File & file, fs::File * mask=NULL);                                 //Image and mask are read from the files while uploading
 };
 
 class OpenAI_AudioTranscription {
   private:
     OpenAI & oai;
+    static const OpenAI_Field<OpenAI_AudioTranscription> fields[];   //Parameters of the request
     const char * prompt;
-    OpenAI_Audio_Response_Format response_format;
+    uint8_t response_format;          //OpenAI_Audio_Response_Format
     float temperature;
     const char * language;
 
+    String send(OpenAI_Multipart & body);
+
   protected:
 
   public:
@@ -357,15 +650,20 @@ class OpenAI_AudioTranscription {
     OpenAI_AudioTranscription & setLanguage(const char * l);                        //The language in ISO-639-1 format of the input audio. NULL for Auto
 
     String file(uint8_t * data, size_t len, OpenAI_Audio_Input_Format f);           //Transcribe an audio file
+    String file(Stream & data, size_t len, OpenAI_Audio_Input_Format f);            //len bytes are read from the stream while uploading
+    String file(fs::File & file, OpenAI_Audio_Input_Format f);                      //The audio is read from the file while uploading
 };
 
 class OpenAI_AudioTranslation {
   private:
     OpenAI & oai;
+    static const OpenAI_Field<OpenAI_AudioTranslation> fields[];   //Parameters of the request
     const char * prompt;
-    OpenAI_Audio_Response_Format response_format;
+    uint8_t response_format;          //OpenAI_Audio_Response_Format
     float temperature;
 
+    String send(OpenAI_Multipart & body);
+
   protected:
 
   public:
@@ -377,5 +675,7 @@ class OpenAI_AudioTranslation {
     OpenAI_AudioTranslation & setTemperature(float t);                            //float between 0 and 2
 
     String file(uint8_t * data, size_t len, OpenAI_Audio_Input_Format f);         //Transcribe an audio file
+    String file(Stream & data, size_t len, OpenAI_Audio_Input_Format f);          //len bytes are read from the stream while uploading
+    String file(fs::File & file, OpenAI_Audio_Input_Format f);                    //The audio is read from the file while uploading
 };
 
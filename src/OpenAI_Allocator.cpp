@@ -0,0 +1,176 @@
+#include "OpenAI_Allocator.h"
+#include "esp_heap_caps.h"
+
+// Keeps the blocks 8 byte aligned
+typedef struct {
+  uint32_t size;
+  uint8_t category;
+  uint8_t spiram;
+  uint16_t reserved;
+} OpenAI_BlockHeader;
+
+//
+// OpenAI_Allocator
+//
+
+static OpenAI_Allocator * current_allocator = NULL;
+
+OpenAI_MemoryStats OpenAI_Allocator::stats(OpenAI_Memory_Category category){
+  OpenAI_MemoryStats s;
+  memset(&s, 0, sizeof(s));
+  return s;
+}
+
+OpenAI_Allocator * OpenAI_Allocator::get(){
+  if(current_allocator == NULL){
+    static OpenAI_HeapAllocator heap;
+    current_allocator = &heap;
+  }
+  return current_allocator;
+}
+
+void OpenAI_Allocator::set(OpenAI_Allocator * allocator){
+  current_allocator = allocator;
+}
+
+void * openai_malloc(size_t size, OpenAI_Memory_Category category){
+  return OpenAI_Allocator::get()->allocate(size, category);
+}
+
+void * openai_realloc(void * ptr, size_t size, OpenAI_Memory_Category category){
+  return OpenAI_Allocator::get()->reallocate(ptr, size, category);
+}
+
+char * openai_strdup(const char * str, OpenAI_Memory_Category category){
+  size_t len = strlen(str) + 1;
+  char * s = (char*)openai_malloc(len, category);
+  if(s != NULL){
+    memcpy(s, str, len);
+  }
+  return s;
+}
+
+void openai_free(void * ptr){
+  if(ptr != NULL){
+    OpenAI_Allocator::get()->release(ptr);
+  }
+}
+
+//
+// OpenAI_HeapAllocator
+//
+
+OpenAI_HeapAllocator::OpenAI_HeapAllocator(size_t spiram_threshold)
+  : threshold(spiram_threshold)
+{
+  portMUX_TYPE m = portMUX_INITIALIZER_UNLOCKED;
+  mux = m;
+  memset(counters, 0, sizeof(counters));
+}
+
+void OpenAI_HeapAllocator::setThreshold(size_t spiram_threshold){
+  threshold = spiram_threshold;
+}
+
+// heap_caps_realloc() with a NULL base allocates and moves the block if it is in other memory
+void * OpenAI_HeapAllocator::place(void * base, size_t size, bool & spiram){
+  void * p = NULL;
+  spiram = false;
+  if(threshold && size >= threshold){
+    p = heap_caps_realloc(base, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    spiram = (p != NULL);
+  } else {
+    p = heap_caps_realloc(base, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  }
+  if(p == NULL){
+    p = heap_caps_realloc(base, size, MALLOC_CAP_8BIT);
+  }
+  return p;
+}
+
+void OpenAI_HeapAllocator::add(OpenAI_Memory_Category category, size_t size, bool spiram){
+  OpenAI_MemoryStats & s = counters[category];
+  portENTER_CRITICAL(&mux);
+  s.bytes += size;
+  if(s.bytes > s.peak){
+    s.peak = s.bytes;
+  }
+  if(spiram){
+    s.spiram_bytes += size;
+  }
+  s.allocations++;
+  portEXIT_CRITICAL(&mux);
+}
+
+void OpenAI_HeapAllocator::remove(OpenAI_Memory_Category category, size_t size, bool spiram){
+  OpenAI_MemoryStats & s = counters[category];
+  portENTER_CRITICAL(&mux);
+  s.bytes -= size;
+  if(spiram){
+    s.spiram_bytes -= size;
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+void * OpenAI_HeapAllocator::allocate(size_t size, OpenAI_Memory_Category category){
+  return reallocate(NULL, size, category);
+}
+
+void * OpenAI_HeapAllocator::reallocate(void * ptr, size_t size, OpenAI_Memory_Category category){
+  if(category >= OPENAI_MEMORY_MAX){
+    category = OPENAI_MEMORY_PARSER;
+  }
+  OpenAI_BlockHeader * h = NULL;
+  OpenAI_BlockHeader old;
+  if(ptr != NULL){
+    h = (OpenAI_BlockHeader*)ptr - 1;
+    old = *h;
+  }
+  bool spiram = false;
+  h = (OpenAI_BlockHeader*)place(h, sizeof(OpenAI_BlockHeader) + size, spiram);
+  if(h == NULL){
+    portENTER_CRITICAL(&mux);
+    counters[category].failures++;
+    portEXIT_CRITICAL(&mux);
+    return NULL;
+  }
+  if(ptr != NULL){
+    remove((OpenAI_Memory_Category)old.category, old.size, old.spiram);
+  }
+  h->size = size;
+  h->category = category;
+  h->spiram = spiram;
+  h->reserved = 0;
+  add(category, size, spiram);
+  return h + 1;
+}
+
+void OpenAI_HeapAllocator::release(void * ptr){
+  if(ptr == NULL){
+    return;
+  }
+  OpenAI_BlockHeader * h = (OpenAI_BlockHeader*)ptr - 1;
+  remove((OpenAI_Memory_Category)h->category, h->size, h->spiram);
+  heap_caps_free(h);
+}
+
+OpenAI_MemoryStats OpenAI_HeapAllocator::stats(OpenAI_Memory_Category category){
+  OpenAI_MemoryStats s;
+  memset(&s, 0, sizeof(s));
+  if(category < OPENAI_MEMORY_MAX){
+    portENTER_CRITICAL(&mux);
+    s = counters[category];
+    portEXIT_CRITICAL(&mux);
+  }
+  return s;
+}
+
+void OpenAI_HeapAllocator::resetStats(){
+  portENTER_CRITICAL(&mux);
+  for(int i = 0; i < OPENAI_MEMORY_MAX; i++){
+    counters[i].peak = counters[i].bytes;
+    counters[i].allocations = 0;
+    counters[i].failures = 0;
+  }
+  portEXIT_CRITICAL(&mux);
+}
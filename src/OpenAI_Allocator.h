@@ -0,0 +1,67 @@
+#pragma once
+#include "Arduino.h"
+
+#define OPENAI_SPIRAM_THRESHOLD 4096  //Blocks of this many bytes and more go to PSRAM by default
+
+typedef enum {
+  OPENAI_MEMORY_SETTINGS,   //Models, prompts and other strings given to the builders
+  OPENAI_MEMORY_REQUEST,    //Copies of the data that is uploaded
+  OPENAI_MEMORY_PARSER,     //Texts, vectors and records while a response is read, and the scratch of the tokenizer
+  OPENAI_MEMORY_RESPONSE,   //Parsed responses, their errors and chat summaries
+  OPENAI_MEMORY_HISTORY,    //Chat histories
+  OPENAI_MEMORY_CACHE,      //Embedding and response caches, vector indexes and the tokenizer vocabulary
+  OPENAI_MEMORY_MAX
+} OpenAI_Memory_Category;
+
+typedef struct {
+    size_t bytes;               //Allocated now
+    size_t peak;                //Most bytes allocated at once
+    size_t spiram_bytes;        //Of the bytes allocated now, the ones in PSRAM
+    unsigned int allocations;   //Blocks allocated or grown
+    unsigned int failures;      //Allocations that returned NULL
+} OpenAI_MemoryStats;
+
+// Every buffer of the library is taken from one allocator. Subclass it to use a pool or another heap
+// and pass it to OpenAI::setAllocator() before the first request. Blocks are released by the allocator
+// that is set at the time, so it must not change while responses or builders are alive
+class OpenAI_Allocator {
+  public:
+    virtual ~OpenAI_Allocator(){}
+    virtual void * allocate(size_t size, OpenAI_Memory_Category category) = 0;
+    virtual void * reallocate(void * ptr, size_t size, OpenAI_Memory_Category category) = 0;  //Like realloc(). NULL ptr allocates
+    virtual void release(void * ptr) = 0;
+    virtual OpenAI_MemoryStats stats(OpenAI_Memory_Category category);                           //Zeros unless the allocator counts
+    virtual void resetStats(){}
+
+    static OpenAI_Allocator * get();
+    static void set(OpenAI_Allocator * allocator);                                               //NULL restores the default
+};
+
+// The default. Blocks of at least the threshold go to PSRAM if the board has some, smaller ones to internal RAM.
+// Either falls back to the other when it is full. Each block carries an 8 byte header for the counters
+class OpenAI_HeapAllocator : public OpenAI_Allocator {
+  private:
+    portMUX_TYPE mux;
+    size_t threshold;
+    OpenAI_MemoryStats counters[OPENAI_MEMORY_MAX];
+
+    void * place(void * base, size_t size, bool & spiram);
+    void add(OpenAI_Memory_Category category, size_t size, bool spiram);
+    void remove(OpenAI_Memory_Category category, size_t size, bool spiram);
+
+  public:
+    OpenAI_HeapAllocator(size_t spiram_threshold=OPENAI_SPIRAM_THRESHOLD);
+
+    void setThreshold(size_t spiram_threshold);                                                  //0 keeps everything in internal RAM
+
+    void * allocate(size_t size, OpenAI_Memory_Category category);
+    void * reallocate(void * ptr, size_t size, OpenAI_Memory_Category category);
+    void release(void * ptr);
+    OpenAI_MemoryStats stats(OpenAI_Memory_Category category);
+    void resetStats();                                                                           //Peaks start from the bytes allocated now
+};
+
+void * openai_malloc(size_t size, OpenAI_Memory_Category category);
+void * openai_realloc(void * ptr, size_t size, OpenAI_Memory_Category category);
+char * openai_strdup(const char * str, OpenAI_Memory_Category category);
+void openai_free(void * ptr);
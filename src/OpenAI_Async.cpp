@@ -0,0 +1,97 @@
+#include "OpenAI_Async.h"
+
+OpenAI_AsyncTask::OpenAI_AsyncTask()
+  : refs(1)
+  , done(NULL)
+  , serial(NULL)
+  , next(NULL)
+  , lock(NULL)
+  , finished(false)
+{
+  done = xSemaphoreCreateBinary();
+  lock = xSemaphoreCreateMutex();
+  if(!valid()){
+    log_e("Async task could not be allocated");
+  }
+}
+
+OpenAI_AsyncTask::~OpenAI_AsyncTask(){
+  if(done != NULL){
+    vSemaphoreDelete(done);
+  }
+  if(lock != NULL){
+    vSemaphoreDelete(lock);
+  }
+}
+
+void OpenAI_AsyncTask::signal(){
+  // Pick the next task of the conversation first. Once the waiters are awake, the serial may be gone
+  if(serial != NULL){
+    next = serial->finish();
+  }
+  xSemaphoreGive(done);
+}
+
+bool OpenAI_AsyncTask::ready(){
+  bool r;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  r = finished;
+  xSemaphoreGive(lock);
+  return r;
+}
+
+bool OpenAI_AsyncTask::wait(uint32_t timeout_ms){
+  TickType_t ticks = (timeout_ms == portMAX_DELAY)?portMAX_DELAY:pdMS_TO_TICKS(timeout_ms);
+  if(xSemaphoreTake(done, ticks) != pdTRUE){
+    return false;
+  }
+  // Leave it signaled for any other waiter
+  xSemaphoreGive(done);
+  return true;
+}
+
+//
+// OpenAI_Serial
+//
+
+OpenAI_Serial::OpenAI_Serial()
+  : lock(NULL)
+  , head(NULL)
+  , tail(NULL)
+  , busy(false)
+{
+  lock = xSemaphoreCreateMutex();
+}
+
+OpenAI_Serial::~OpenAI_Serial(){
+  if(lock != NULL){
+    vSemaphoreDelete(lock);
+  }
+}
+
+void OpenAI_Serial::append(OpenAI_AsyncTask * task){
+  task->next = NULL;
+  if(tail != NULL){
+    tail->next = task;
+  } else {
+    head = task;
+  }
+  tail = task;
+}
+
+OpenAI_AsyncTask * OpenAI_Serial::finish(){
+  OpenAI_AsyncTask * t;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  t = head;
+  if(t != NULL){
+    head = t->next;
+    if(head == NULL){
+      tail = NULL;
+    }
+    t->next = NULL;
+  } else {
+    busy = false;
+  }
+  xSemaphoreGive(lock);
+  return t;
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include "Arduino.h"
+#include <functional>
+#include <atomic>
+
+class OpenAI;
+class OpenAI_Serial;
+
+// Work item that is queued to the worker task of an OpenAI client.
+// It is reference counted, so the queue and any number of futures can hold it.
+class OpenAI_AsyncTask {
+  private:
+    std::atomic<int> refs;
+    SemaphoreHandle_t done;
+    OpenAI_Serial * serial;
+    OpenAI_AsyncTask * next;
+
+    friend class OpenAI;
+    friend class OpenAI_Serial;
+
+  protected:
+    SemaphoreHandle_t lock;
+    bool finished;
+
+    void signal();                       //Wakes up everyone waiting for the task
+
+  public:
+    OpenAI_AsyncTask();
+    virtual ~OpenAI_AsyncTask();
+
+    virtual void run() = 0;              //Executes the request. Called on the worker task
+    virtual void cancel() = 0;           //Called instead of run() if the request could not be queued or executed
+
+    void retain(){ refs++; }
+    void release(){ if(--refs == 0){ delete this; } }
+    bool valid(){ return done != NULL && lock != NULL; }
+    bool ready();
+    bool wait(uint32_t timeout_ms);
+};
+
+template<typename T>
+class OpenAI_AsyncJob : public OpenAI_AsyncTask {
+  public:
+    typedef std::function<T()> Function;
+    typedef std::function<void(T & result)> Callback;
+
+  private:
+    Function job;
+    Callback callback;
+    T * result;
+
+    void complete(T * r){
+      xSemaphoreTake(lock, portMAX_DELAY);
+      result = r;
+      finished = true;
+      Callback cb = callback;
+      callback = nullptr;
+      xSemaphoreGive(lock);
+      signal();
+      if(cb && r != NULL){
+        cb(*r);
+      }
+    }
+
+  public:
+    OpenAI_AsyncJob(Function f) : job(f), callback(nullptr), result(NULL) {}
+    ~OpenAI_AsyncJob(){
+      if(result != NULL){
+        delete result;
+      }
+    }
+
+    void run(){
+      T * r = new T(job());
+      // Release whatever the job captured as soon as it is done
+      job = nullptr;
+      complete(r);
+    }
+
+    void cancel(){
+      job = nullptr;
+      complete(NULL);
+    }
+
+    void onComplete(Callback cb){
+      xSemaphoreTake(lock, portMAX_DELAY);
+      if(!finished){
+        callback = cb;
+        xSemaphoreGive(lock);
+        return;
+      }
+      xSemaphoreGive(lock);
+      if(result != NULL){
+        cb(*result);
+      }
+    }
+
+    T * get(){
+      return ready()?result:NULL;
+    }
+};
+
+// Runs the async requests of one conversation one after another and in the order they were submitted.
+// Requests of other conversations keep running on the other workers in the meantime
+class OpenAI_Serial {
+  private:
+    SemaphoreHandle_t lock;
+    OpenAI_AsyncTask * head;   //Waiting for the running task to finish
+    OpenAI_AsyncTask * tail;
+    bool busy;                 //A task is queued or running
+
+    friend class OpenAI;
+    friend class OpenAI_AsyncTask;
+    void append(OpenAI_AsyncTask * task);
+    OpenAI_AsyncTask * finish();   //Next task to run, or NULL if the conversation is idle again
+
+  public:
+    OpenAI_Serial();
+    ~OpenAI_Serial();
+};
+
+// Handle to a request that runs on the worker task. Copies share the same request
+template<typename T>
+class OpenAI_Future {
+  private:
+    OpenAI_AsyncJob<T> * job;
+
+  public:
+    typedef typename OpenAI_AsyncJob<T>::Callback Callback;
+
+    OpenAI_Future(OpenAI_AsyncJob<T> * j=NULL) : job(j) {
+      if(job != NULL){
+        job->retain();
+      }
+    }
+    OpenAI_Future(const OpenAI_Future & other) : job(other.job) {
+      if(job != NULL){
+        job->retain();
+      }
+    }
+    OpenAI_Future & operator=(const OpenAI_Future & other){
+      if(other.job != NULL){
+        other.job->retain();
+      }
+      if(job != NULL){
+        job->release();
+      }
+      job = other.job;
+      return *this;
+    }
+    ~OpenAI_Future(){
+      if(job != NULL){
+        job->release();
+      }
+    }
+
+    bool valid(){ return job != NULL; }                                   //false if the request could not be created
+    bool ready(){ return job == NULL || job->ready(); }                   //true once the request has completed or was cancelled
+    bool wait(uint32_t timeout_ms=portMAX_DELAY){                         //Blocks until ready() or the timeout expires
+      return job == NULL || job->wait(timeout_ms);
+    }
+    T * get(){ return (job != NULL)?job->get():NULL; }                    //The result, or NULL while pending or if the request was cancelled
+    OpenAI_Future & onComplete(Callback cb){                              //Called on the worker task, or right away if already done
+      if(job != NULL){
+        job->onComplete(cb);
+      }
+      return *this;
+    }
+};
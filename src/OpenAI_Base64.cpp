@@ -0,0 +1,43 @@
+#include "OpenAI_Base64.h"
+
+// Value of each character, -1 if it is not part of the alphabet. Covers both the standard and the URL-safe alphabet
+static const int8_t base64_values[128] = {
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,62,-1,63,
+  52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,
+  -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,
+  15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,63,
+  -1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,
+  41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1
+};
+
+void OpenAI_Base64Decoder::reset(){
+  bits = 0;
+  bits_len = 0;
+  error = false;
+}
+
+size_t OpenAI_Base64Decoder::decode(const char * in, size_t len, uint8_t * out){
+  size_t out_len = 0;
+  for(size_t i = 0; i < len; i++){
+    int8_t v = ((uint8_t)in[i] < 128)?base64_values[(uint8_t)in[i]]:-1;
+    if(v < 0){
+      if(in[i] != '=' && in[i] != '\r' && in[i] != '\n'){
+        error = true;
+      }
+      if(in[i] == '='){
+        // The bits left over before padding are not data
+        bits_len = 0;
+      }
+      continue;
+    }
+    bits = (bits << 6) | v;
+    bits_len += 6;
+    if(bits_len >= 8){
+      bits_len -= 8;
+      out[out_len++] = (bits >> bits_len) & 0xFF;
+    }
+  }
+  return out_len;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "Arduino.h"
+
+// Incremental base64 decoder. The text can be split anywhere, so it can be fed
+// from a streaming parser. Line breaks and padding are skipped
+class OpenAI_Base64Decoder {
+  private:
+    uint32_t bits;
+    uint8_t bits_len;
+    bool error;
+
+  public:
+    OpenAI_Base64Decoder(){ reset(); }
+
+    void reset();
+    size_t decode(const char * in, size_t len, uint8_t * out);  //out needs room for len * 3 / 4 + 1 bytes. Returns the number of bytes written
+    bool failed(){ return error; }                               //An invalid character was found
+    bool pending(){ return bits_len == 6; }                      //The input ended with a character that does not complete a byte
+};
@@ -0,0 +1,541 @@
+#include "OpenAI_Body.h"
+#include "OpenAI_Allocator.h"
+#include "esp_heap_caps.h"
+
+static bool jsonNeedsEscape(uint8_t c){
+  return c == '"' || c == '\\' || c < 0x20;
+}
+
+// Writes the escape sequence of c inside a JSON string. Returns its length
+static uint8_t jsonEscape(uint8_t c, char * out){
+  out[0] = '\\';
+  switch(c){
+    case '"': out[1] = '"'; return 2;
+    case '\\': out[1] = '\\'; return 2;
+    case '\n': out[1] = 'n'; return 2;
+    case '\r': out[1] = 'r'; return 2;
+    case '\t': out[1] = 't'; return 2;
+    default:
+      snprintf(out, 7, "\\u%04x", c);
+      return 6;
+  }
+}
+
+static size_t jsonEscapedLength(const char * text, size_t len){
+  char esc[8];
+  size_t l = len;
+  for(size_t i = 0; i < len; i++){
+    if(jsonNeedsEscape(text[i])){
+      l += jsonEscape(text[i], esc) - 1;
+    }
+  }
+  return l;
+}
+
+//
+// OpenAI_Body
+//
+
+OpenAI_Body::OpenAI_Body()
+  : parts(NULL)
+  , parts_len(0)
+  , parts_size(0)
+  , part(0)
+  , offset(0)
+  , total(0)
+  , sent(0)
+  , failed(false)
+  , started(0)
+  , finished(0)
+  , heap_start(0)
+  , heap_min(0)
+  , text_pos(0)
+  , esc_len(0)
+  , esc_pos(0)
+{}
+
+OpenAI_Body::~OpenAI_Body(){
+  if(parts != NULL){
+    for(unsigned int i = 0; i < parts_len; i++){
+      if(parts[i].owned){
+        openai_free((void*)parts[i].data);
+      }
+    }
+    openai_free(parts);
+  }
+}
+
+OpenAI_Body::Part * OpenAI_Body::newPart(size_t len){
+  if(failed){
+    return NULL;
+  }
+  if(parts_len == parts_size){
+    unsigned int s = (parts_size)?(parts_size * 2):8;
+    Part * p = (Part*)openai_realloc(parts, s * sizeof(Part), OPENAI_MEMORY_REQUEST);
+    if(p == NULL){
+      log_e("Part could not be allocated");
+      failed = true;
+      return NULL;
+    }
+    parts = p;
+    parts_size = s;
+  }
+  Part * p = &parts[parts_len++];
+  memset(p, 0, sizeof(Part));
+  p->len = len;
+  total += len;
+  return p;
+}
+
+bool OpenAI_Body::addPart(const uint8_t * data, size_t len, bool copy){
+  if(len == 0){
+    return !failed;
+  }
+  if(copy){
+    uint8_t * d = (uint8_t*)openai_malloc(len, OPENAI_MEMORY_REQUEST);
+    if(d == NULL){
+      log_e("Part could not be allocated. Len: %u", len);
+      failed = true;
+      return false;
+    }
+    memcpy(d, data, len);
+    data = d;
+  }
+  Part * p = newPart(len);
+  if(p == NULL){
+    if(copy){
+      openai_free((void*)data);
+    }
+    return false;
+  }
+  p->data = data;
+  p->owned = copy;
+  return true;
+}
+
+bool OpenAI_Body::addPart(Stream * stream, size_t len){
+  if(len == 0){
+    return !failed;
+  }
+  Part * p = newPart(len);
+  if(p == NULL){
+    return false;
+  }
+  p->stream = stream;
+  return true;
+}
+
+bool OpenAI_Body::addPart(fs::File * file, size_t len){
+  if(len == 0){
+    return !failed;
+  }
+  Part * p = newPart(len);
+  if(p == NULL){
+    return false;
+  }
+  p->stream = file;
+  p->file = file;
+  p->start = file->position();
+  return true;
+}
+
+bool OpenAI_Body::addEscaped(const char * text, size_t len){
+  if(len == 0){
+    return !failed;
+  }
+  Part * p = newPart(jsonEscapedLength(text, len));
+  if(p == NULL){
+    return false;
+  }
+  p->data = (const uint8_t *)text;
+  p->start = len;
+  p->escaped = true;
+  return true;
+}
+
+bool OpenAI_Body::rewind(){
+  if(sent == 0){
+    return true;
+  }
+  for(unsigned int i = 0; i < parts_len; i++){
+    if(parts[i].stream == NULL){
+      continue;
+    }
+    if(parts[i].file == NULL || !parts[i].file->seek(parts[i].start)){
+      log_e("Body stream can not be rewound");
+      return false;
+    }
+  }
+  part = 0;
+  offset = 0;
+  sent = 0;
+  started = 0;
+  text_pos = 0;
+  esc_len = 0;
+  esc_pos = 0;
+  return true;
+}
+
+OpenAI_UploadStats OpenAI_Body::stats(){
+  OpenAI_UploadStats s;
+  s.bytes = sent;
+  s.time = started?(finished - started):0;
+  s.heap_used = (heap_start > heap_min)?(heap_start - heap_min):0;
+  return s;
+}
+
+int OpenAI_Body::available(){
+  if(failed){
+    // Ends HTTPClient's send loop
+    return -1;
+  }
+  return total - sent;
+}
+
+int OpenAI_Body::peek(){
+  if(part >= parts_len){
+    return -1;
+  }
+  if(parts[part].stream != NULL){
+    return parts[part].stream->peek();
+  }
+  if(parts[part].escaped){
+    if(esc_pos < esc_len){
+      return esc[esc_pos];
+    }
+    return jsonNeedsEscape(parts[part].data[text_pos])?'\\':parts[part].data[text_pos];
+  }
+  return parts[part].data[offset];
+}
+
+int OpenAI_Body::read(){
+  uint8_t c;
+  if(readBytes((char*)&c, 1) != 1){
+    return -1;
+  }
+  return c;
+}
+
+size_t OpenAI_Body::readBytes(char * buffer, size_t length){
+  size_t done = 0;
+  size_t heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  if(!started){
+    started = millis();
+    heap_start = heap;
+    heap_min = heap;
+  } else if(heap < heap_min){
+    heap_min = heap;
+  }
+  while(done < length && part < parts_len){
+    size_t l = parts[part].len - offset;
+    if(l > (length - done)){
+      l = length - done;
+    }
+    if(parts[part].stream != NULL){
+      // Read straight into the transfer buffer of the connection
+      size_t r = parts[part].stream->readBytes(buffer + done, l);
+      if(r == 0){
+        log_e("Body stream ended %u bytes early", parts[part].len - offset);
+        failed = true;
+        break;
+      }
+      l = r;
+    } else if(parts[part].escaped){
+      l = readEscaped(&parts[part], buffer + done, l);
+    } else {
+      memcpy(buffer + done, parts[part].data + offset, l);
+    }
+    done += l;
+    offset += l;
+    if(offset == parts[part].len){
+      part++;
+      offset = 0;
+      text_pos = 0;
+      esc_len = 0;
+      esc_pos = 0;
+    }
+  }
+  sent += done;
+  finished = millis();
+  return done;
+}
+
+// Escapes the text of the part into the buffer. An escape sequence can be split between two calls
+size_t OpenAI_Body::readEscaped(const Part * p, char * buffer, size_t length){
+  size_t done = 0;
+  while(done < length){
+    if(esc_pos < esc_len){
+      buffer[done++] = esc[esc_pos++];
+      continue;
+    }
+    if(text_pos >= p->start){
+      break;
+    }
+    if(jsonNeedsEscape(p->data[text_pos])){
+      esc_len = jsonEscape(p->data[text_pos++], esc);
+      esc_pos = 0;
+      continue;
+    }
+    // Plain runs are copied in one piece
+    size_t run = 1;
+    while(run < (length - done) && (text_pos + run) < p->start && !jsonNeedsEscape(p->data[text_pos + run])){
+      run++;
+    }
+    memcpy(buffer + done, p->data + text_pos, run);
+    done += run;
+    text_pos += run;
+  }
+  return done;
+}
+
+//
+// OpenAI_Multipart
+//
+
+OpenAI_Multipart::OpenAI_Multipart(const char * b)
+  : boundary(b)
+  , ended(false)
+{}
+
+bool OpenAI_Multipart::addField(const char * name, const char * value){
+  return addText("--" + boundary + "\r\nContent-Disposition: form-data; name=\"" + String(name) + "\"\r\n\r\n" + String(value) + "\r\n");
+}
+
+bool OpenAI_Multipart::addFile(const char * name, const char * filename, const char * mime, const uint8_t * data, size_t len){
+  return addText("--" + boundary + "\r\nContent-Disposition: form-data; name=\"" + String(name) + "\"; filename=\"" + String(filename) + "\"\r\nContent-Type: " + String(mime) + "\r\n\r\n")
+      && addPart(data, len, false)
+      && addText("\r\n");
+}
+
+bool OpenAI_Multipart::addFile(const char * name, const char * filename, const char * mime, Stream * stream, size_t len){
+  return addText("--" + boundary + "\r\nContent-Disposition: form-data; name=\"" + String(name) + "\"; filename=\"" + String(filename) + "\"\r\nContent-Type: " + String(mime) + "\r\n\r\n")
+      && addPart(stream, len)
+      && addText("\r\n");
+}
+
+bool OpenAI_Multipart::addFile(const char * name, const char * filename, const char * mime, fs::File & file){
+  return addText("--" + boundary + "\r\nContent-Disposition: form-data; name=\"" + String(name) + "\"; filename=\"" + String(filename) + "\"\r\nContent-Type: " + String(mime) + "\r\n\r\n")
+      && addPart(&file, file.size() - file.position())
+      && addText("\r\n");
+}
+
+void OpenAI_Multipart::end(){
+  if(!ended){
+    addText("--" + boundary + "--\r\n");
+    ended = true;
+  }
+}
+
+//
+// OpenAI_JsonBody
+//
+
+OpenAI_JsonBody::OpenAI_JsonBody()
+  : blocks(NULL)
+  , pending(0)
+  , members(0)
+  , level(0)
+  , ended(false)
+{}
+
+OpenAI_JsonBody::~OpenAI_JsonBody(){
+  while(blocks != NULL){
+    Block * b = blocks->next;
+    openai_free(blocks);
+    blocks = b;
+  }
+}
+
+// Room for len more bytes. A new block is started when the current one is full, so parts never move
+char * OpenAI_JsonBody::reserve(size_t len){
+  if(blocks != NULL && (blocks->len + len) <= blocks->size){
+    return blocks->data + blocks->len;
+  }
+  flush();
+  size_t size = (len > OPENAI_JSON_BLOCK)?len:OPENAI_JSON_BLOCK;
+  Block * b = (Block*)openai_malloc(sizeof(Block) + size, OPENAI_MEMORY_REQUEST);
+  if(b == NULL){
+    log_e("JSON block could not be allocated");
+    fail();
+    return NULL;
+  }
+  b->next = blocks;
+  b->len = 0;
+  b->size = size;
+  b->data = (char*)(b + 1);
+  blocks = b;
+  pending = 0;
+  return b->data;
+}
+
+void OpenAI_JsonBody::append(const char * text, size_t len){
+  char * p = reserve(len);
+  if(p != NULL){
+    memcpy(p, text, len);
+    blocks->len += len;
+  }
+}
+
+void OpenAI_JsonBody::appendEscaped(const char * text, size_t len){
+  char * p = reserve(jsonEscapedLength(text, len));
+  if(p == NULL){
+    return;
+  }
+  for(size_t i = 0; i < len; i++){
+    if(jsonNeedsEscape(text[i])){
+      p += jsonEscape(text[i], p);
+    } else {
+      *p++ = text[i];
+    }
+  }
+  blocks->len = p - blocks->data;
+}
+
+// Hands the bytes written since the last part over as a part
+void OpenAI_JsonBody::flush(){
+  if(blocks != NULL && blocks->len > pending){
+    addPart((const uint8_t *)blocks->data + pending, blocks->len - pending, false);
+    pending = blocks->len;
+  }
+}
+
+// Comma and key in front of a value
+void OpenAI_JsonBody::separate(const char * key){
+  if(level){
+    uint32_t bit = 1UL << (level - 1);
+    if(members & bit){
+      append(",", 1);
+    }
+    members |= bit;
+  }
+  if(key != NULL){
+    append("\"", 1);
+    appendEscaped(key, strlen(key));
+    append("\":", 2);
+  }
+}
+
+bool OpenAI_JsonBody::beginObject(const char * key){
+  if(level == 32){
+    log_e("JSON is nested too deep");
+    fail();
+    return false;
+  }
+  separate(key);
+  append("{", 1);
+  members &= ~(1UL << level);
+  level++;
+  return valid();
+}
+
+bool OpenAI_JsonBody::endObject(){
+  if(level){
+    level--;
+  }
+  append("}", 1);
+  return valid();
+}
+
+bool OpenAI_JsonBody::beginArray(const char * key){
+  if(level == 32){
+    log_e("JSON is nested too deep");
+    fail();
+    return false;
+  }
+  separate(key);
+  append("[", 1);
+  members &= ~(1UL << level);
+  level++;
+  return valid();
+}
+
+bool OpenAI_JsonBody::endArray(){
+  if(level){
+    level--;
+  }
+  append("]", 1);
+  return valid();
+}
+
+bool OpenAI_JsonBody::addString(const char * key, const char * value, bool copy){
+  if(value == NULL){
+    separate(key);
+    append("null", 4);
+    return valid();
+  }
+  size_t len = strlen(value);
+  separate(key);
+  append("\"", 1);
+  if(copy || len <= OPENAI_JSON_INLINE){
+    appendEscaped(value, len);
+  } else {
+    flush();
+    addEscaped(value, len);
+  }
+  append("\"", 1);
+  return valid();
+}
+
+bool OpenAI_JsonBody::addNumber(const char * key, double value){
+  char num[24];
+  separate(key);
+  append(num, snprintf(num, sizeof(num), "%g", value));
+  return valid();
+}
+
+bool OpenAI_JsonBody::addInteger(const char * key, long value){
+  char num[24];
+  separate(key);
+  append(num, snprintf(num, sizeof(num), "%ld", value));
+  return valid();
+}
+
+bool OpenAI_JsonBody::addBool(const char * key, bool value){
+  separate(key);
+  if(value){
+    append("true", 4);
+  } else {
+    append("false", 5);
+  }
+  return valid();
+}
+
+bool OpenAI_JsonBody::addRaw(const char * key, const char * json, bool copy){
+  size_t len = strlen(json);
+  separate(key);
+  if(copy || len <= OPENAI_JSON_INLINE){
+    append(json, len);
+  } else {
+    flush();
+    addPart((const uint8_t *)json, len, false);
+  }
+  return valid();
+}
+
+bool OpenAI_JsonBody::end(){
+  if(!ended){
+    if(level){
+      log_e("JSON has %u open containers", level);
+      fail();
+    }
+    flush();
+    ended = true;
+  }
+  return valid();
+}
+
+String OpenAI_JsonBody::toString(){
+  String s;
+  char buffer[64];
+  size_t n;
+  end();
+  if(!valid() || !s.reserve(length())){
+    return String();
+  }
+  rewind();
+  while((n = readBytes(buffer, sizeof(buffer))) > 0){
+    s.concat(buffer, n);
+  }
+  rewind();
+  return s;
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include "Arduino.h"
+#include "FS.h"
+
+typedef struct {
+    size_t bytes;         //Body bytes sent
+    unsigned long time;   //ms from the first to the last byte handed to the connection
+    size_t heap_used;     //Largest drop of the free heap while sending
+} OpenAI_UploadStats;
+
+// Request body made of parts that are sent one after another.
+// Large payloads are referenced, not copied, and reach the connection straight from where they already are.
+class OpenAI_Body : public Stream {
+  private:
+    typedef struct {
+      const uint8_t * data;   //memory part
+      Stream * stream;        //or a stream that is read while sending
+      fs::File * file;        //set if the stream can be rewound
+      size_t start;           //Position in the file, or the length of escaped text
+      size_t len;             //Bytes that are sent
+      bool owned;
+      bool escaped;           //data is text that is escaped for a JSON string while sending
+    } Part;
+
+    Part * parts;
+    unsigned int parts_len;
+    unsigned int parts_size;
+    unsigned int part;
+    size_t offset;
+    size_t total;
+    size_t sent;
+    bool failed;
+    unsigned long started;
+    unsigned long finished;
+    size_t heap_start;
+    size_t heap_min;
+    size_t text_pos;          //Of the escaped part being sent
+    char esc[8];
+    uint8_t esc_len;
+    uint8_t esc_pos;
+
+    Part * newPart(size_t len);
+    size_t readEscaped(const Part * p, char * buffer, size_t length);
+
+  protected:
+    bool addPart(const uint8_t * data, size_t len, bool copy);
+    bool addPart(Stream * stream, size_t len);
+    bool addPart(fs::File * file, size_t len);
+    bool addEscaped(const char * text, size_t len);               //Referenced, has to stay valid until sent
+    void fail(){ failed = true; }
+    bool addText(const String & text){
+      return addPart((const uint8_t *)text.c_str(), text.length(), true);
+    }
+
+  public:
+    OpenAI_Body();
+    virtual ~OpenAI_Body();
+
+    size_t length(){ return total; }   //Content-Length of the whole body
+    bool valid(){ return !failed; }    //false if a part could not be added
+    bool rewind();                     //Start over, i.e. to resend the body. false if a stream part can not be read again
+    OpenAI_UploadStats stats();
+
+    int available();
+    int read();
+    int peek();
+    size_t readBytes(char * buffer, size_t length);
+    size_t write(uint8_t c){ return 0; }
+};
+
+// multipart/form-data body. Field values are copied, file contents are only referenced
+// and have to stay valid until the upload is done
+class OpenAI_Multipart : public OpenAI_Body {
+  private:
+    String boundary;
+    bool ended;
+
+  public:
+    OpenAI_Multipart(const char * boundary);
+
+    bool addField(const char * name, const char * value);
+    bool addFile(const char * name, const char * filename, const char * mime, const uint8_t * data, size_t len);
+    bool addFile(const char * name, const char * filename, const char * mime, Stream * stream, size_t len);  //len bytes are read from the stream while uploading
+    bool addFile(const char * name, const char * filename, const char * mime, fs::File & file);            //The rest of the file is read while uploading
+    void end();                        //Adds the closing boundary. Called by OpenAI::upload()
+    String contentType(){
+      return "multipart/form-data; boundary=" + boundary;
+    }
+};
+
+#define OPENAI_JSON_BLOCK   256   //Size of the blocks that hold the syntax, numbers and short strings
+#define OPENAI_JSON_INLINE  64    //Longer strings are referenced instead of copied
+
+// application/json body that is serialized while it is sent. Keys, numbers and short strings are written
+// to small blocks, longer strings are referenced and escaped on their way to the connection, so the
+// document is never held in one piece. Referenced strings have to stay valid until the request is done.
+// Keys are NULL for the elements of arrays and for the document itself
+class OpenAI_JsonBody : public OpenAI_Body {
+  private:
+    typedef struct Block {
+      struct Block * next;
+      size_t len;
+      size_t size;
+      char * data;          //Follows the block in the same allocation
+    } Block;
+
+    Block * blocks;         //The one being written first
+    size_t pending;         //Start of the bytes of the first block that are not a part yet
+    uint32_t members;       //Bit per level, set once its container has a member
+    uint8_t level;
+    bool ended;
+
+    char * reserve(size_t len);
+    void append(const char * text, size_t len);
+    void appendEscaped(const char * text, size_t len);
+    void flush();
+    void separate(const char * key);
+
+  public:
+    OpenAI_JsonBody();
+    ~OpenAI_JsonBody();
+
+    bool beginObject(const char * key=NULL);
+    bool endObject();
+    bool beginArray(const char * key=NULL);
+    bool endArray();
+    bool addString(const char * key, const char * value, bool copy=false);    //Short values are always copied. NULL is written as null
+    bool addNumber(const char * key, double value);
+    bool addInteger(const char * key, long value);
+    bool addBool(const char * key, bool value);
+    bool addRaw(const char * key, const char * json, bool copy=false);        //Has to be valid JSON
+    bool end();                        //Checks that every container is closed. Called by OpenAI::post()
+    String toString();                 //The whole document, i.e. for logs or as the key of the response cache
+};
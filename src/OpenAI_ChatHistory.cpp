@@ -0,0 +1,177 @@
+#include "OpenAI_ChatHistory.h"
+#include "OpenAI_Allocator.h"
+
+// Role, length, tokens and terminator
+#define OPENAI_HISTORY_RECORD 10
+#define OPENAI_HISTORY_TEXT   9
+
+static uint32_t recordLength(const uint8_t * record){
+  uint32_t len;
+  memcpy(&len, record + 1, sizeof(len));
+  return len;
+}
+
+static uint32_t recordTokens(const uint8_t * record){
+  uint32_t tokens;
+  memcpy(&tokens, record + 5, sizeof(tokens));
+  return tokens;
+}
+
+OpenAI_ChatHistory::OpenAI_ChatHistory(size_t max_bytes)
+  : data(NULL)
+  , start(0)
+  , end(0)
+  , size(0)
+  , max_size(max_bytes)
+  , count(0)
+  , token_count(0)
+  , dropped_count(0)
+{}
+
+OpenAI_ChatHistory::~OpenAI_ChatHistory(){
+  if(data != NULL){
+    openai_free(data);
+  }
+}
+
+void OpenAI_ChatHistory::clear(){
+  if(data != NULL){
+    openai_free(data);
+    data = NULL;
+  }
+  start = 0;
+  end = 0;
+  size = 0;
+  count = 0;
+  token_count = 0;
+  dropped_count = 0;
+}
+
+void OpenAI_ChatHistory::dropFirst(){
+  token_count -= recordTokens(&data[start]);
+  start += OPENAI_HISTORY_RECORD + recordLength(&data[start]);
+  count--;
+  dropped_count++;
+  if(!count){
+    start = 0;
+    end = 0;
+    token_count = 0;
+  }
+}
+
+bool OpenAI_ChatHistory::removeOldest(){
+  if(!count){
+    return false;
+  }
+  dropFirst();
+  while(count && data[start] == OPENAI_CHAT_ROLE_ASSISTANT){
+    dropFirst();
+  }
+  return true;
+}
+
+bool OpenAI_ChatHistory::removeNewest(){
+  if(!count){
+    return false;
+  }
+  // Records only link forward, so the last one is found from the oldest
+  size_t last = start;
+  for(unsigned int i = 1; i < count; i++){
+    last += OPENAI_HISTORY_RECORD + recordLength(&data[last]);
+  }
+  token_count -= recordTokens(&data[last]);
+  end = last;
+  count--;
+  if(!count){
+    start = 0;
+    end = 0;
+    token_count = 0;
+  }
+  return true;
+}
+
+void OpenAI_ChatHistory::setMaxBytes(size_t max_bytes){
+  max_size = max_bytes;
+  while(count && bytes() > max_size){
+    dropFirst();
+  }
+  // A turn starts with the question
+  while(count && data[start] == OPENAI_CHAT_ROLE_ASSISTANT){
+    dropFirst();
+  }
+}
+
+// Makes room for len more bytes at the end. Drops the oldest turns first if the cap is reached
+bool OpenAI_ChatHistory::reserve(size_t len){
+  if(len > max_size){
+    log_e("Message of %u bytes does not fit in the history", len);
+    return false;
+  }
+  while(count && (bytes() + len) > max_size){
+    removeOldest();
+  }
+  if((end + len) <= size){
+    return true;
+  }
+  // Move the records to the front before growing
+  if(start && (bytes() + len) <= size){
+    memmove(data, &data[start], bytes());
+    end -= start;
+    start = 0;
+    return true;
+  }
+  size_t s = (size)?(size * 2):256;
+  while(s < (bytes() + len)){
+    s *= 2;
+  }
+  if(s > max_size){
+    s = max_size;
+  }
+  if(start){
+    memmove(data, &data[start], bytes());
+    end -= start;
+    start = 0;
+  }
+  uint8_t * d = (uint8_t*)openai_realloc(data, s, OPENAI_MEMORY_HISTORY);
+  if(d == NULL){
+    log_e("History could not be allocated");
+    return false;
+  }
+  data = d;
+  size = s;
+  return true;
+}
+
+bool OpenAI_ChatHistory::add(OpenAI_Chat_Role role, const char * content, unsigned int tokens){
+  if(content == NULL){
+    return false;
+  }
+  uint32_t len = strlen(content);
+  if(!reserve(OPENAI_HISTORY_RECORD + len)){
+    return false;
+  }
+  // Its question was dropped to make room
+  if(!count && role == OPENAI_CHAT_ROLE_ASSISTANT){
+    return false;
+  }
+  data[end] = role;
+  memcpy(&data[end + 1], &len, sizeof(len));
+  memcpy(&data[end + 5], &tokens, sizeof(uint32_t));
+  memcpy(&data[end + OPENAI_HISTORY_TEXT], content, len + 1);
+  end += OPENAI_HISTORY_RECORD + len;
+  count++;
+  token_count += tokens;
+  return true;
+}
+
+bool OpenAI_ChatHistory::read(size_t & cursor, OpenAI_Chat_Role & role, const char * & content, size_t & len){
+  if((start + cursor) >= end){
+    return false;
+  }
+  const uint8_t * r = &data[start + cursor];
+  role = (OpenAI_Chat_Role)r[0];
+  len = recordLength(r);
+  content = (const char *)(r + OPENAI_HISTORY_TEXT);
+  cursor += OPENAI_HISTORY_RECORD + len;
+  return true;
+}
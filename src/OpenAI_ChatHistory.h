@@ -0,0 +1,45 @@
+#pragma once
+#include "Arduino.h"
+
+typedef enum {
+  OPENAI_CHAT_ROLE_SYSTEM,
+  OPENAI_CHAT_ROLE_USER,
+  OPENAI_CHAT_ROLE_ASSISTANT
+} OpenAI_Chat_Role;
+
+// Messages of a conversation, packed one after another in a single buffer.
+// A record is the role byte, the length and tokens as uint32 and the UTF-8 text with its terminator.
+// Once the records reach the cap, the oldest turns are dropped to make room
+class OpenAI_ChatHistory {
+  private:
+    uint8_t * data;
+    size_t start;          //Offset of the oldest record
+    size_t end;            //Offset past the newest record
+    size_t size;           //Allocated
+    size_t max_size;
+    unsigned int count;
+    size_t token_count;
+    unsigned long dropped_count;
+
+    void dropFirst();
+    bool reserve(size_t len);
+
+  public:
+    OpenAI_ChatHistory(size_t max_bytes=16384);
+    ~OpenAI_ChatHistory();
+
+    void setMaxBytes(size_t max_bytes);   //Drops the oldest turns if the records already take more
+    bool add(OpenAI_Chat_Role role, const char * content, unsigned int tokens=0); //Tokens of the message, as counted by the caller
+    bool removeOldest();                  //Drops the oldest turn, the question and its replies
+    bool removeNewest();                  //Takes back the last record, i.e. a question whose reply could not be added
+    void clear();
+
+    unsigned int length(){ return count; }
+    size_t tokens(){ return token_count; }          //Sum of the tokens of the records
+    unsigned long dropped(){ return dropped_count; }//Records dropped so far, tells which of them are still there
+    size_t bytes(){ return end - start; }           //Taken by the records
+    size_t capacity(){ return size; }               //Allocated
+
+    //Reads the record at cursor and moves the cursor to the next one. Start with 0. false after the last record
+    bool read(size_t & cursor, OpenAI_Chat_Role & role, const char * & content, size_t & len);
+};
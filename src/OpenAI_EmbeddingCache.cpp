@@ -0,0 +1,437 @@
+#include "OpenAI_EmbeddingCache.h"
+#include "OpenAI_Allocator.h"
+
+// File layout: "OAEC", uint32 version, then records of
+// uint64 key, uint32 number of values, uint32 FNV-1a of the values, float32 values
+#define OPENAI_CACHE_MAGIC    0x4345414F
+#define OPENAI_CACHE_VERSION  1
+#define OPENAI_CACHE_HEADER   8
+#define OPENAI_CACHE_RECORD   16
+
+typedef struct {
+    uint64_t key;
+    uint32_t len;
+    uint32_t check;
+} OpenAI_CacheRecordHeader;
+
+static uint32_t checksum(const float * values, unsigned int len){
+  const uint8_t * p = (const uint8_t *)values;
+  uint32_t h = 2166136261UL;
+  for(size_t i = 0; i < len * sizeof(float); i++){
+    h = (h ^ p[i]) * 16777619UL;
+  }
+  return h;
+}
+
+OpenAI_EmbeddingCache::OpenAI_EmbeddingCache(size_t max_ram)
+  : lock(NULL)
+  , head(NULL)
+  , tail(NULL)
+  , ram_bytes(0)
+  , ram_max(max_ram)
+  , fs(NULL)
+  , path()
+  , flash_max(0)
+  , records(NULL)
+  , records_len(0)
+  , records_size(0)
+{
+  memset(&counters, 0, sizeof(counters));
+  lock = xSemaphoreCreateMutex();
+  if(lock == NULL){
+    log_e("Cache lock could not be allocated");
+  }
+}
+
+OpenAI_EmbeddingCache::~OpenAI_EmbeddingCache(){
+  end();
+  while(head != NULL){
+    dropRam(head);
+  }
+  if(lock != NULL){
+    vSemaphoreDelete(lock);
+  }
+}
+
+uint64_t OpenAI_EmbeddingCache::key(const char * model, const char * input){
+  uint64_t h = 14695981039346656037ULL;
+  const char * parts[2] = { model, input };
+  for(int i = 0; i < 2; i++){
+    const char * p = parts[i];
+    while(p != NULL && *p){
+      h = (h ^ (uint8_t)*p++) * 1099511628211ULL;
+    }
+    // The terminator keeps ("ab", "c") apart from ("a", "bc")
+    h = h * 1099511628211ULL;
+  }
+  return h;
+}
+
+//
+// RAM tier
+//
+
+OpenAI_EmbeddingCache::Entry * OpenAI_EmbeddingCache::find(uint64_t key){
+  for(Entry * e = head; e != NULL; e = e->next){
+    if(e->key == key){
+      return e;
+    }
+  }
+  return NULL;
+}
+
+void OpenAI_EmbeddingCache::dropRam(Entry * e){
+  if(e->prev != NULL){
+    e->prev->next = e->next;
+  } else {
+    head = e->next;
+  }
+  if(e->next != NULL){
+    e->next->prev = e->prev;
+  } else {
+    tail = e->prev;
+  }
+  ram_bytes -= sizeof(Entry) + e->len * sizeof(float);
+  openai_free(e);
+}
+
+void OpenAI_EmbeddingCache::putRam(uint64_t key, const float * values, unsigned int len){
+  size_t size = sizeof(Entry) + len * sizeof(float);
+  if(size > ram_max){
+    return;
+  }
+  // Least recently used first
+  while(tail != NULL && (ram_bytes + size) > ram_max){
+    dropRam(tail);
+    counters.evictions++;
+  }
+  Entry * e = (Entry*)openai_malloc(size, OPENAI_MEMORY_CACHE);
+  if(e == NULL){
+    log_e("Cache entry could not be allocated");
+    return;
+  }
+  e->key = key;
+  e->len = len;
+  e->values = (float*)(e + 1);
+  memcpy(e->values, values, len * sizeof(float));
+  e->prev = NULL;
+  e->next = head;
+  if(head != NULL){
+    head->prev = e;
+  } else {
+    tail = e;
+  }
+  head = e;
+  ram_bytes += size;
+}
+
+//
+// Flash tier
+//
+
+bool OpenAI_EmbeddingCache::addRecord(uint64_t key, uint32_t offset){
+  if(records_len == records_size){
+    unsigned int s = (records_size)?(records_size * 2):64;
+    Record * r = (Record*)openai_realloc(records, s * sizeof(Record), OPENAI_MEMORY_CACHE);
+    if(r == NULL){
+      log_e("Cache index could not be allocated");
+      return false;
+    }
+    records = r;
+    records_size = s;
+  }
+  records[records_len].key = key;
+  records[records_len].offset = offset;
+  records_len++;
+  return true;
+}
+
+// Reads the record headers. A record cut short by a reset ends the file
+bool OpenAI_EmbeddingCache::load(){
+  records_len = 0;
+  counters.flash_bytes = 0;
+  fs::File f = fs->open(path.c_str(), "r");
+  if(f){
+    uint32_t header[2] = { 0, 0 };
+    size_t size = f.size();
+    if(f.read((uint8_t*)header, OPENAI_CACHE_HEADER) == OPENAI_CACHE_HEADER && header[0] == OPENAI_CACHE_MAGIC && header[1] == OPENAI_CACHE_VERSION){
+      size_t offset = OPENAI_CACHE_HEADER;
+      OpenAI_CacheRecordHeader r;
+      while((offset + OPENAI_CACHE_RECORD) <= size){
+        if(!f.seek(offset) || f.read((uint8_t*)&r, OPENAI_CACHE_RECORD) != OPENAI_CACHE_RECORD){
+          break;
+        }
+        size_t next = offset + OPENAI_CACHE_RECORD + (size_t)r.len * sizeof(float);
+        if(!r.len || next > size || !addRecord(r.key, offset)){
+          break;
+        }
+        offset = next;
+      }
+      counters.flash_bytes = offset;
+      if(offset == size){
+        f.close();
+        return true;
+      }
+      log_e("Cache file ends after %u of %u bytes", offset, size);
+    } else if(size){
+      log_e("Invalid cache file: %s", path.c_str());
+    }
+    f.close();
+  }
+  // New, foreign or damaged file. Write what is still valid to a clean one
+  return compact(0);
+}
+
+// Rewrites the file with the newest records that leave room for needed bytes
+bool OpenAI_EmbeddingCache::compact(size_t needed){
+  size_t keep_max = (needed)?((flash_max * 3 / 4 > needed)?(flash_max * 3 / 4 - needed):0):flash_max;
+  unsigned int first = records_len;
+  size_t kept = OPENAI_CACHE_HEADER;
+  while(first > 0){
+    size_t end = (first < records_len)?records[first].offset:counters.flash_bytes;
+    size_t size = end - records[first - 1].offset;
+    if((kept + size) > keep_max){
+      break;
+    }
+    kept += size;
+    first--;
+  }
+
+  String tmp = path + ".tmp";
+  fs::File out = fs->open(tmp.c_str(), "w");
+  if(!out){
+    log_e("Cache file could not be created: %s", tmp.c_str());
+    return false;
+  }
+  uint32_t header[2] = { OPENAI_CACHE_MAGIC, OPENAI_CACHE_VERSION };
+  bool ok = out.write((const uint8_t*)header, OPENAI_CACHE_HEADER) == OPENAI_CACHE_HEADER;
+  if(ok && first < records_len){
+    fs::File in = fs->open(path.c_str(), "r");
+    ok = in && in.seek(records[first].offset);
+    uint8_t buf[256];
+    size_t left = counters.flash_bytes - records[first].offset;
+    while(ok && left){
+      size_t n = in.read(buf, (left > sizeof(buf))?sizeof(buf):left);
+      ok = n > 0 && out.write(buf, n) == n;
+      left -= n;
+    }
+    if(in){
+      in.close();
+    }
+  }
+  out.close();
+  if(!ok){
+    log_e("Cache file could not be compacted");
+    fs->remove(tmp.c_str());
+    return false;
+  }
+  fs->remove(path.c_str());
+  if(!fs->rename(tmp.c_str(), path.c_str())){
+    log_e("Cache file could not be renamed");
+    records_len = 0;
+    counters.flash_bytes = 0;
+    return false;
+  }
+
+  // The kept records move to the front
+  counters.evictions += first;
+  if(first < records_len){
+    uint32_t shift = records[first].offset - OPENAI_CACHE_HEADER;
+    for(unsigned int i = first; i < records_len; i++){
+      records[i - first].key = records[i].key;
+      records[i - first].offset = records[i].offset - shift;
+    }
+  }
+  records_len -= first;
+  counters.flash_bytes = kept;
+  return true;
+}
+
+unsigned int OpenAI_EmbeddingCache::readFlash(uint64_t key, float * values, unsigned int len){
+  // Newest first, a key is only written again after its record was dropped
+  unsigned int i = records_len;
+  while(i > 0 && records[i - 1].key != key){
+    i--;
+  }
+  if(i == 0){
+    return 0;
+  }
+  fs::File f = fs->open(path.c_str(), "r");
+  if(!f){
+    return 0;
+  }
+  OpenAI_CacheRecordHeader r;
+  unsigned int result = 0;
+  if(f.seek(records[i - 1].offset) && f.read((uint8_t*)&r, OPENAI_CACHE_RECORD) == OPENAI_CACHE_RECORD && r.key == key){
+    result = r.len;
+    if(r.len <= len){
+      size_t size = r.len * sizeof(float);
+      if(f.read((uint8_t*)values, size) != size || checksum(values, r.len) != r.check){
+        log_e("Cache record is damaged");
+        result = 0;
+      }
+    }
+  }
+  f.close();
+  return result;
+}
+
+bool OpenAI_EmbeddingCache::putFlash(uint64_t key, const float * values, unsigned int len){
+  size_t size = OPENAI_CACHE_RECORD + len * sizeof(float);
+  if((OPENAI_CACHE_HEADER + size) > flash_max){
+    return false;
+  }
+  if((counters.flash_bytes + size) > flash_max && !compact(size)){
+    return false;
+  }
+  fs::File f = fs->open(path.c_str(), "a");
+  if(!f){
+    log_e("Cache file could not be opened: %s", path.c_str());
+    return false;
+  }
+  OpenAI_CacheRecordHeader r;
+  r.key = key;
+  r.len = len;
+  r.check = checksum(values, len);
+  bool ok = f.write((const uint8_t*)&r, OPENAI_CACHE_RECORD) == OPENAI_CACHE_RECORD
+         && f.write((const uint8_t*)values, len * sizeof(float)) == (len * sizeof(float));
+  f.close();
+  if(!ok){
+    log_e("Cache record could not be written");
+    // Whatever was written is dropped by the next load()
+    return false;
+  }
+  if(!addRecord(key, counters.flash_bytes)){
+    return false;
+  }
+  counters.flash_bytes += size;
+  return true;
+}
+
+//
+// Public
+//
+
+bool OpenAI_EmbeddingCache::begin(fs::FS & f, const char * p, size_t max_flash){
+  end();
+  xSemaphoreTake(lock, portMAX_DELAY);
+  fs = &f;
+  path = p;
+  flash_max = max_flash;
+  bool ok = load();
+  if(!ok){
+    fs = NULL;
+    records_len = 0;
+    counters.flash_bytes = 0;
+  }
+  xSemaphoreGive(lock);
+  return ok;
+}
+
+void OpenAI_EmbeddingCache::end(){
+  xSemaphoreTake(lock, portMAX_DELAY);
+  fs = NULL;
+  openai_free(records);
+  records = NULL;
+  records_len = 0;
+  records_size = 0;
+  counters.flash_bytes = 0;
+  xSemaphoreGive(lock);
+}
+
+void OpenAI_EmbeddingCache::clear(){
+  xSemaphoreTake(lock, portMAX_DELAY);
+  while(head != NULL){
+    dropRam(head);
+  }
+  if(fs != NULL){
+    records_len = 0;
+    counters.flash_bytes = 0;
+    compact(0);
+  }
+  xSemaphoreGive(lock);
+}
+
+unsigned int OpenAI_EmbeddingCache::get(uint64_t key, float * values, unsigned int len){
+  unsigned long start = micros();
+  unsigned int result = 0;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  Entry * e = find(key);
+  if(e != NULL){
+    result = e->len;
+    if(e->len <= len){
+      memcpy(values, e->values, e->len * sizeof(float));
+      // Move to the front of the LRU list
+      if(e != head){
+        e->prev->next = e->next;
+        if(e->next != NULL){
+          e->next->prev = e->prev;
+        } else {
+          tail = e->prev;
+        }
+        e->prev = NULL;
+        e->next = head;
+        head->prev = e;
+        head = e;
+      }
+      counters.ram_hits++;
+    }
+  } else if(fs != NULL){
+    result = readFlash(key, values, len);
+    if(result && result <= len){
+      putRam(key, values, result);
+      counters.flash_hits++;
+    }
+  }
+  // A buffer that was too small is not a lookup, the caller tries again with a larger one
+  if(result <= len){
+    if(!result){
+      counters.misses++;
+    }
+    counters.lookups++;
+    counters.lookup_time += micros() - start;
+  }
+  counters.ram_bytes = ram_bytes;
+  xSemaphoreGive(lock);
+  return result;
+}
+
+bool OpenAI_EmbeddingCache::put(uint64_t key, const float * values, unsigned int len){
+  if(values == NULL || !len){
+    return false;
+  }
+  xSemaphoreTake(lock, portMAX_DELAY);
+  if(find(key) == NULL){
+    putRam(key, values, len);
+  }
+  bool ok = true;
+  if(fs != NULL){
+    unsigned int i = records_len;
+    while(i > 0 && records[i - 1].key != key){
+      i--;
+    }
+    if(i == 0){
+      ok = putFlash(key, values, len);
+    }
+  }
+  counters.ram_bytes = ram_bytes;
+  xSemaphoreGive(lock);
+  return ok;
+}
+
+OpenAI_EmbeddingCacheStats OpenAI_EmbeddingCache::stats(){
+  OpenAI_EmbeddingCacheStats s;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  s = counters;
+  xSemaphoreGive(lock);
+  return s;
+}
+
+void OpenAI_EmbeddingCache::resetStats(){
+  xSemaphoreTake(lock, portMAX_DELAY);
+  size_t flash_bytes = counters.flash_bytes;
+  memset(&counters, 0, sizeof(counters));
+  counters.ram_bytes = ram_bytes;
+  counters.flash_bytes = flash_bytes;
+  xSemaphoreGive(lock);
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "Arduino.h"
+#include "FS.h"
+
+typedef struct {
+    unsigned int lookups;
+    unsigned int ram_hits;
+    unsigned int flash_hits;
+    unsigned int misses;
+    unsigned long lookup_time;   //us spent in lookups, hits and misses
+    size_t ram_bytes;            //Bytes held by the RAM tier
+    size_t flash_bytes;          //Size of the flash file
+    unsigned int evictions;      //Vectors dropped from either tier to stay under its cap
+} OpenAI_EmbeddingCacheStats;
+
+// Embedding vectors keyed by a hash of (model, input), so the same text is only sent to the API once.
+// Recently used vectors are kept in RAM. With begin() they are also appended to a file on LittleFS, SPIFFS or SD
+// and survive a reboot. Pass it to OpenAI::setEmbeddingCache() or OpenAI_Embedding::setCache()
+class OpenAI_EmbeddingCache {
+  private:
+    typedef struct Entry {
+      struct Entry * prev;
+      struct Entry * next;
+      uint64_t key;
+      unsigned int len;
+      float * values;          //Follows the entry in the same allocation
+    } Entry;
+
+    typedef struct {
+      uint64_t key;
+      uint32_t offset;   //Of the record in the file
+    } Record;
+
+    SemaphoreHandle_t lock;
+    Entry * head;              //Most recently used
+    Entry * tail;
+    size_t ram_bytes;
+    size_t ram_max;
+    fs::FS * fs;
+    String path;
+    size_t flash_max;
+    Record * records;          //Index of the file, oldest first
+    unsigned int records_len;
+    unsigned int records_size;
+    OpenAI_EmbeddingCacheStats counters;
+
+    Entry * find(uint64_t key);
+    void putRam(uint64_t key, const float * values, unsigned int len);
+    void dropRam(Entry * e);
+    unsigned int readFlash(uint64_t key, float * values, unsigned int len);
+    bool putFlash(uint64_t key, const float * values, unsigned int len);
+    bool addRecord(uint64_t key, uint32_t offset);
+    bool load();
+    bool compact(size_t needed);
+
+  public:
+    OpenAI_EmbeddingCache(size_t max_ram=64*1024);    //Bytes of vectors kept in RAM. 0 keeps only the flash tier
+    ~OpenAI_EmbeddingCache();
+
+    bool begin(fs::FS & fs, const char * path="/embeddings.bin", size_t max_flash=1024*1024); //Loads the index of the file and appends new vectors to it
+    void end();                                                   //Stops using the file. It is kept for the next begin()
+    void clear();                                                 //Drops the vectors of both tiers and truncates the file
+
+    static uint64_t key(const char * model, const char * input);  //64 bit FNV-1a of the model and the input
+    unsigned int get(uint64_t key, float * values, unsigned int len); //Returns the length of the cached vector or 0 on a miss. The values are copied only if they fit in len
+    bool put(uint64_t key, const float * values, unsigned int len);
+
+    OpenAI_EmbeddingCacheStats stats();
+    void resetStats();
+};
@@ -0,0 +1,141 @@
+#pragma once
+#include "Arduino.h"
+#include "OpenAI_Body.h"
+
+typedef enum {
+  OPENAI_FIELD_TEXT,     //const char *. NULL is left out, unless there is a fallback
+  OPENAI_FIELD_REAL,     //float
+  OPENAI_FIELD_COUNT,    //unsigned int
+  OPENAI_FIELD_FLAG,     //bool
+  OPENAI_FIELD_CHOICE    //uint8_t index into names
+} OpenAI_Field_Type;
+
+// One parameter of a request: its key, the member of the builder that holds it, the value the API
+// assumes when it is left out and the range its setter accepts. Each builder has a constant table of
+// them that is made at compile time and stays in flash. It writes the body and checks the setters,
+// so a new parameter is one entry
+template<class C>
+struct OpenAI_Field {
+  const char * key;
+  OpenAI_Field_Type type;
+  const char * C::* text;
+  float C::* real;
+  unsigned int C::* count;
+  bool C::* flag;
+  uint8_t C::* choice;
+  const char * const * names;  //Values of CHOICE
+  const char * fallback;       //Sent for TEXT while the member is NULL
+  float def;                   //Left out while the value equals it
+  float min;
+  float max;
+};
+
+#define OPENAI_FIELD_NO_MAX 1e9f
+
+template<class C>
+constexpr OpenAI_Field<C> openaiText(const char * key, const char * C::* m, const char * fallback=nullptr){
+  return {key, OPENAI_FIELD_TEXT, m, nullptr, nullptr, nullptr, nullptr, nullptr, fallback, 0, 0, 0};
+}
+
+template<class C>
+constexpr OpenAI_Field<C> openaiReal(const char * key, float C::* m, float def, float min, float max){
+  return {key, OPENAI_FIELD_REAL, nullptr, m, nullptr, nullptr, nullptr, nullptr, nullptr, def, min, max};
+}
+
+template<class C>
+constexpr OpenAI_Field<C> openaiCount(const char * key, unsigned int C::* m, unsigned int def, unsigned int min, float max=OPENAI_FIELD_NO_MAX){
+  return {key, OPENAI_FIELD_COUNT, nullptr, nullptr, m, nullptr, nullptr, nullptr, nullptr, (float)def, (float)min, max};
+}
+
+template<class C>
+constexpr OpenAI_Field<C> openaiFlag(const char * key, bool C::* m, bool def){
+  return {key, OPENAI_FIELD_FLAG, nullptr, nullptr, nullptr, m, nullptr, nullptr, nullptr, def?1.0f:0.0f, 0, 1};
+}
+
+template<class C>
+constexpr OpenAI_Field<C> openaiChoice(const char * key, uint8_t C::* m, const char * const * names, unsigned int count){
+  return {key, OPENAI_FIELD_CHOICE, nullptr, nullptr, nullptr, nullptr, m, names, nullptr, 0, 0, (float)(count - 1)};
+}
+
+template<class C> static bool openaiIsField(const OpenAI_Field<C> & f, float C::* m){ return f.real == m; }
+template<class C> static bool openaiIsField(const OpenAI_Field<C> & f, unsigned int C::* m){ return f.count == m; }
+template<class C> static bool openaiIsField(const OpenAI_Field<C> & f, bool C::* m){ return f.flag == m; }
+template<class C> static bool openaiIsField(const OpenAI_Field<C> & f, uint8_t C::* m){ return f.choice == m; }
+
+// Sets the member if the value is in the range of its field
+template<class C, size_t N, class T, class V>
+static bool openaiSetField(C * builder, const OpenAI_Field<C> (&fields)[N], T C::* m, V value){
+  for(size_t i = 0; i < N; i++){
+    if(openaiIsField(fields[i], m)){
+      if((float)value < fields[i].min || (float)value > fields[i].max){
+        log_e("%s out of range", fields[i].key);
+        return false;
+      }
+      break;
+    }
+  }
+  builder->*m = (T)value;
+  return true;
+}
+
+// Value of the field as text. NULL if it is left out
+template<class C>
+static const char * openaiFieldText(const C * builder, const OpenAI_Field<C> & f, char * num, size_t len){
+  switch(f.type){
+    case OPENAI_FIELD_TEXT: {
+      const char * s = (f.text != nullptr)?(builder->*f.text):NULL;
+      return (s != NULL)?s:f.fallback;
+    }
+    case OPENAI_FIELD_REAL:
+      if(builder->*f.real == f.def){
+        return NULL;
+      }
+      snprintf(num, len, "%g", builder->*f.real);
+      return num;
+    case OPENAI_FIELD_COUNT:
+      if(builder->*f.count == (unsigned int)f.def){
+        return NULL;
+      }
+      snprintf(num, len, "%u", builder->*f.count);
+      return num;
+    case OPENAI_FIELD_FLAG:
+      if(builder->*f.flag == (f.def != 0)){
+        return NULL;
+      }
+      return (builder->*f.flag)?"true":"false";
+    case OPENAI_FIELD_CHOICE:
+      if(builder->*f.choice == (uint8_t)f.def){
+        return NULL;
+      }
+      return f.names[builder->*f.choice];
+  }
+  return NULL;
+}
+
+template<class C, size_t N>
+static void openaiWriteFields(const C * builder, const OpenAI_Field<C> (&fields)[N], OpenAI_JsonBody & body){
+  char num[24];
+  for(size_t i = 0; i < N; i++){
+    const OpenAI_Field<C> & f = fields[i];
+    const char * value = openaiFieldText(builder, f, num, sizeof(num));
+    if(value == NULL){
+      continue;
+    }
+    if(f.type == OPENAI_FIELD_TEXT || f.type == OPENAI_FIELD_CHOICE){
+      body.addString(f.key, value);
+    } else {
+      body.addRaw(f.key, value, true);
+    }
+  }
+}
+
+template<class C, size_t N>
+static void openaiWriteFields(const C * builder, const OpenAI_Field<C> (&fields)[N], OpenAI_Multipart & body){
+  char num[24];
+  for(size_t i = 0; i < N; i++){
+    const char * value = openaiFieldText(builder, fields[i], num, sizeof(num));
+    if(value != NULL){
+      body.addField(fields[i].key, value);
+    }
+  }
+}
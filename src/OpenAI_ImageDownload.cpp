@@ -0,0 +1,327 @@
+#include "OpenAI_ImageDownload.h"
+#include "OpenAI.h"
+#include "HTTPClient.h"
+#include <vector>
+
+#define OPENAI_DOWNLOAD_MAX_CONNECTIONS 10
+
+OpenAI_ImageDownload::OpenAI_ImageDownload(unsigned int n)
+  : connections(1)
+  , attempts(3)
+  , retry_delay(500)
+  , retry_max_delay(20000)
+  , timeout(10000)
+  , core(tskNO_AFFINITY)
+  , progress(nullptr)
+  , lock(xSemaphoreCreateMutex())
+  , finished(xSemaphoreCreateCounting(OPENAI_DOWNLOAD_MAX_CONNECTIONS, 0))
+  , images(NULL)
+  , output(nullptr)
+  , results(NULL)
+  , len(0)
+  , next(0)
+  , started(0)
+  , elapsed(0)
+{
+  setConnections(n);
+}
+
+OpenAI_ImageDownload::~OpenAI_ImageDownload(){
+  openai_free(results);
+  if(lock != NULL){
+    vSemaphoreDelete(lock);
+  }
+  if(finished != NULL){
+    vSemaphoreDelete(finished);
+  }
+}
+
+OpenAI_ImageDownload & OpenAI_ImageDownload::setConnections(unsigned int n){
+  if(n < 1 || n > OPENAI_DOWNLOAD_MAX_CONNECTIONS){
+    log_e("Connections must be between 1 and %u", OPENAI_DOWNLOAD_MAX_CONNECTIONS);
+    return *this;
+  }
+  connections = n;
+  return *this;
+}
+
+OpenAI_ImageDownload & OpenAI_ImageDownload::setAttempts(unsigned int n, unsigned long base_delay, unsigned long max_delay){
+  if(n < 1){
+    log_e("At least one attempt is needed");
+    return *this;
+  }
+  attempts = n;
+  retry_delay = base_delay;
+  retry_max_delay = max_delay;
+  return *this;
+}
+
+OpenAI_ImageDownload & OpenAI_ImageDownload::setTimeout(uint16_t ms){
+  timeout = ms;
+  return *this;
+}
+
+OpenAI_ImageDownload & OpenAI_ImageDownload::setCore(int c){
+  core = c;
+  return *this;
+}
+
+OpenAI_ImageDownload & OpenAI_ImageDownload::onProgress(OpenAI_DownloadProgress cb){
+  progress = cb;
+  return *this;
+}
+
+OpenAI_DownloadStats OpenAI_ImageDownload::stats(unsigned int index){
+  OpenAI_DownloadStats s;
+  memset(&s, 0, sizeof(s));
+  if(index < len && results != NULL){
+    s = results[index];
+  }
+  return s;
+}
+
+void OpenAI_ImageDownload::report(unsigned int index, size_t received, size_t size, float rate){
+  if(!progress){
+    return;
+  }
+  xSemaphoreTake(lock, portMAX_DELAY);
+  progress(index, received, size, rate);
+  xSemaphoreGive(lock);
+}
+
+// Requests the image until it is complete or the attempts run out.
+// Every request after the first asks for the rest of the image only. Attempts that got nothing wait
+// with the backoff of the retry policy before the next one, so a failing server is not hammered
+void OpenAI_ImageDownload::fetch(unsigned int index, const char * url, WiFiClient * client, uint8_t * buffer){
+  OpenAI_DownloadStats & s = results[index];
+  unsigned long first = millis();
+  unsigned int failures = 0;
+  HTTPClient http;
+  // No chunked encoding, so the body can be read straight from the connection
+  http.useHTTP10(true);
+  for(unsigned int attempt = 0; attempt < attempts && !s.done; attempt++){
+    if(failures){
+      unsigned long wait = openai_backoff(failures, retry_delay, retry_max_delay);
+      log_d("Image %u: attempt %u of %u in %lu ms", index, attempt + 1, attempts, wait);
+      delay(wait);
+    }
+    http.setTimeout(timeout);
+    if(!http.begin(*client, url)){
+      log_e("Invalid URL: %s", url);
+      s.code = HTTPC_ERROR_CONNECTION_REFUSED;
+      break;
+    }
+    size_t offset = s.received;
+    if(offset){
+      http.addHeader("Range", "bytes=" + String(offset) + "-");
+    }
+    int code = http.GET();
+    s.code = code;
+    if(code == HTTP_CODE_PARTIAL_CONTENT && offset){
+      s.resumes++;
+    } else if(code == HTTP_CODE_OK){
+      if(offset){
+        log_d("Image %u: range was not accepted, starting over", index);
+        s.restarts++;
+        s.received = offset = 0;
+      }
+    } else {
+      log_e("Image %u: HTTP_ERROR: %d", index, code);
+      http.end();
+      client->stop();
+      if(code > 0 && code < 500 && code != 408 && code != 429){
+        // The same request would fail again
+        break;
+      }
+      failures++;
+      continue;
+    }
+
+    int size = http.getSize();
+    s.size = (size >= 0)?(offset + size):0;
+    WiFiClient * stream = http.getStreamPtr();
+    unsigned long begun = millis(), last = begun;
+    size_t got = 0;
+    bool closed = false;
+    bool failed = false;
+    while(s.size == 0 || s.received < s.size){
+      int available = stream->available();
+      if(available <= 0){
+        if(!stream->connected()){
+          closed = true;
+          break;
+        }
+        if((millis() - last) > timeout){
+          log_d("Image %u: timeout after %u bytes", index, s.received);
+          break;
+        }
+        delay(1);
+        continue;
+      }
+      int n = stream->read(buffer, (available < OPENAI_DOWNLOAD_BUFFER)?available:OPENAI_DOWNLOAD_BUFFER);
+      if(n <= 0){
+        continue;
+      }
+      if(!output(index, s.received, buffer, n)){
+        log_e("Image %u: output failed at %u bytes", index, s.received);
+        failed = true;
+        break;
+      }
+      s.received += n;
+      got += n;
+      last = millis();
+      s.time = last - first;
+      report(index, s.received, s.size, (got * 1000.0f) / ((last > begun)?(last - begun):1));
+    }
+    // Without a length, the server closing the connection ends the image
+    s.done = !failed && ((s.size != 0)?(s.received >= s.size):closed);
+    http.end();
+    client->stop();
+    if(failed){
+      break;
+    }
+    if(!s.done){
+      log_d("Image %u: stopped at %u of %u bytes", index, s.received, s.size);
+      // A request that made progress is continued right away
+      failures = (got)?0:(failures + 1);
+    }
+  }
+  if(!s.done){
+    log_e("Image %u: failed after %u attempts", index, attempts);
+  }
+}
+
+// Takes the next image until none are left. Each task has its own connection and buffer
+void OpenAI_ImageDownload::work(){
+  uint8_t * buffer = (uint8_t*)openai_malloc(OPENAI_DOWNLOAD_BUFFER, OPENAI_MEMORY_PARSER);
+  WiFiClient * client = NULL;
+  bool secure = false;
+  while(true){
+    xSemaphoreTake(lock, portMAX_DELAY);
+    unsigned int index = next;
+    if(index < len){
+      next++;
+    }
+    xSemaphoreGive(lock);
+    if(index >= len){
+      break;
+    }
+    const char * url = images->getAt(index);
+    bool https = !strncmp(url, "https://", 8);
+    if(!https && strncmp(url, "http://", 7)){
+      log_e("Image %u is not a URL", index);
+      results[index].code = HTTPC_ERROR_CONNECTION_REFUSED;
+      continue;
+    }
+    if(client == NULL || secure != https){
+      delete client;
+      if(https){
+        WiFiClientSecure * c = new WiFiClientSecure();
+        if(c != NULL){
+          c->setInsecure();
+        }
+        client = c;
+      } else {
+        client = new WiFiClient();
+      }
+      secure = https;
+    }
+    if(buffer == NULL || client == NULL){
+      log_e("Image %u: buffers could not be allocated", index);
+      results[index].code = HTTPC_ERROR_TOO_LESS_RAM;
+      continue;
+    }
+    fetch(index, url, client, buffer);
+  }
+  delete client;
+  openai_free(buffer);
+}
+
+void OpenAI_ImageDownload::task(void * arg){
+  OpenAI_ImageDownload * d = (OpenAI_ImageDownload*)arg;
+  d->work();
+  xSemaphoreGive(d->finished);
+  vTaskDelete(NULL);
+}
+
+bool OpenAI_ImageDownload::download(OpenAI_ImageResponse & response, OpenAI_DownloadOutput out){
+  openai_free(results);
+  results = NULL;
+  len = 0;
+  elapsed = 0;
+  if(lock == NULL || finished == NULL){
+    log_e("Download could not be created");
+    return false;
+  }
+  unsigned int n = response.length();
+  if(!n){
+    log_e("Response has no images");
+    return false;
+  }
+  results = (OpenAI_DownloadStats*)openai_malloc(n * sizeof(OpenAI_DownloadStats), OPENAI_MEMORY_RESPONSE);
+  if(results == NULL){
+    log_e("Stats could not be allocated");
+    return false;
+  }
+  memset(results, 0, n * sizeof(OpenAI_DownloadStats));
+  images = &response;
+  output = out;
+  len = n;
+  next = 0;
+  started = millis();
+
+  // The calling task downloads too, so one connection needs no task at all
+  unsigned int tasks = ((connections < n)?connections:n) - 1;
+  unsigned int running = 0;
+  for(unsigned int i = 0; i < tasks; i++){
+    if(xTaskCreatePinnedToCore(task, "openai_download", OPENAI_DOWNLOAD_STACK, this, 1, NULL, core) != pdPASS){
+      // The tasks that did start take over the images
+      log_e("Download task could not be started");
+      break;
+    }
+    running++;
+  }
+  work();
+  for(unsigned int i = 0; i < running; i++){
+    xSemaphoreTake(finished, portMAX_DELAY);
+  }
+  elapsed = millis() - started;
+  images = NULL;
+  output = nullptr;
+
+  bool complete = true;
+  for(unsigned int i = 0; i < len; i++){
+    complete = complete && results[i].done;
+  }
+  log_d("Downloaded %u images in %lu ms", len, elapsed);
+  return complete;
+}
+
+bool OpenAI_ImageDownload::download(OpenAI_ImageResponse & response, fs::FS & fs, const char * path){
+  std::vector<fs::File> files(response.length());
+  bool complete = download(response, [&files, &fs, path](unsigned int index, size_t offset, const uint8_t * data, size_t l){
+    fs::File & f = files[index];
+    if(offset == 0){
+      // First piece, or the server sent the image again from the start
+      char name[64];
+      snprintf(name, sizeof(name), path, index);
+      if(f){
+        f.close();
+      }
+      f = fs.open(name, FILE_WRITE);
+      if(!f){
+        log_e("%s could not be opened", name);
+        return false;
+      }
+    } else if(f.position() != offset && !f.seek(offset)){
+      return false;
+    }
+    return f.write(data, l) == l;
+  });
+  for(unsigned int i = 0; i < files.size(); i++){
+    if(files[i]){
+      files[i].close();
+    }
+  }
+  return complete;
+}
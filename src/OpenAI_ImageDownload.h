@@ -0,0 +1,76 @@
+#pragma once
+#include "Arduino.h"
+#include "FS.h"
+#include <functional>
+
+class OpenAI_ImageResponse;
+class WiFiClient;
+
+#define OPENAI_DOWNLOAD_BUFFER 1460  //Bytes read from the connection at a time. Each connection has one buffer
+#define OPENAI_DOWNLOAD_STACK  8192  //Stack of the extra download tasks, TLS needs most of it
+
+typedef struct {
+    size_t size;              //Length of the image. 0 until the server sends it
+    size_t received;          //Bytes written to the output
+    unsigned int resumes;     //Requests that continued with a Range header after the connection dropped
+    unsigned int restarts;    //Times the server ignored the range and the image was written from the start again
+    unsigned long time;       //ms from the first request to the last byte
+    int code;                 //HTTP code of the last request, or HTTPC_ERROR_*
+    bool done;
+} OpenAI_DownloadStats;
+
+//Writes a piece of the image at offset. A restarted image is written from offset 0 again. Return false to give up on the image
+typedef std::function<bool(unsigned int index, size_t offset, const uint8_t * data, size_t len)> OpenAI_DownloadOutput;
+
+//Called after every piece with the bytes of the image received so far, its size (0 if unknown) and the bytes per second of the current request
+typedef std::function<void(unsigned int index, size_t received, size_t size, float rate)> OpenAI_DownloadProgress;
+
+// Fetches the images of a response that was requested with OPENAI_IMAGE_RESPONSE_FORMAT_URL.
+// Up to the given number of images are downloaded at the same time, each over its own connection.
+// The calling task takes one of them and runs a task for each of the others. Bodies pass through a
+// buffer of OPENAI_DOWNLOAD_BUFFER bytes per connection, so the memory does not grow with the images.
+// A request that stops early is continued with a Range request, for up to the given number of attempts
+class OpenAI_ImageDownload {
+  private:
+    unsigned int connections;
+    unsigned int attempts;
+    unsigned long retry_delay;
+    unsigned long retry_max_delay;
+    uint16_t timeout;
+    int core;
+    OpenAI_DownloadProgress progress;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t finished;
+
+    // State of the running download, shared by the tasks under the lock
+    OpenAI_ImageResponse * images;
+    OpenAI_DownloadOutput output;
+    OpenAI_DownloadStats * results;
+    unsigned int len;
+    unsigned int next;
+    unsigned long started;
+    unsigned long elapsed;
+
+    static void task(void * arg);
+    void work();
+    void fetch(unsigned int index, const char * url, WiFiClient * client, uint8_t * buffer);
+    void report(unsigned int index, size_t received, size_t size, float rate);
+
+  public:
+    OpenAI_ImageDownload(unsigned int connections=2);
+    ~OpenAI_ImageDownload();
+
+    OpenAI_ImageDownload & setConnections(unsigned int n);       //Images that are downloaded at the same time. Between 1 and 10
+    OpenAI_ImageDownload & setAttempts(unsigned int n, unsigned long base_delay=500, unsigned long max_delay=20000); //Requests made for one image before it fails. Each one continues where the one before stopped
+                                                                  //Attempts that got nothing wait as with OpenAI::setRetryPolicy() before the next one
+    OpenAI_ImageDownload & setTimeout(uint16_t ms);              //Time without data before a request is given up
+    OpenAI_ImageDownload & setCore(int c);                       //Core of the download tasks
+    OpenAI_ImageDownload & onProgress(OpenAI_DownloadProgress cb); //Called on the download tasks, but never for two images at once
+
+    bool download(OpenAI_ImageResponse & response, OpenAI_DownloadOutput out);   //Blocks until every image is done or failed. true if all of them were completed
+    bool download(OpenAI_ImageResponse & response, fs::FS & fs, const char * path); //Saves image i to path with "%u" replaced by i, i.e. "/image%u.png". Failed images are left as far as they got
+
+    unsigned int length(){ return len; }                          //Images of the last download
+    OpenAI_DownloadStats stats(unsigned int index);               //Counters of an image of the last download
+    unsigned long time(){ return elapsed; }                       //ms the last download took
+};
@@ -0,0 +1,394 @@
+#include "OpenAI_JsonReader.h"
+
+enum {
+  JSON_VALUE,         // a value is expected
+  JSON_VALUE_OR_END,  // right after '['
+  JSON_KEY_OR_END,    // right after '{'
+  JSON_KEY,           // after ',' in an object
+  JSON_COLON,
+  JSON_AFTER_VALUE,   // ',' or the end of the container is expected
+  JSON_STRING,
+  JSON_ESCAPE,
+  JSON_UNICODE,
+  JSON_NUMBER,
+  JSON_LITERAL,
+  JSON_DONE,
+  JSON_ERROR
+};
+
+static bool isSpace(char c){
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static bool isNumberChar(char c){
+  return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+OpenAI_JsonReader::OpenAI_JsonReader(){
+  reset();
+}
+
+void OpenAI_JsonReader::reset(){
+  level = 0;
+  arrays = 0;
+  state = JSON_VALUE;
+  literal_pos = 0;
+  literal = NULL;
+  in_key = false;
+  key_len = 0;
+  chunk_len = 0;
+  unicode = 0;
+  unicode_len = 0;
+  high_surrogate = 0;
+  total = 0;
+  error_str = NULL;
+}
+
+const char * OpenAI_JsonReader::key(unsigned int l){
+  if(l >= level || l >= OPENAI_JSON_MAX_DEPTH || frames[l].type != OPENAI_JSON_OBJECT){
+    return "";
+  }
+  return frames[l].key;
+}
+
+unsigned int OpenAI_JsonReader::index(unsigned int l){
+  if(l >= level || l >= OPENAI_JSON_MAX_DEPTH || frames[l].type != OPENAI_JSON_ARRAY){
+    return 0;
+  }
+  return frames[l].index;
+}
+
+bool OpenAI_JsonReader::match(const char * path){
+  unsigned int l = 0;
+  while(*path){
+    if(l >= level || l >= OPENAI_JSON_MAX_DEPTH){
+      return false;
+    }
+    const char * end = strchr(path, '.');
+    size_t len = (end != NULL)?(size_t)(end - path):strlen(path);
+    if(frames[l].type == OPENAI_JSON_ARRAY){
+      if(len != 1 || *path != '#'){
+        return false;
+      }
+    } else if(strlen(frames[l].key) != len || strncmp(frames[l].key, path, len)){
+      return false;
+    }
+    l++;
+    path += len;
+    if(*path == '.'){
+      path++;
+    }
+  }
+  return l == level;
+}
+
+void OpenAI_JsonReader::fail(const char * e){
+  if(error_str == NULL){
+    error_str = e;
+  }
+  state = JSON_ERROR;
+}
+
+void OpenAI_JsonReader::beginContainer(OpenAI_Json_Container type){
+  if(level >= 64){
+    fail("Document too deep");
+    return;
+  }
+  onBegin(type);
+  if(type == OPENAI_JSON_ARRAY){
+    arrays |= (1ULL << level);
+  } else {
+    arrays &= ~(1ULL << level);
+  }
+  if(level < OPENAI_JSON_MAX_DEPTH){
+    frames[level].type = type;
+    frames[level].index = 0;
+    frames[level].key[0] = 0;
+  }
+  level++;
+  state = (type == OPENAI_JSON_OBJECT)?JSON_KEY_OR_END:JSON_VALUE_OR_END;
+}
+
+void OpenAI_JsonReader::endContainer(OpenAI_Json_Container type){
+  level--;
+  onEnd(type);
+  valueDone();
+}
+
+void OpenAI_JsonReader::valueDone(){
+  state = (level == 0)?JSON_DONE:JSON_AFTER_VALUE;
+}
+
+void OpenAI_JsonReader::flushChunk(bool last){
+  if(chunk_len || last){
+    onString(chunk, chunk_len, last);
+    chunk_len = 0;
+  }
+}
+
+void OpenAI_JsonReader::addChar(char c){
+  if(in_key){
+    if(level <= OPENAI_JSON_MAX_DEPTH && key_len < (OPENAI_JSON_KEY_LEN - 1)){
+      frames[level - 1].key[key_len++] = c;
+      frames[level - 1].key[key_len] = 0;
+    }
+    return;
+  }
+  if(chunk_len == OPENAI_JSON_CHUNK_LEN){
+    flushChunk(false);
+  }
+  chunk[chunk_len++] = c;
+}
+
+void OpenAI_JsonReader::addCodepoint(uint32_t cp){
+  if(cp < 0x80){
+    addChar(cp);
+  } else if(cp < 0x800){
+    addChar(0xC0 | (cp >> 6));
+    addChar(0x80 | (cp & 0x3F));
+  } else if(cp < 0x10000){
+    addChar(0xE0 | (cp >> 12));
+    addChar(0x80 | ((cp >> 6) & 0x3F));
+    addChar(0x80 | (cp & 0x3F));
+  } else {
+    addChar(0xF0 | (cp >> 18));
+    addChar(0x80 | ((cp >> 12) & 0x3F));
+    addChar(0x80 | ((cp >> 6) & 0x3F));
+    addChar(0x80 | (cp & 0x3F));
+  }
+}
+
+// Returns false if the character has to be processed again in the new state
+bool OpenAI_JsonReader::process(char c){
+  switch(state){
+    case JSON_VALUE_OR_END:
+      if(isSpace(c)){
+        return true;
+      }
+      if(c == ']'){
+        endContainer(OPENAI_JSON_ARRAY);
+        return true;
+      }
+      state = JSON_VALUE;
+      return false;
+
+    case JSON_VALUE:
+      if(isSpace(c)){
+        return true;
+      }
+      if(c == '{'){
+        beginContainer(OPENAI_JSON_OBJECT);
+      } else if(c == '['){
+        beginContainer(OPENAI_JSON_ARRAY);
+      } else if(c == '"'){
+        in_key = false;
+        chunk_len = 0;
+        state = JSON_STRING;
+      } else if(c == '-' || (c >= '0' && c <= '9')){
+        chunk_len = 0;
+        chunk[chunk_len++] = c;
+        state = JSON_NUMBER;
+      } else if(c == 't' || c == 'f' || c == 'n'){
+        literal = (c == 't')?"true":((c == 'f')?"false":"null");
+        literal_pos = 1;
+        state = JSON_LITERAL;
+      } else {
+        fail("Unexpected character");
+      }
+      return true;
+
+    case JSON_KEY_OR_END:
+      if(isSpace(c)){
+        return true;
+      }
+      if(c == '}'){
+        endContainer(OPENAI_JSON_OBJECT);
+        return true;
+      }
+      state = JSON_KEY;
+      return false;
+
+    case JSON_KEY:
+      if(isSpace(c)){
+        return true;
+      }
+      if(c != '"'){
+        fail("Expected key");
+        return true;
+      }
+      in_key = true;
+      key_len = 0;
+      if(level <= OPENAI_JSON_MAX_DEPTH){
+        frames[level - 1].key[0] = 0;
+      }
+      state = JSON_STRING;
+      return true;
+
+    case JSON_COLON:
+      if(isSpace(c)){
+        return true;
+      }
+      if(c != ':'){
+        fail("Expected ':'");
+        return true;
+      }
+      state = JSON_VALUE;
+      return true;
+
+    case JSON_AFTER_VALUE: {
+      if(isSpace(c)){
+        return true;
+      }
+      bool array = (arrays >> (level - 1)) & 1;
+      if(c == ','){
+        if(array){
+          if(level <= OPENAI_JSON_MAX_DEPTH){
+            frames[level - 1].index++;
+          }
+          state = JSON_VALUE;
+        } else {
+          state = JSON_KEY;
+        }
+      } else if(c == ']' && array){
+        endContainer(OPENAI_JSON_ARRAY);
+      } else if(c == '}' && !array){
+        endContainer(OPENAI_JSON_OBJECT);
+      } else {
+        fail("Expected ',' or end of container");
+      }
+      return true;
+    }
+
+    case JSON_STRING:
+      if(c == '"'){
+        if(in_key){
+          in_key = false;
+          state = JSON_COLON;
+        } else {
+          flushChunk(true);
+          valueDone();
+        }
+      } else if(c == '\\'){
+        state = JSON_ESCAPE;
+      } else {
+        addChar(c);
+      }
+      return true;
+
+    case JSON_ESCAPE:
+      state = JSON_STRING;
+      switch(c){
+        case 'n': addChar('\n'); break;
+        case 't': addChar('\t'); break;
+        case 'r': addChar('\r'); break;
+        case 'b': addChar('\b'); break;
+        case 'f': addChar('\f'); break;
+        case 'u':
+          unicode = 0;
+          unicode_len = 0;
+          state = JSON_UNICODE;
+          break;
+        default: addChar(c); break;
+      }
+      return true;
+
+    case JSON_UNICODE:
+      if(c >= '0' && c <= '9'){
+        unicode = (unicode << 4) | (c - '0');
+      } else if(c >= 'a' && c <= 'f'){
+        unicode = (unicode << 4) | (c - 'a' + 10);
+      } else if(c >= 'A' && c <= 'F'){
+        unicode = (unicode << 4) | (c - 'A' + 10);
+      } else {
+        fail("Invalid unicode escape");
+        return true;
+      }
+      if(++unicode_len < 4){
+        return true;
+      }
+      state = JSON_STRING;
+      if(unicode >= 0xD800 && unicode <= 0xDBFF){
+        // Wait for the low surrogate that should follow
+        high_surrogate = unicode;
+      } else if(unicode >= 0xDC00 && unicode <= 0xDFFF && high_surrogate){
+        addCodepoint(0x10000 + ((high_surrogate - 0xD800) << 10) + (unicode - 0xDC00));
+        high_surrogate = 0;
+      } else {
+        high_surrogate = 0;
+        addCodepoint(unicode);
+      }
+      return true;
+
+    case JSON_NUMBER:
+      if(isNumberChar(c)){
+        if(chunk_len < (OPENAI_JSON_CHUNK_LEN - 1)){
+          chunk[chunk_len++] = c;
+        }
+        return true;
+      }
+      chunk[chunk_len] = 0;
+      onNumber(strtod(chunk, NULL));
+      chunk_len = 0;
+      valueDone();
+      return false;
+
+    case JSON_LITERAL:
+      if(c != literal[literal_pos]){
+        fail("Invalid literal");
+        return true;
+      }
+      if(literal[++literal_pos] == 0){
+        if(literal[0] == 'n'){
+          onNull();
+        } else {
+          onBool(literal[0] == 't');
+        }
+        valueDone();
+      }
+      return true;
+
+    case JSON_DONE:
+      if(!isSpace(c)){
+        fail("Data after end of document");
+      }
+      return true;
+
+    default:
+      return true;
+  }
+}
+
+size_t OpenAI_JsonReader::write(const uint8_t * buffer, size_t size){
+  const char * p = (const char *)buffer;
+  const char * end = p + size;
+  total += size;
+  while(p < end && state != JSON_ERROR){
+    if(state == JSON_STRING && !in_key){
+      // Pass plain runs of a string value on without copying them
+      const char * s = p;
+      while(p < end && *p != '"' && *p != '\\'){
+        p++;
+      }
+      if(p > s){
+        flushChunk(false);
+        onString(s, p - s, false);
+        continue;
+      }
+    }
+    if(process(*p)){
+      p++;
+    }
+  }
+  // Errors are reported through failed(), the rest of the body is still consumed
+  return size;
+}
+
+bool OpenAI_JsonReader::finish(){
+  if(state == JSON_NUMBER && level == 0){
+    process(' ');
+  }
+  if(state != JSON_DONE && state != JSON_ERROR){
+    fail((total == 0)?"Empty document":"Unexpected end of document");
+  }
+  return state == JSON_DONE;
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include "Arduino.h"
+
+#define OPENAI_JSON_MAX_DEPTH 12  //Containers deeper than this are parsed, but their keys are not tracked
+#define OPENAI_JSON_KEY_LEN   24  //Longer keys are truncated
+#define OPENAI_JSON_CHUNK_LEN 64  //Unescaped string data is reported in pieces of up to this size
+
+typedef enum {
+  OPENAI_JSON_OBJECT,
+  OPENAI_JSON_ARRAY
+} OpenAI_Json_Container;
+
+// Incremental (SAX style) JSON reader.
+// The document is written to it in pieces of any size, usually straight from the socket,
+// and every value is reported through the virtual callbacks while its path is available
+// through depth(), key() and index(). No tree is built and strings are passed on in chunks,
+// so a reader needs the same small amount of memory for any size of document.
+class OpenAI_JsonReader : public Stream {
+  private:
+    typedef struct {
+      uint8_t type;
+      unsigned int index;
+      char key[OPENAI_JSON_KEY_LEN];
+    } Frame;
+
+    Frame frames[OPENAI_JSON_MAX_DEPTH];
+    unsigned int level;
+    uint64_t arrays;
+    uint8_t state;
+    uint8_t literal_pos;
+    const char * literal;
+    bool in_key;
+    size_t key_len;
+    char chunk[OPENAI_JSON_CHUNK_LEN];
+    size_t chunk_len;
+    uint32_t unicode;
+    uint8_t unicode_len;
+    uint32_t high_surrogate;
+    size_t total;
+    const char * error_str;
+
+    bool process(char c);
+    void fail(const char * e);
+    void beginContainer(OpenAI_Json_Container type);
+    void endContainer(OpenAI_Json_Container type);
+    void valueDone();
+    void addChar(char c);
+    void addCodepoint(uint32_t cp);
+    void flushChunk(bool last);
+
+  protected:
+    virtual void onBegin(OpenAI_Json_Container type){}       //An object or array starts. The path points to the container
+    virtual void onEnd(OpenAI_Json_Container type){}         //An object or array ends. The path points to the container
+    virtual void onString(const char * data, size_t len, bool last){}  //A piece of a string value. last is set on the final piece
+    virtual void onNumber(double value){}
+    virtual void onBool(bool value){}
+    virtual void onNull(){}
+
+  public:
+    OpenAI_JsonReader();
+    virtual ~OpenAI_JsonReader(){}
+
+    void reset();                             //Prepare for a new document
+    bool finish();                            //Call after the last byte. Returns true if a complete document was read
+    bool failed(){ return error_str != NULL; }
+    const char * error(){ return error_str; }
+    size_t received(){ return total; }        //Bytes written so far
+
+    unsigned int depth(){ return level; }     //Number of containers around the current value
+    const char * key(unsigned int l);         //Current member name of the object at level l
+    unsigned int index(unsigned int l);       //Current element of the array at level l
+    bool match(const char * path);            //Compare the current path to a pattern like "choices.#.message.content". '#' stands for any array element
+
+    size_t write(const uint8_t * buffer, size_t size);
+    size_t write(uint8_t c){ return write(&c, 1); }
+    int available(){ return 0; }
+    int read(){ return -1; }
+    int peek(){ return -1; }
+};
@@ -0,0 +1,146 @@
+#include "OpenAI_ResponseCache.h"
+#include "OpenAI_Allocator.h"
+
+static uint64_t hashRequest(const String & request){
+  uint64_t h = 14695981039346656037ULL;
+  const char * p = request.c_str();
+  for(unsigned int i = 0; i < request.length(); i++){
+    h = (h ^ (uint8_t)p[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+OpenAI_MemoryResponseCache::OpenAI_MemoryResponseCache(size_t max, unsigned long ttl_ms)
+  : lock(NULL)
+  , head(NULL)
+  , tail(NULL)
+  , bytes(0)
+  , max_bytes(max)
+  , ttl(ttl_ms)
+{
+  memset(&counters, 0, sizeof(counters));
+  lock = xSemaphoreCreateMutex();
+  if(lock == NULL){
+    log_e("Cache lock could not be allocated");
+  }
+}
+
+OpenAI_MemoryResponseCache::~OpenAI_MemoryResponseCache(){
+  while(head != NULL){
+    drop(head);
+  }
+  if(lock != NULL){
+    vSemaphoreDelete(lock);
+  }
+}
+
+void OpenAI_MemoryResponseCache::drop(Entry * e){
+  if(e->prev != NULL){
+    e->prev->next = e->next;
+  } else {
+    head = e->next;
+  }
+  if(e->next != NULL){
+    e->next->prev = e->prev;
+  } else {
+    tail = e->prev;
+  }
+  bytes -= sizeof(Entry) + e->len;
+  openai_free(e);
+}
+
+bool OpenAI_MemoryResponseCache::get(const String & request, Stream * response){
+  uint64_t key = hashRequest(request);
+  xSemaphoreTake(lock, portMAX_DELAY);
+  Entry * e = head;
+  while(e != NULL && (e->key != key || e->request_len != request.length())){
+    e = e->next;
+  }
+  if(e != NULL && (millis() - e->stored) >= ttl){
+    drop(e);
+    e = NULL;
+    counters.expired++;
+  }
+  if(e == NULL){
+    counters.misses++;
+    xSemaphoreGive(lock);
+    return false;
+  }
+  if(e != head){
+    e->prev->next = e->next;
+    if(e->next != NULL){
+      e->next->prev = e->prev;
+    } else {
+      tail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = head;
+    head->prev = e;
+    head = e;
+  }
+  counters.hits++;
+  // Written while locked, so the entry can not be dropped meanwhile
+  if(response != NULL){
+    response->write(e->data, e->len);
+  }
+  xSemaphoreGive(lock);
+  return true;
+}
+
+void OpenAI_MemoryResponseCache::put(const String & request, const uint8_t * data, size_t len){
+  size_t size = sizeof(Entry) + len;
+  if(data == NULL || !len || size > max_bytes){
+    return;
+  }
+  uint64_t key = hashRequest(request);
+  xSemaphoreTake(lock, portMAX_DELAY);
+  for(Entry * e = head; e != NULL; e = e->next){
+    if(e->key == key && e->request_len == request.length()){
+      drop(e);
+      break;
+    }
+  }
+  while(tail != NULL && (bytes + size) > max_bytes){
+    drop(tail);
+    counters.evictions++;
+  }
+  Entry * e = (Entry*)openai_malloc(size, OPENAI_MEMORY_CACHE);
+  if(e == NULL){
+    log_e("Cache entry could not be allocated");
+    xSemaphoreGive(lock);
+    return;
+  }
+  e->key = key;
+  e->request_len = request.length();
+  e->stored = millis();
+  e->len = len;
+  e->data = (uint8_t*)(e + 1);
+  memcpy(e->data, data, len);
+  e->prev = NULL;
+  e->next = head;
+  if(head != NULL){
+    head->prev = e;
+  } else {
+    tail = e;
+  }
+  head = e;
+  bytes += size;
+  xSemaphoreGive(lock);
+}
+
+void OpenAI_MemoryResponseCache::clear(){
+  xSemaphoreTake(lock, portMAX_DELAY);
+  while(head != NULL){
+    drop(head);
+  }
+  xSemaphoreGive(lock);
+}
+
+OpenAI_ResponseCacheStats OpenAI_MemoryResponseCache::stats(){
+  OpenAI_ResponseCacheStats s;
+  xSemaphoreTake(lock, portMAX_DELAY);
+  s = counters;
+  s.bytes = bytes;
+  xSemaphoreGive(lock);
+  return s;
+}
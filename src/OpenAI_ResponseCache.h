@@ -0,0 +1,57 @@
+#pragma once
+#include "Arduino.h"
+
+// Stores the raw responses of deterministic requests, so repeating one does not go to the network.
+// The request is the endpoint and the serialized JSON body, which holds the model and every parameter.
+// Derive from it to keep the responses elsewhere, i.e. on flash
+class OpenAI_ResponseCache {
+  public:
+    virtual ~OpenAI_ResponseCache(){}
+
+    virtual bool get(const String & request, Stream * response) = 0;              //Writes the stored response to the stream. false on a miss
+    virtual void put(const String & request, const uint8_t * data, size_t len) = 0;
+    virtual size_t maxSize(){ return 8192; }                                      //Longer responses are not recorded
+};
+
+typedef struct {
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int expired;     //Misses because the response was older than the TTL
+    unsigned int evictions;   //Responses dropped to stay under the size cap
+    size_t bytes;             //Bytes held
+} OpenAI_ResponseCacheStats;
+
+// Keeps the most recently used responses in RAM for ttl ms
+class OpenAI_MemoryResponseCache : public OpenAI_ResponseCache {
+  private:
+    typedef struct Entry {
+      struct Entry * prev;
+      struct Entry * next;
+      uint64_t key;
+      size_t request_len;      //Along with the hash, tells requests apart
+      unsigned long stored;
+      size_t len;
+      uint8_t * data;          //Follows the entry in the same allocation
+    } Entry;
+
+    SemaphoreHandle_t lock;
+    Entry * head;              //Most recently used
+    Entry * tail;
+    size_t bytes;
+    size_t max_bytes;
+    unsigned long ttl;
+    OpenAI_ResponseCacheStats counters;
+
+    void drop(Entry * e);
+
+  public:
+    OpenAI_MemoryResponseCache(size_t max_bytes=16384, unsigned long ttl_ms=3600000);
+    ~OpenAI_MemoryResponseCache();
+
+    bool get(const String & request, Stream * response);
+    void put(const String & request, const uint8_t * data, size_t len);
+    size_t maxSize(){ return max_bytes / 4; }
+
+    void clear();
+    OpenAI_ResponseCacheStats stats();
+};
@@ -0,0 +1,325 @@
+#include "OpenAI_Tokenizer.h"
+#include "OpenAI_Allocator.h"
+
+// File layout, little-endian: "OATK", uint32 version, tokens, buckets and bytes,
+// then uint32 offsets[tokens + 1], uint32 table[buckets] and the bytes of the tokens
+#define OPENAI_TOKENIZER_MAGIC    0x4B54414F
+#define OPENAI_TOKENIZER_VERSION  1
+#define OPENAI_TOKENIZER_HEADER   20
+#define OPENAI_TOKENIZER_STACK    32  //Pieces up to this long are merged without allocating
+
+typedef enum {
+  OPENAI_CHAR_LETTER,
+  OPENAI_CHAR_NUMBER,
+  OPENAI_CHAR_SPACE,
+  OPENAI_CHAR_NEWLINE,
+  OPENAI_CHAR_OTHER
+} OpenAI_Char_Class;
+
+static OpenAI_Char_Class classify(uint32_t cp){
+  if(cp < 0x80){
+    if((cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z')){
+      return OPENAI_CHAR_LETTER;
+    }
+    if(cp >= '0' && cp <= '9'){
+      return OPENAI_CHAR_NUMBER;
+    }
+    if(cp == '\r' || cp == '\n'){
+      return OPENAI_CHAR_NEWLINE;
+    }
+    if(cp == ' ' || cp == '\t' || cp == '\v' || cp == '\f'){
+      return OPENAI_CHAR_SPACE;
+    }
+    return OPENAI_CHAR_OTHER;
+  }
+  if(cp == 0x85 || cp == 0xA0 || cp == 0x1680 || (cp >= 0x2000 && cp <= 0x200A) || cp == 0x2028 || cp == 0x2029 || cp == 0x202F || cp == 0x205F || cp == 0x3000){
+    return OPENAI_CHAR_SPACE;
+  }
+  // Latin-1 signs, general punctuation, symbols, CJK punctuation, variation selectors and emoji
+  if((cp >= 0x80 && cp <= 0xBF && cp != 0xAA && cp != 0xB5 && cp != 0xBA) || cp == 0xD7 || cp == 0xF7
+    || (cp >= 0x2000 && cp <= 0x206F) || (cp >= 0x2190 && cp <= 0x2BFF) || (cp >= 0x3000 && cp <= 0x303F)
+    || (cp >= 0xFE00 && cp <= 0xFE0F) || (cp >= 0x1F000 && cp <= 0x1FAFF)){
+    return OPENAI_CHAR_OTHER;
+  }
+  return OPENAI_CHAR_LETTER;
+}
+
+// Class of the UTF-8 character at p. Returns the start of the next one
+static const uint8_t * nextChar(const uint8_t * p, const uint8_t * end, OpenAI_Char_Class & c){
+  uint32_t cp = *p;
+  size_t n = 1;
+  if(cp >= 0xF0){
+    n = 4;
+    cp &= 0x07;
+  } else if(cp >= 0xE0){
+    n = 3;
+    cp &= 0x0F;
+  } else if(cp >= 0xC0){
+    n = 2;
+    cp &= 0x1F;
+  }
+  if(n > 1){
+    if((size_t)(end - p) < n){
+      n = 1;
+      cp = *p;
+    } else {
+      for(size_t i = 1; i < n; i++){
+        cp = (cp << 6) | (p[i] & 0x3F);
+      }
+    }
+  }
+  c = classify(cp);
+  return p + n;
+}
+
+static const uint8_t * skipClass(const uint8_t * p, const uint8_t * end, OpenAI_Char_Class want){
+  OpenAI_Char_Class c;
+  while(p < end){
+    const uint8_t * n = nextChar(p, end, c);
+    if(c != want){
+      break;
+    }
+    p = n;
+  }
+  return p;
+}
+
+// Returns the end of the piece that starts at p. Follows the cl100k pattern:
+// 's|'t|'re|'ve|'m|'ll|'d | [^\r\n\p{L}\p{N}]?\p{L}+ | \p{N}{1,3} | ?[^\s\p{L}\p{N}]+[\r\n]* | \s*[\r\n]+ | \s+(?!\S) | \s+
+static const uint8_t * splitPiece(const uint8_t * p, const uint8_t * end){
+  OpenAI_Char_Class c, n;
+  const uint8_t * q = nextChar(p, end, c);
+  if(*p == '\'' && q < end){
+    char a = tolower(q[0]);
+    char b = ((q + 1) < end)?tolower(q[1]):0;
+    if(a == 's' || a == 't' || a == 'm' || a == 'd'){
+      return q + 1;
+    }
+    if((a == 'r' && b == 'e') || (a == 'v' && b == 'e') || (a == 'l' && b == 'l')){
+      return q + 2;
+    }
+  }
+  if(c == OPENAI_CHAR_LETTER){
+    return skipClass(q, end, OPENAI_CHAR_LETTER);
+  }
+  if((c == OPENAI_CHAR_SPACE || c == OPENAI_CHAR_OTHER) && q < end){
+    nextChar(q, end, n);
+    if(n == OPENAI_CHAR_LETTER){
+      return skipClass(q, end, OPENAI_CHAR_LETTER);
+    }
+  }
+  if(c == OPENAI_CHAR_NUMBER){
+    for(int i = 1; i < 3 && q < end; i++){
+      const uint8_t * r = nextChar(q, end, n);
+      if(n != OPENAI_CHAR_NUMBER){
+        break;
+      }
+      q = r;
+    }
+    return q;
+  }
+  const uint8_t * r = q;
+  n = c;
+  if(*p == ' ' && q < end){
+    r = nextChar(q, end, n);
+  }
+  if(n == OPENAI_CHAR_OTHER){
+    r = skipClass(r, end, OPENAI_CHAR_OTHER);
+    return skipClass(r, end, OPENAI_CHAR_NEWLINE);
+  }
+  // Whitespace. Up to the last line break, else all but the space before the next word
+  const uint8_t * w = p;
+  const uint8_t * last = p;
+  const uint8_t * newline = NULL;
+  while(w < end){
+    r = nextChar(w, end, n);
+    if(n != OPENAI_CHAR_SPACE && n != OPENAI_CHAR_NEWLINE){
+      break;
+    }
+    if(n == OPENAI_CHAR_NEWLINE){
+      newline = r;
+    }
+    last = w;
+    w = r;
+  }
+  if(newline != NULL){
+    return newline;
+  }
+  if(w == end || last == p){
+    return w;
+  }
+  return last;
+}
+
+OpenAI_Tokenizer::OpenAI_Tokenizer()
+  : vocab(NULL)
+  , owned(false)
+  , count_len(0)
+  , mask(0)
+  , offsets(NULL)
+  , table(NULL)
+  , bytes(NULL)
+{}
+
+OpenAI_Tokenizer::~OpenAI_Tokenizer(){
+  end();
+}
+
+bool OpenAI_Tokenizer::begin(const uint8_t * data, size_t len){
+  end();
+  const uint32_t * h = (const uint32_t *)data;
+  if(data == NULL || len < OPENAI_TOKENIZER_HEADER || ((uintptr_t)data & 3)){
+    log_e("Invalid vocabulary");
+    return false;
+  }
+  if(h[0] != OPENAI_TOKENIZER_MAGIC || h[1] != OPENAI_TOKENIZER_VERSION){
+    log_e("Unknown vocabulary format");
+    return false;
+  }
+  uint32_t tokens = h[2];
+  uint32_t buckets = h[3];
+  uint32_t bytes_len = h[4];
+  if(!tokens || !buckets || (buckets & (buckets - 1)) || buckets <= tokens
+    || (OPENAI_TOKENIZER_HEADER + ((size_t)tokens + 1 + buckets) * 4 + bytes_len) > len){
+    log_e("Vocabulary is damaged");
+    return false;
+  }
+  offsets = h + 5;
+  table = offsets + tokens + 1;
+  bytes = (const uint8_t *)(table + buckets);
+  if(offsets[tokens] != bytes_len){
+    log_e("Vocabulary is damaged");
+    offsets = NULL;
+    table = NULL;
+    bytes = NULL;
+    return false;
+  }
+  count_len = tokens;
+  mask = buckets - 1;
+  vocab = data;
+  return true;
+}
+
+bool OpenAI_Tokenizer::begin(fs::FS & fs, const char * path){
+  end();
+  fs::File f = fs.open(path, "r");
+  if(!f){
+    log_e("Vocabulary not found: %s", path);
+    return false;
+  }
+  size_t len = f.size();
+  // Large enough to go to PSRAM with the default allocator
+  uint8_t * data = (uint8_t*)openai_malloc(len, OPENAI_MEMORY_CACHE);
+  if(data == NULL){
+    log_e("Vocabulary could not be allocated: %u bytes", len);
+    f.close();
+    return false;
+  }
+  size_t n = f.read(data, len);
+  f.close();
+  if(n != len || !begin(data, len)){
+    log_e("Vocabulary could not be read: %s", path);
+    openai_free(data);
+    return false;
+  }
+  owned = true;
+  return true;
+}
+
+void OpenAI_Tokenizer::end(){
+  if(owned && vocab != NULL){
+    openai_free((void*)vocab);
+  }
+  vocab = NULL;
+  owned = false;
+  count_len = 0;
+  mask = 0;
+  offsets = NULL;
+  table = NULL;
+  bytes = NULL;
+}
+
+// Rank of the token with these bytes, -1 if there is none
+int OpenAI_Tokenizer::rank(const uint8_t * data, size_t len){
+  uint32_t h = 2166136261UL;
+  for(size_t i = 0; i < len; i++){
+    h = (h ^ data[i]) * 16777619UL;
+  }
+  for(uint32_t b = h & mask; table[b]; b = (b + 1) & mask){
+    uint32_t r = table[b] - 1;
+    if((offsets[r + 1] - offsets[r]) == len && !memcmp(&bytes[offsets[r]], data, len)){
+      return r;
+    }
+  }
+  return -1;
+}
+
+// Merges the pair of parts with the lowest rank until no pair is a token. Returns the parts left
+unsigned int OpenAI_Tokenizer::merge(const uint8_t * data, size_t len){
+  if(len == 1 || rank(data, len) >= 0){
+    return 1;
+  }
+  uint32_t stack_parts[OPENAI_TOKENIZER_STACK + 1];
+  int stack_ranks[OPENAI_TOKENIZER_STACK + 1];
+  uint32_t * parts = stack_parts;
+  int * ranks = stack_ranks;
+  if(len > OPENAI_TOKENIZER_STACK){
+    parts = (uint32_t*)openai_malloc((len + 1) * sizeof(uint32_t), OPENAI_MEMORY_PARSER);
+    ranks = (int*)openai_malloc((len + 1) * sizeof(int), OPENAI_MEMORY_PARSER);
+    if(parts == NULL || ranks == NULL){
+      openai_free(parts);
+      openai_free(ranks);
+      return (len + 3) / 4;
+    }
+  }
+  // ranks[i] is the rank of parts i and i + 1 together
+  size_t n = len + 1;
+  for(size_t i = 0; i < n; i++){
+    parts[i] = i;
+  }
+  for(size_t i = 0; i < (n - 1); i++){
+    ranks[i] = ((i + 2) < n)?rank(&data[i], 2):-1;
+  }
+  while(n > 2){
+    size_t best = n;
+    for(size_t i = 0; (i + 2) < n; i++){
+      if(ranks[i] >= 0 && (best == n || ranks[i] < ranks[best])){
+        best = i;
+      }
+    }
+    if(best == n){
+      break;
+    }
+    memmove(&parts[best + 1], &parts[best + 2], (n - best - 2) * sizeof(uint32_t));
+    memmove(&ranks[best + 1], &ranks[best + 2], (n - best - 3) * sizeof(int));
+    n--;
+    ranks[best] = ((best + 2) < n)?rank(&data[parts[best]], parts[best + 2] - parts[best]):-1;
+    if(best > 0){
+      ranks[best - 1] = rank(&data[parts[best - 1]], parts[best + 1] - parts[best - 1]);
+    }
+  }
+  if(parts != stack_parts){
+    openai_free(parts);
+    openai_free(ranks);
+  }
+  return n - 1;
+}
+
+unsigned int OpenAI_Tokenizer::count(const char * text){
+  return (text != NULL)?count(text, strlen(text)):0;
+}
+
+unsigned int OpenAI_Tokenizer::count(const char * text, size_t len){
+  if(vocab == NULL){
+    return (len + 3) / 4;
+  }
+  const uint8_t * p = (const uint8_t *)text;
+  const uint8_t * end = p + len;
+  unsigned int tokens = 0;
+  while(p < end){
+    const uint8_t * s = p;
+    p = splitPiece(p, end);
+    tokens += merge(s, p - s);
+  }
+  return tokens;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "Arduino.h"
+#include "FS.h"
+
+// Byte pair encoding tokenizer for the vocabularies of the GPT models (cl100k_base and the like).
+// The vocabulary is a binary file made by extras/tokenizer_vocab.py from a .tiktoken file.
+// It is used in place: a hash table of the tokens, their offsets and their bytes. Map it from a flash
+// partition with esp_partition_mmap() and pass the pointer, or let begin() load it from a file.
+// Text is split like the cl100k pattern. Characters above ASCII count as letters, except common
+// punctuation, symbols and emoji, so counts of other text can differ slightly from the API.
+class OpenAI_Tokenizer {
+  private:
+    const uint8_t * vocab;
+    bool owned;
+    uint32_t count_len;     //Tokens, their rank is their index
+    uint32_t mask;          //Buckets of the hash table - 1
+    const uint32_t * offsets;
+    const uint32_t * table; //Rank + 1 of the token in each bucket, 0 if empty
+    const uint8_t * bytes;
+
+    int rank(const uint8_t * data, size_t len);
+    unsigned int merge(const uint8_t * data, size_t len);
+
+  public:
+    OpenAI_Tokenizer();
+    ~OpenAI_Tokenizer();
+
+    bool begin(const uint8_t * data, size_t len);                //Uses the vocabulary where it is, i.e. mapped flash. It has to stay valid
+    bool begin(fs::FS & fs, const char * path);                  //Loads the vocabulary into PSRAM if there is some, else into the heap
+    void end();
+    bool loaded(){ return vocab != NULL; }
+    unsigned int vocabularySize(){ return count_len; }
+
+    unsigned int count(const char * text);                       //Tokens of the text. About four characters per token if no vocabulary is loaded
+    unsigned int count(const char * text, size_t len);
+};
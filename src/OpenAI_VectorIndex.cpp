@@ -0,0 +1,231 @@
+#include "OpenAI_VectorIndex.h"
+
+#if defined(__has_include)
+#if __has_include("dsps_dotprod.h")
+#include "dsps_dotprod.h"
+#define OPENAI_VECTOR_USE_DSP 1
+#endif
+#endif
+
+// Rows start on 16 byte boundaries, as required by the SIMD dot product of the ESP32-S3
+#define OPENAI_VECTOR_ALIGN 16
+#define OPENAI_VECTOR_ALIGN_FLOATS (OPENAI_VECTOR_ALIGN / sizeof(float))
+
+// The allocator does not align, so blocks are taken OPENAI_VECTOR_ALIGN bytes larger and the start is
+// moved up to the next boundary. The byte before the start keeps how far it was moved
+static float * alignedAlloc(size_t size){
+  uint8_t * block = (uint8_t*)openai_malloc(size + OPENAI_VECTOR_ALIGN, OPENAI_MEMORY_CACHE);
+  if(block == NULL){
+    return NULL;
+  }
+  uint8_t * p = (uint8_t*)(((uintptr_t)block + OPENAI_VECTOR_ALIGN) & ~(uintptr_t)(OPENAI_VECTOR_ALIGN - 1));
+  p[-1] = p - block;
+  return (float*)p;
+}
+
+static void alignedFree(float * ptr){
+  uint8_t * p = (uint8_t*)ptr;
+  openai_free(p - p[-1]);
+}
+
+static float dotProduct(const float * a, const float * b, unsigned int len){
+#ifdef OPENAI_VECTOR_USE_DSP
+  float r = 0;
+  dsps_dotprod_f32(a, b, &r, len);
+  return r;
+#else
+  // Independent sums, so the FPU pipeline does not wait on every add
+  float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  unsigned int i = 0;
+  for(; (i + 4) <= len; i += 4){
+    s0 += a[i] * b[i];
+    s1 += a[i + 1] * b[i + 1];
+    s2 += a[i + 2] * b[i + 2];
+    s3 += a[i + 3] * b[i + 3];
+  }
+  for(; i < len; i++){
+    s0 += a[i] * b[i];
+  }
+  return (s0 + s1) + (s2 + s3);
+#endif
+}
+
+OpenAI_VectorIndex::OpenAI_VectorIndex(OpenAI_Vector_Metric m)
+  : matrix(NULL)
+  , dims(0)
+  , stride(0)
+  , rows(0)
+  , capacity(0)
+  , metric(m)
+  , query(NULL)
+{}
+
+OpenAI_VectorIndex::~OpenAI_VectorIndex(){
+  clear();
+}
+
+void OpenAI_VectorIndex::clear(){
+  if(matrix != NULL){
+    alignedFree(matrix);
+    matrix = NULL;
+  }
+  if(query != NULL){
+    alignedFree(query);
+    query = NULL;
+  }
+  dims = 0;
+  stride = 0;
+  rows = 0;
+  capacity = 0;
+}
+
+bool OpenAI_VectorIndex::reserve(unsigned int count){
+  if(count <= capacity){
+    return true;
+  }
+  unsigned int c = (capacity)?capacity:16;
+  while(c < count){
+    c *= 2;
+  }
+  // There is no aligned realloc, the rows are moved to the new block
+  float * m = alignedAlloc((size_t)c * stride * sizeof(float));
+  if(m == NULL){
+    log_e("Vector index could not be allocated. Rows: %u", c);
+    return false;
+  }
+  if(matrix != NULL){
+    memcpy(m, matrix, (size_t)rows * stride * sizeof(float));
+    alignedFree(matrix);
+  }
+  matrix = m;
+  capacity = c;
+  return true;
+}
+
+// Sets the dimensions with the first vector and checks the ones after it
+static bool checkDimensions(unsigned int & dims, unsigned int & stride, unsigned int len){
+  if(len == 0){
+    log_e("Empty vector");
+    return false;
+  }
+  if(dims == 0){
+    dims = len;
+    stride = (len + OPENAI_VECTOR_ALIGN_FLOATS - 1) & ~(OPENAI_VECTOR_ALIGN_FLOATS - 1);
+    return true;
+  }
+  if(len != dims){
+    log_e("Vector has %u dimensions, index has %u", len, dims);
+    return false;
+  }
+  return true;
+}
+
+static void normalize(float * row, unsigned int len){
+  float n = sqrtf(dotProduct(row, row, len));
+  if(n > 0){
+    n = 1.0f / n;
+    for(unsigned int i = 0; i < len; i++){
+      row[i] *= n;
+    }
+  }
+}
+
+int OpenAI_VectorIndex::add(const float * values, unsigned int len){
+  if(!checkDimensions(dims, stride, len) || !reserve(rows + 1)){
+    return -1;
+  }
+  float * row = &matrix[rows * stride];
+  memcpy(row, values, len * sizeof(float));
+  memset(row + len, 0, (stride - len) * sizeof(float));
+  if(metric == OPENAI_VECTOR_METRIC_COSINE){
+    normalize(row, len);
+  }
+  return rows++;
+}
+
+int OpenAI_VectorIndex::add(OpenAI_EmbeddingResponse & response){
+  int first = rows;
+  if(!response.length()){
+    return -1;
+  }
+  for(unsigned int v = 0; v < response.length(); v++){
+    unsigned int len = response.getAt(v)->len;
+    if(!checkDimensions(dims, stride, len) || !reserve(rows + response.length() - v)){
+      return -1;
+    }
+    // Converted from whatever precision the response keeps
+    float * row = &matrix[rows * stride];
+    for(unsigned int i = 0; i < len; i++){
+      row[i] = response.valueAt(v, i);
+    }
+    memset(row + len, 0, (stride - len) * sizeof(float));
+    if(metric == OPENAI_VECTOR_METRIC_COSINE){
+      normalize(row, len);
+    }
+    rows++;
+  }
+  return first;
+}
+
+unsigned int OpenAI_VectorIndex::search(const float * values, unsigned int len, OpenAI_VectorMatch * results, unsigned int k){
+  if(!rows || !k || len != dims){
+    if(rows && len != dims){
+      log_e("Query has %u dimensions, index has %u", len, dims);
+    }
+    return 0;
+  }
+  if(query == NULL){
+    query = alignedAlloc(stride * sizeof(float));
+    if(query == NULL){
+      log_e("Query could not be allocated");
+      return 0;
+    }
+  }
+  if(values != query){
+    memcpy(query, values, len * sizeof(float));
+  }
+  memset(query + len, 0, (stride - len) * sizeof(float));
+  if(metric == OPENAI_VECTOR_METRIC_COSINE){
+    normalize(query, len);
+  }
+  if(k > rows){
+    k = rows;
+  }
+  // results stays sorted, best first. Most rows fail the check against the worst kept score
+  unsigned int found = 0;
+  for(unsigned int r = 0; r < rows; r++){
+    // Padding is zero on both sides, so whole rows can be used
+    float score = dotProduct(query, &matrix[r * stride], stride);
+    if(found == k && score <= results[k - 1].score){
+      continue;
+    }
+    unsigned int i = (found < k)?found++:(k - 1);
+    while(i > 0 && results[i - 1].score < score){
+      results[i] = results[i - 1];
+      i--;
+    }
+    results[i].id = r;
+    results[i].score = score;
+  }
+  return found;
+}
+
+unsigned int OpenAI_VectorIndex::search(OpenAI_EmbeddingResponse & response, unsigned int index, OpenAI_VectorMatch * results, unsigned int k){
+  OpenAI_EmbeddingData * d = response.getAt(index);
+  if(d == NULL || d->len != dims || !rows){
+    log_e("Invalid query");
+    return 0;
+  }
+  if(query == NULL){
+    query = alignedAlloc(stride * sizeof(float));
+    if(query == NULL){
+      log_e("Query could not be allocated");
+      return 0;
+    }
+  }
+  for(unsigned int i = 0; i < d->len; i++){
+    query[i] = response.valueAt(index, i);
+  }
+  // Prepared in place by the other search
+  return search(query, d->len, results, k);
+}
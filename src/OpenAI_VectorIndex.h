@@ -0,0 +1,44 @@
+#pragma once
+#include "OpenAI.h"
+
+typedef enum {
+  OPENAI_VECTOR_METRIC_COSINE,  //Vectors and queries are normalized when they are added
+  OPENAI_VECTOR_METRIC_DOT
+} OpenAI_Vector_Metric;
+
+typedef struct {
+    unsigned int id;    //Order in which the vector was added, starting at 0
+    float score;
+} OpenAI_VectorMatch;
+
+// Embeddings kept as one contiguous, aligned float matrix for fast top-k search.
+// Uses the esp-dsp dot product where available and an unrolled loop elsewhere
+class OpenAI_VectorIndex {
+  private:
+    float * matrix;
+    unsigned int dims;
+    unsigned int stride;      //Floats per row, padded for alignment
+    unsigned int rows;
+    unsigned int capacity;
+    OpenAI_Vector_Metric metric;
+    float * query;            //Scratch row for the prepared query
+
+    bool reserve(unsigned int count);
+
+  public:
+    OpenAI_VectorIndex(OpenAI_Vector_Metric m=OPENAI_VECTOR_METRIC_COSINE);
+    ~OpenAI_VectorIndex();
+
+    int add(const float * values, unsigned int len);                 //Returns the id of the vector or -1
+    int add(OpenAI_EmbeddingResponse & response);                     //Adds all vectors of the response. Returns the id of the first one or -1
+    void clear();
+
+    unsigned int length(){ return rows; }
+    unsigned int dimensions(){ return dims; }
+    size_t memory(){ return capacity * stride * sizeof(float); }     //Bytes used by the matrix
+    const float * getAt(unsigned int id){ return (id < rows)?&matrix[id * stride]:NULL; }
+
+    //Fills results with the k best matches, best first. Returns the number of matches
+    unsigned int search(const float * values, unsigned int len, OpenAI_VectorMatch * results, unsigned int k);
+    unsigned int search(OpenAI_EmbeddingResponse & response, unsigned int index, OpenAI_VectorMatch * results, unsigned int k);
+};